@@ -2,50 +2,212 @@
 // See https://llvm.org/LICENSE.txt for license information.
 // SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
 
+// Allocator benchmarks. The same source is built as malloc_benchmark (linked
+// with mtmalloc.a) and system_malloc_benchmark (the system malloc), so that
+// the two can be compared case by case.
+//
+// Every case reports:
+//   * ops/s (items_per_second): one op is one malloc/free pair;
+//   * time/op: the inverse of ops/s, i.e. with several threads, the time per
+//     op of all threads together;
+//   * RSS: the process RSS with the working set live, in MB;
+//   * RSSAfter: the process RSS after the case freed everything, in MB.
+//
+// The cases:
+//   * BM_FixedSize/Size/Order: allocate a batch of Size-byte chunks, then
+//     free them in the given order (LIFO, FIFO or random). The sizes cover
+//     all size class ranges, from 16 bytes to the large allocations.
+//   * BM_RandomSize/Dist/Order: same with sizes drawn from a distribution.
+//   * BM_Interleaved/Dist: a steady state working set; every op frees a
+//     random live chunk and allocates a new one in its place.
+//   * BM_Threads*: a few of the above on 1 to 64 threads.
+
 #include <benchmark/benchmark.h>
-#include <thread>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "mtmalloc_util.h"
+
+namespace {
+
+enum FreeOrder { kLifo, kFifo, kRandomOrder };
+
+enum SizeDist {
+  // Uniform in [1, 256]: many small objects.
+  kSmall,
+  // Most allocations are small, with a long tail; roughly what allocation
+  // profiles of large C++ servers look like:
+  // 60% in [1, 64], 25% in (64, 512], 12% in (512, 8K], 2.9% in (8K, 256K],
+  // 0.1% in (256K, 1M] (i.e. large allocations).
+  kMixed,
+  // Log-uniform in [16, 256K]: every size class range gets the same share.
+  kLogUniform,
+};
+
+// The working sets of all threads together are about this large, unless
+// that would be more than kMaxBatch chunks per thread.
+constexpr size_t kBatchBytes = 32 << 20;
+constexpr size_t kMinBatch = 64;
+constexpr size_t kMaxBatch = 10000;
 
-void FixedSizeLoop(size_t Size, size_t NumIter) {
-  void* P[NumIter];
-  for (size_t i = 0; i < NumIter; i++) P[i] = malloc(64);
-  for (size_t i = 0; i < NumIter; i++) free(P[i]);
+size_t RandomSize(SizeDist Dist, std::mt19937_64 &R) {
+  auto Uniform = [&](size_t Lo, size_t Hi) {
+    return std::uniform_int_distribution<size_t>(Lo, Hi)(R);
+  };
+  switch (Dist) {
+  case kSmall:
+    return Uniform(1, 256);
+  case kMixed: {
+    size_t P = Uniform(0, 999);
+    if (P < 600) return Uniform(1, 64);
+    if (P < 850) return Uniform(65, 512);
+    if (P < 970) return Uniform(513, 8 << 10);
+    if (P < 999) return Uniform((8 << 10) + 1, 256 << 10);
+    return Uniform((256 << 10) + 1, 1 << 20);
+  }
+  case kLogUniform:
+    return std::exp2(std::uniform_real_distribution<double>(4, 18)(R));
+  }
+  return 0;
 }
 
-// T0: means it happens in main thread.
-// T1: one thread
-// TN: N threads
+// The per-thread input of a case, generated before the timed loop.
+struct Workload {
+  std::vector<size_t> Sizes;
+  std::vector<size_t> Order;  // Indices into Sizes / Ptrs.
+  std::vector<void *> Ptrs;
+
+  // Sizes are either all FixedSize, or drawn from Dist.
+  Workload(benchmark::State &State, size_t FixedSize, SizeDist Dist,
+           FreeOrder FO) {
+    std::mt19937_64 R(State.thread_index() + 1);
+    size_t N = FixedSize ? kBatchBytes / State.threads() / FixedSize : 0;
+    if (!FixedSize) {
+      size_t Sum = 0;
+      for (size_t I = 0; I < 100000; I++) Sum += RandomSize(Dist, R);
+      N = kBatchBytes / State.threads() / (Sum / 100000);
+    }
+    N = std::clamp(N, kMinBatch, kMaxBatch);
+    Sizes.resize(N, FixedSize);
+    if (!FixedSize)
+      for (auto &S : Sizes) S = RandomSize(Dist, R);
+    Order.resize(N);
+    for (size_t I = 0; I < N; I++) Order[I] = FO == kLifo ? N - 1 - I : I;
+    if (FO == kRandomOrder) std::shuffle(Order.begin(), Order.end(), R);
+    Ptrs.resize(N);
+  }
+};
 
-static void BM_64_T0(benchmark::State& state) {
-  for (auto _ : state) FixedSizeLoop(64, 100000);
+// Writes one byte per page, like a program initializing the chunk would, so
+// that the RSS counts every page the allocator handed out.
+void *Touch(void *P, size_t Size) {
+  for (size_t I = 0; I < Size; I += 4096) static_cast<char *>(P)[I] = 1;
+  return P;
 }
 
-template<typename CallBack>
-void RunThreads(size_t NumThreads, CallBack CB) {
-  std::thread *T[NumThreads];
-  for (size_t i = 0; i < NumThreads; i++)
-    T[i] = new std::thread(CB);
-  for (size_t i = 0; i < NumThreads; i++) {
-    T[i]->join();
-    delete T[i];
+void SetCounters(benchmark::State &State, size_t OpsPerIter, size_t Rss) {
+  State.SetItemsProcessed(State.iterations() * OpsPerIter);
+  State.counters["time/op"] = benchmark::Counter(
+      OpsPerIter, benchmark::Counter::kIsIterationInvariantRate |
+                      benchmark::Counter::kInvert);
+  // RSS is per process: report it once.
+  if (State.thread_index() == 0) {
+    State.counters["RSS"] = Rss >> 20;
+    State.counters["RSSAfter"] = MTMalloc::GetRss() >> 20;
   }
 }
 
-template <size_t NumThreads>
-static void BM_64(benchmark::State& state) {
-  for (auto _ : state)
-    RunThreads(NumThreads, []() { FixedSizeLoop(64, 100000); });
+// Allocates the whole batch, then frees it in W.Order.
+void AllocThenFree(benchmark::State &State, Workload &W) {
+  size_t N = W.Sizes.size(), Rss = 0;
+  for (auto _ : State) {
+    for (size_t I = 0; I < N; I++) W.Ptrs[I] = Touch(malloc(W.Sizes[I]), W.Sizes[I]);
+    benchmark::DoNotOptimize(W.Ptrs.data());
+    if (!Rss) Rss = MTMalloc::GetRss();
+    for (size_t I = 0; I < N; I++) free(W.Ptrs[W.Order[I]]);
+    benchmark::ClobberMemory();
+  }
+  SetCounters(State, N, Rss);
 }
-static void BM_64_T1(benchmark::State& state) { BM_64<1>(state); }
-static void BM_64_T4(benchmark::State& state) { BM_64<4>(state); }
-static void BM_64_T16(benchmark::State& state) { BM_64<16>(state); }
-static void BM_64_T64(benchmark::State& state) { BM_64<64>(state); }
 
-// Register the function as a benchmark
-BENCHMARK(BM_64_T0);
-BENCHMARK(BM_64_T1);
-BENCHMARK(BM_64_T4);
-BENCHMARK(BM_64_T16);
-BENCHMARK(BM_64_T64);
+void BM_FixedSize(benchmark::State &State) {
+  Workload W(State, State.range(0), kSmall,
+             static_cast<FreeOrder>(State.range(1)));
+  AllocThenFree(State, W);
+}
+
+void BM_RandomSize(benchmark::State &State) {
+  Workload W(State, 0, static_cast<SizeDist>(State.range(0)),
+             static_cast<FreeOrder>(State.range(1)));
+  AllocThenFree(State, W);
+}
+
+// The working set is kept live across iterations; every op replaces the
+// chunk in a random slot with one of a new random size.
+void BM_Interleaved(benchmark::State &State) {
+  Workload W(State, 0, static_cast<SizeDist>(State.range(0)), kRandomOrder);
+  size_t N = W.Sizes.size(), Rss = 0;
+  for (size_t I = 0; I < N; I++)
+    W.Ptrs[I] = Touch(malloc(W.Sizes[I]), W.Sizes[I]);
+  for (auto _ : State) {
+    for (size_t I = 0; I < N; I++) {
+      size_t Slot = W.Order[I];
+      free(W.Ptrs[Slot]);
+      // Shifted, so that the slot does not get its old size back.
+      size_t Size = W.Sizes[(Slot + I) % N];
+      W.Ptrs[Slot] = Touch(malloc(Size), Size);
+    }
+    benchmark::DoNotOptimize(W.Ptrs.data());
+    if (!Rss) Rss = MTMalloc::GetRss();
+  }
+  for (size_t I = 0; I < N; I++) free(W.Ptrs[I]);
+  SetCounters(State, N, Rss);
+}
+
+void FixedSizeArgs(benchmark::internal::Benchmark *B) {
+  for (int64_t Size = 16; Size <= (1 << 20); Size *= 4)
+    for (int64_t FO : {kLifo, kFifo, kRandomOrder}) B->Args({Size, FO});
+  // The largest size class and just above it.
+  for (int64_t Size : {262144, 262145}) B->Args({Size, kLifo});
+}
+
+void DistArgs(benchmark::internal::Benchmark *B) {
+  for (int64_t D : {kSmall, kMixed, kLogUniform})
+    for (int64_t FO : {kLifo, kFifo, kRandomOrder}) B->Args({D, FO});
+}
+
+}  // namespace
+
+BENCHMARK(BM_FixedSize)->Apply(FixedSizeArgs)->ArgNames({"size", "order"});
+BENCHMARK(BM_RandomSize)->Apply(DistArgs)->ArgNames({"dist", "order"});
+BENCHMARK(BM_Interleaved)
+    ->DenseRange(kSmall, kLogUniform)
+    ->ArgNames({"dist"});
+
+// The multi-threaded cases.
+BENCHMARK(BM_FixedSize)
+    ->Name("BM_ThreadsFixedSize")
+    ->Args({64, kLifo})
+    ->ArgNames({"size", "order"})
+    ->ThreadRange(1, 64)
+    ->UseRealTime();
+BENCHMARK(BM_RandomSize)
+    ->Name("BM_ThreadsRandomSize")
+    ->Args({kMixed, kRandomOrder})
+    ->ArgNames({"dist", "order"})
+    ->ThreadRange(1, 64)
+    ->UseRealTime();
+BENCHMARK(BM_Interleaved)
+    ->Name("BM_ThreadsInterleaved")
+    ->Arg(kMixed)
+    ->ArgNames({"dist"})
+    ->ThreadRange(1, 64)
+    ->UseRealTime();
 
 BENCHMARK_MAIN();
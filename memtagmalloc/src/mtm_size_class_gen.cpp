@@ -0,0 +1,173 @@
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+// Generates a size class table tuned for an allocation size histogram, to be
+// loaded at startup with MTM_SIZE_CLASSES=<file>.
+//
+// The inputs are allocation traces (see mtm_trace_start()) and/or text
+// histograms, one "<size> <count>" per line (e.g. from -d). The sizes up to
+// 256 and the largest size class are fixed; the other size classes are
+// chosen, by dynamic programming over the requested sizes, to minimize the
+// expected waste of an allocation: the slack (chunk size minus requested
+// size) plus its share of the unusable tail of the SuperPage. Only sizes
+// that satisfy IsCorrectDivToMul are used, and the powers of two are kept.
+//
+// Usage: mtm_size_class_gen [-c] [-d] [-o OUTPUT] INPUT...
+//   -c: write the table as the C++ initializer of SCArray.
+//   -d: write the merged histogram of the inputs instead.
+//   -o: write to OUTPUT instead of stdout.
+
+#include "mtmalloc_size_class_gen.h"
+#include "mtmalloc_trace.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+using namespace MTMalloc;
+
+namespace {
+
+bool LoadTrace(const char *File, const void *Map, size_t Size, SizeHistogram &H) {
+  auto *Header = static_cast<const TraceHeader *>(Map);
+  if (Header->Version != kTraceVersion) {
+    fprintf(stderr, "%s: unsupported trace version %u\n", File,
+            Header->Version);
+    return false;
+  }
+  TraceReader R(Header, static_cast<const uint8_t *>(Map) + Size);
+  TraceEvent E;
+  while (R.Next(&E)) {
+    if (E.Op == kTraceFree) continue;
+    size_t Size = E.Size;
+    // Like posix_memalign().
+    if (E.Op == kTraceMemalign && E.Alignment > 16)
+      Size = RoundUpTo(Size, E.Alignment);
+    AddSize(H, Size, 1);
+  }
+  if (!R.Done()) fprintf(stderr, "%s: truncated\n", File);
+  return true;
+}
+
+bool LoadHistogram(const char *File, const char *Text, size_t Len,
+                   SizeHistogram &H) {
+  size_t LineNo = 0;
+  for (const char *P = Text, *End = Text + Len; P < End;) {
+    const char *Eol = static_cast<const char *>(memchr(P, '\n', End - P));
+    if (!Eol) Eol = End;
+    std::string Line(P, Eol);
+    P = Eol + 1;
+    LineNo++;
+    size_t Hash = Line.find('#');
+    if (Hash != std::string::npos) Line.resize(Hash);
+    if (Line.find_first_not_of(" \t\r") == std::string::npos) continue;
+    unsigned long long Size, Count;
+    char Extra;
+    if (sscanf(Line.c_str(), "%llu %llu %c", &Size, &Count, &Extra) != 2) {
+      fprintf(stderr, "%s:%zd: expected \"<size> <count>\"\n", File, LineNo);
+      return false;
+    }
+    AddSize(H, Size, Count);
+  }
+  return true;
+}
+
+bool LoadInput(const char *File, SizeHistogram &H) {
+  int Fd = open(File, O_RDONLY | O_CLOEXEC);
+  struct stat St;
+  if (Fd < 0 || fstat(Fd, &St)) {
+    perror(File);
+    return false;
+  }
+  size_t Size = St.st_size;
+  if (!Size) {
+    close(Fd);
+    return true;
+  }
+  void *Map = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, Fd, 0);
+  close(Fd);
+  if (Map == MAP_FAILED) {
+    perror(File);
+    return false;
+  }
+  bool Res = Size >= sizeof(TraceHeader) &&
+                     !memcmp(Map, kTraceMagic, sizeof(kTraceMagic))
+                 ? LoadTrace(File, Map, Size, H)
+                 : LoadHistogram(File, static_cast<const char *>(Map), Size,
+                                 H);
+  munmap(Map, Size);
+  return Res;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  bool AsCpp = false, DumpHistogram = false;
+  const char *Output = nullptr;
+  int Opt;
+  while ((Opt = getopt(argc, argv, "cdo:")) != -1) {
+    if (Opt == 'c') AsCpp = true;
+    else if (Opt == 'd') DumpHistogram = true;
+    else if (Opt == 'o') Output = optarg;
+    else optind = argc + 1;
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: %s [-c] [-d] [-o OUTPUT] INPUT...\n", argv[0]);
+    return 1;
+  }
+  SizeHistogram H;
+  for (int I = optind; I < argc; I++)
+    if (!LoadInput(argv[I], H)) return 1;
+  FILE *Out = Output ? fopen(Output, "w") : stdout;
+  if (!Out) {
+    perror(Output);
+    return 1;
+  }
+
+  if (DumpHistogram) {
+    for (auto &P : H) fprintf(Out, "%zd %zd\n", P.first, (size_t)P.second);
+    return fclose(Out) != 0;
+  }
+
+  uint64_t NumAllocs = 0, NumTuned = 0;
+  for (auto &P : H) {
+    NumAllocs += P.second;
+    if (P.first >= kMinTunedSize && P.first <= kMaxSizeClass)
+      NumTuned += P.second;
+  }
+  size_t Sizes[kNumSizeClasses];
+  MakeTable(ChooseSizeClasses(H, kNumSizeClasses - kNumFixedClasses), Sizes);
+  if (const char *Error = CheckSizeClasses(Sizes)) {
+    fprintf(stderr, "Bad size class table: %s\n", Error);
+    return 1;
+  }
+  Waste Default = ComputeWaste(H, SCArray), Tuned = ComputeWaste(H, Sizes);
+  fprintf(stderr,
+          "%zd allocations, %zd of %zd..%zd bytes: slack %.0fK tail %.0fK "
+          "(%.2f%%), with the default table: slack %.0fK tail %.0fK "
+          "(%.2f%%)\n",
+          (size_t)NumAllocs, (size_t)NumTuned, kMinTunedSize, kMaxSizeClass,
+          Tuned.Slack / 1024, Tuned.Tail / 1024, Tuned.Percent(),
+          Default.Slack / 1024, Default.Tail / 1024, Default.Percent());
+
+  const char *Prefix = AsCpp ? "//" : "#";
+  fprintf(Out,
+          "%s Generated by mtm_size_class_gen from %zd allocations.\n"
+          "%s Waste (slack and SuperPage tails) of those of %zd..%zd bytes:\n"
+          "%s %.2f%% of the requested bytes (%.2f%% with the default "
+          "table).\n",
+          Prefix, (size_t)NumAllocs, Prefix, kMinTunedSize, kMaxSizeClass,
+          Prefix, Tuned.Percent(), Default.Percent());
+  if (AsCpp) fprintf(Out, "constexpr size_t SCArray[] = {\n");
+  for (size_t I = 0; I < kNumSizeClasses; I++)
+    fprintf(Out, "%s%zd%s%s", I % 8 ? " " : AsCpp ? "    " : "", Sizes[I],
+            AsCpp ? "," : "", I % 8 == 7 || I + 1 == kNumSizeClasses ? "\n" : "");
+  if (AsCpp) fprintf(Out, "};\n");
+  return fclose(Out) != 0;
+}
@@ -0,0 +1,209 @@
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+// Reads a heap snapshot written by mtm_heap_snapshot() and prints, per size
+// class:
+//   * the resident bytes and how much of them is used, quarantined and free;
+//   * the fragmentation: the share of the resident bytes not used by live
+//     chunks;
+//   * the quarantine composition: the share of all quarantined bytes that
+//     sit in this size class;
+//   * the release potential: the resident bytes in pages that contain only
+//     available chunks (releasable now), and those that would, once the next
+//     scan recycles the quarantine.
+//
+// Usage: mtm_snapshot_reader SNAPSHOT_FILE [-v]
+//   -v: also print one line per SuperPage.
+
+#include "mtmalloc_snapshot.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+using namespace MTMalloc;
+
+namespace {
+
+struct ClassStats {
+  size_t NumSuperPages = 0;
+  size_t ResidentBytes = 0;
+  size_t UsedBytes = 0;
+  size_t QuarantinedBytes = 0;
+  size_t AvailableBytes = 0;
+  size_t ReleasableNow = 0;
+  size_t ReleasableAfterScan = 0;
+
+  void Add(const ClassStats &O) {
+    NumSuperPages += O.NumSuperPages;
+    ResidentBytes += O.ResidentBytes;
+    UsedBytes += O.UsedBytes;
+    QuarantinedBytes += O.QuarantinedBytes;
+    AvailableBytes += O.AvailableBytes;
+    ReleasableNow += O.ReleasableNow;
+    ReleasableAfterScan += O.ReleasableAfterScan;
+  }
+};
+
+bool IsUsed(uint8_t S) {
+  return S == kSnapshotUsedMixed || S == kSnapshotUsedData;
+}
+bool IsQuarantined(uint8_t S) {
+  return S == kSnapshotQuarantined || S == kSnapshotMarked;
+}
+bool IsAvailable(uint8_t S) {
+  return S == kSnapshotAvailable || S == kSnapshotReleasing;
+}
+
+double Percent(size_t A, size_t B) { return B ? 100.0 * A / B : 0; }
+
+bool Read(FILE *F, void *Buf, size_t Size) {
+  return fread(Buf, 1, Size, F) == Size;
+}
+
+// Accounts one SuperPage. A resident page is releasable if every chunk
+// overlapping it is available (or, after a scan, available or quarantined).
+// The pages with no chunk are never released, nor are, in RangeNum 0, the
+// ones with the state array (see SizeOfInlineMeta()) after the chunks.
+void ProcessSuperPage(const SnapshotHeader &H, size_t ChunkSize,
+                      size_t RangeNum, const uint8_t *State, size_t NumChunks,
+                      const uint8_t *Resident, ClassStats *CS) {
+  CS->NumSuperPages++;
+  for (size_t I = 0; I < NumChunks; I++) {
+    if (IsUsed(State[I])) CS->UsedBytes += ChunkSize;
+    else if (IsQuarantined(State[I])) CS->QuarantinedBytes += ChunkSize;
+    else if (IsAvailable(State[I])) CS->AvailableBytes += ChunkSize;
+  }
+  size_t NumPages = H.SuperPageSize / H.PageSize;
+  size_t ChunksEnd = NumChunks * ChunkSize;
+  for (size_t Page = 0; Page < NumPages; Page++) {
+    if (!(Resident[Page / 8] & (1 << (Page % 8)))) continue;
+    CS->ResidentBytes += H.PageSize;
+    size_t Beg = Page * H.PageSize, End = Beg + H.PageSize;
+    bool FreeNow = Beg < ChunksEnd && (RangeNum || End <= ChunksEnd);
+    bool FreeAfterScan = FreeNow;
+    for (size_t I = Beg / ChunkSize; I < NumChunks && I * ChunkSize < End;
+         I++) {
+      FreeNow &= IsAvailable(State[I]);
+      FreeAfterScan &= !IsUsed(State[I]);
+    }
+    if (FreeNow) CS->ReleasableNow += H.PageSize;
+    if (FreeAfterScan) CS->ReleasableAfterScan += H.PageSize;
+  }
+}
+
+void PrintRow(const char *Name, size_t ChunkSize, const ClassStats &CS,
+              size_t TotalQuarantined) {
+  printf("%-6s %8zd %5zd %10zdK %10zdK %10zdK %10zdK %6.1f%% %6.1f%% "
+         "%10zdK %10zdK\n",
+         Name, ChunkSize, CS.NumSuperPages, CS.ResidentBytes >> 10,
+         CS.UsedBytes >> 10, CS.QuarantinedBytes >> 10,
+         CS.AvailableBytes >> 10,
+         Percent(CS.ResidentBytes - std::min(CS.UsedBytes, CS.ResidentBytes),
+                 CS.ResidentBytes),
+         Percent(CS.QuarantinedBytes, TotalQuarantined),
+         CS.ReleasableNow >> 10, CS.ReleasableAfterScan >> 10);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s SNAPSHOT_FILE [-v]\n", argv[0]);
+    return 1;
+  }
+  bool Verbose = argc > 2 && !strcmp(argv[2], "-v");
+  FILE *F = fopen(argv[1], "rb");
+  if (!F) {
+    perror(argv[1]);
+    return 1;
+  }
+  SnapshotHeader H;
+  if (!Read(F, &H, sizeof(H)) ||
+      memcmp(H.Magic, kSnapshotMagic, sizeof(H.Magic))) {
+    fprintf(stderr, "%s: not a heap snapshot\n", argv[1]);
+    return 1;
+  }
+  if (H.Version != kSnapshotVersion || !H.PageSize ||
+      H.SuperPageSize % H.PageSize) {
+    fprintf(stderr, "%s: unsupported snapshot version %u\n", argv[1],
+            H.Version);
+    return 1;
+  }
+  std::vector<SnapshotSizeClass> Classes(H.NumSizeClasses);
+  if (!Read(F, Classes.data(), Classes.size() * sizeof(Classes[0]))) {
+    fprintf(stderr, "%s: truncated\n", argv[1]);
+    return 1;
+  }
+  // The chunk sizes are divided by, and all the chunks of a SuperPage must
+  // fit into it.
+  for (size_t SC = 0; SC < H.NumSizeClasses; SC++) {
+    const SnapshotSizeClass &C = Classes[SC];
+    if (!C.ChunkSize || C.ChunkSize > H.SuperPageSize ||
+        C.NumChunks > H.SuperPageSize / C.ChunkSize) {
+      fprintf(stderr, "%s: corrupt size class %zd (chunk size %u)\n", argv[1],
+              SC, C.ChunkSize);
+      return 1;
+    }
+  }
+  std::vector<ClassStats> Stats(H.NumSizeClasses);
+  std::vector<uint8_t> State, Tags;
+  std::vector<uint8_t> Resident(H.SuperPageSize / H.PageSize / 8);
+  for (size_t I = 0; I < H.NumSuperPages; I++) {
+    SnapshotSuperPage S;
+    if (!Read(F, &S, sizeof(S)) || S.SizeClass >= H.NumSizeClasses ||
+        S.NumChunks > Classes[S.SizeClass].NumChunks) {
+      fprintf(stderr, "%s: truncated or corrupt at SuperPage %zd\n", argv[1],
+              I);
+      return 1;
+    }
+    State.resize(S.NumChunks);
+    Tags.resize(S.NumChunks);
+    if (!Read(F, State.data(), S.NumChunks) ||
+        ((H.Flags & kSnapshotHasTags) && !Read(F, Tags.data(), S.NumChunks)) ||
+        !Read(F, Resident.data(), Resident.size())) {
+      fprintf(stderr, "%s: truncated at SuperPage %zd\n", argv[1], I);
+      return 1;
+    }
+    ClassStats SP;
+    ProcessSuperPage(H, Classes[S.SizeClass].ChunkSize, S.RangeNum,
+                     State.data(), S.NumChunks, Resident.data(), &SP);
+    if (Verbose) {
+      printf("SP %#zx range %u class %u: resident %zdK used %zdK "
+             "quarantined %zdK releasable %zdK",
+             static_cast<size_t>(S.Address), S.RangeNum, S.SizeClass,
+             SP.ResidentBytes >> 10, SP.UsedBytes >> 10,
+             SP.QuarantinedBytes >> 10, SP.ReleasableNow >> 10);
+      if (H.Flags & kSnapshotHasTags) {
+        size_t Tagged = 0;
+        for (uint8_t T : Tags) Tagged += T != 0;
+        printf(" tagged %zd/%u", Tagged, S.NumChunks);
+      }
+      printf("\n");
+    }
+    Stats[S.SizeClass].Add(SP);
+  }
+  fclose(F);
+
+  ClassStats Total;
+  for (const ClassStats &CS : Stats) Total.Add(CS);
+  printf("RSS: %zdK SuperPages: %u Large: live %zdK quarantined %zdK "
+         "cached %zdK\n",
+         static_cast<size_t>(H.Rss >> 10), H.NumSuperPages,
+         static_cast<size_t>(H.LargeLiveBytes >> 10),
+         static_cast<size_t>(H.LargeQuarantinedBytes >> 10),
+         static_cast<size_t>(H.LargeCachedBytes >> 10));
+  printf("%-6s %8s %5s %11s %11s %11s %11s %7s %7s %11s %11s\n", "class",
+         "chunk", "SPs", "resident", "used", "quarantine", "available",
+         "frag", "q-share", "rel-now", "rel-scan");
+  char Name[16];
+  for (size_t SC = 0; SC < H.NumSizeClasses; SC++) {
+    if (!Stats[SC].NumSuperPages) continue;
+    snprintf(Name, sizeof(Name), "%zd", SC);
+    PrintRow(Name, Classes[SC].ChunkSize, Stats[SC], Total.QuarantinedBytes);
+  }
+  PrintRow("total", 0, Total, Total.QuarantinedBytes);
+}
@@ -0,0 +1,331 @@
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+// Replays allocation traces recorded with mtm_trace_start() (or MTM_TRACE),
+// one thread per trace file, against the allocator it is linked with:
+// mtm_trace_replay uses MemTagMalloc, system_trace_replay the system malloc.
+//
+// The files are mapped and decoded up front. Their events are merged by time
+// to give every allocation an object ID, so that a free() on one thread of an
+// object allocated on another one waits for that allocation. Each thread
+// replays the same calls, in the same order, on every run.
+//
+// Reports the replay time, the RSS over time and the peaks of the RSS, of
+// the live bytes and of the overhead: the RSS on top of the baseline (the
+// RSS before the replay) and of the live bytes, i.e. the allocator metadata,
+// the fragmentation and, for MemTagMalloc, the quarantine.
+//
+// Usage: mtm_trace_replay [-i INTERVAL_MS] [-n] TRACE_FILE...
+//   -i: sample the RSS every INTERVAL_MS milliseconds (default 10).
+//   -n: don't write to the allocated memory (by default, one byte per page
+//       is written, so that the RSS counts every page handed out).
+
+#include "mtmalloc_trace.h"
+#include "mtmalloc_util.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace MTMalloc;
+
+namespace {
+
+constexpr uint32_t kNoObject = ~0U;
+
+struct ReplayOp {
+  uint64_t Size;
+  uint32_t Alignment;
+  uint32_t Obj;  // The allocated one.
+  uint32_t OldObj;  // The freed one, or kNoObject if unknown.
+  TraceOp Op;
+};
+
+struct ReplayThread {
+  std::vector<ReplayOp> Ops;
+  size_t NumWaits = 0;
+  // Updated by the thread, read by the sampler. Padded rather than aligned:
+  // no aligned operator new, which not every allocator replaces.
+  char Pad[64];
+  std::atomic<int64_t> LiveBytes{0};
+};
+
+// One end of an event, for the merge: the freeing part (free, the start of a
+// realloc) or the allocating part.
+struct MergeKey {
+  uint64_t Ticks;
+  uint32_t Thread, Idx;
+  bool Alloc;
+  uintptr_t Addr;
+
+  bool operator<(const MergeKey &O) const {
+    if (Ticks != O.Ticks) return Ticks < O.Ticks;
+    if (Alloc != O.Alloc) return !Alloc;  // Frees first.
+    if (Thread != O.Thread) return Thread < O.Thread;
+    return Idx < O.Idx;
+  }
+};
+
+struct Sample {
+  uint64_t TimeNs;
+  size_t Rss;
+  int64_t LiveBytes;
+};
+
+uint64_t NowNs() {
+  struct timespec TS;
+  clock_gettime(CLOCK_MONOTONIC, &TS);
+  return TS.tv_sec * 1000000000UL + TS.tv_nsec;
+}
+
+// Maps File and decodes its events into T, and their ends into Keys.
+bool LoadTrace(const char *File, uint32_t ThreadIdx, ReplayThread *T,
+               std::vector<MergeKey> *Keys) {
+  int Fd = open(File, O_RDONLY | O_CLOEXEC);
+  struct stat St;
+  if (Fd < 0 || fstat(Fd, &St)) {
+    perror(File);
+    return false;
+  }
+  size_t Size = St.st_size;
+  if (Size < sizeof(TraceHeader)) {
+    fprintf(stderr, "%s: not a trace\n", File);
+    return false;
+  }
+  void *Map = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, Fd, 0);
+  close(Fd);
+  if (Map == MAP_FAILED) {
+    perror(File);
+    return false;
+  }
+  auto *H = static_cast<const TraceHeader *>(Map);
+  if (memcmp(H->Magic, kTraceMagic, sizeof(H->Magic)) ||
+      H->Version != kTraceVersion) {
+    fprintf(stderr, "%s: not a trace, or an unsupported version\n", File);
+    return false;
+  }
+  TraceReader R(H, static_cast<const uint8_t *>(Map) + Size);
+  TraceEvent E;
+  while (R.Next(&E)) {
+    uint32_t Idx = T->Ops.size();
+    ReplayOp Op = {E.Size, static_cast<uint32_t>(E.Alignment), kNoObject,
+                   kNoObject, E.Op};
+    T->Ops.push_back(Op);
+    if (E.Op == kTraceFree || E.Op == kTraceRealloc)
+      Keys->push_back({E.Ticks, ThreadIdx, Idx, false, E.OldAddr});
+    if (E.Op != kTraceFree)
+      Keys->push_back({E.EndTicks, ThreadIdx, Idx, true, E.Addr});
+  }
+  if (!R.Done())
+    fprintf(stderr, "%s: truncated after %zd events\n", File, T->Ops.size());
+  munmap(Map, Size);
+  return true;
+}
+
+// Gives every allocation an object ID and every free the ID of the object it
+// frees. Returns the number of objects.
+uint32_t AssignObjects(std::vector<MergeKey> &Keys,
+                       std::vector<ReplayThread> &Threads,
+                       size_t *NumUnknownFrees) {
+  std::sort(Keys.begin(), Keys.end());
+  std::unordered_map<uintptr_t, uint32_t> Live;
+  uint32_t NumObjects = 0;
+  for (const MergeKey &K : Keys) {
+    ReplayOp &Op = Threads[K.Thread].Ops[K.Idx];
+    if (K.Alloc) {
+      Op.Obj = NumObjects;
+      Live[K.Addr] = NumObjects++;
+      continue;
+    }
+    auto It = Live.find(K.Addr);
+    if (It == Live.end()) {
+      // Allocated before the recording started.
+      (*NumUnknownFrees)++;
+      continue;
+    }
+    Op.OldObj = It->second;
+    Live.erase(It);
+  }
+  return NumObjects;
+}
+
+void Touch(void *P, size_t Size) {
+  for (size_t I = 0; I < Size; I += 4096) static_cast<char *>(P)[I] = 1;
+}
+
+struct Replayer {
+  std::vector<ReplayThread> &Threads;
+  std::unique_ptr<std::atomic<void *>[]> Objects;
+  std::unique_ptr<uint64_t[]> ObjectSizes;
+  bool TouchMemory;
+  std::atomic<size_t> NumReady{0};
+
+  Replayer(std::vector<ReplayThread> &Threads, uint32_t NumObjects,
+           bool TouchMemory)
+      : Threads(Threads), Objects(new std::atomic<void *>[NumObjects]()),
+        ObjectSizes(new uint64_t[NumObjects]()), TouchMemory(TouchMemory) {}
+
+  // Waits for the allocation of Obj, possibly on another thread.
+  void *Get(uint32_t Obj, ReplayThread &T) {
+    void *Res = Objects[Obj].load(std::memory_order_acquire);
+    if (Res) return Res;
+    T.NumWaits++;
+    while (!(Res = Objects[Obj].load(std::memory_order_acquire)))
+      sched_yield();
+    return Res;
+  }
+
+  void Set(uint32_t Obj, void *Ptr, uint64_t Size, ReplayThread &T) {
+    if (TouchMemory) Touch(Ptr, Size);
+    ObjectSizes[Obj] = Size;
+    T.LiveBytes.fetch_add(Size, std::memory_order_relaxed);
+    Objects[Obj].store(Ptr, std::memory_order_release);
+  }
+
+  void Run(size_t ThreadIdx) {
+    ReplayThread &T = Threads[ThreadIdx];
+    NumReady++;
+    while (NumReady < Threads.size()) sched_yield();
+    for (const ReplayOp &Op : T.Ops) {
+      void *Old = nullptr;
+      if (Op.OldObj != kNoObject) {
+        Old = Get(Op.OldObj, T);
+        T.LiveBytes.fetch_sub(ObjectSizes[Op.OldObj],
+                              std::memory_order_relaxed);
+      }
+      void *New = nullptr;
+      switch (Op.Op) {
+      case kTraceMalloc:
+        New = malloc(Op.Size);
+        break;
+      case kTraceCalloc:
+        New = calloc(1, Op.Size);
+        break;
+      case kTraceFree:
+        if (Old) free(Old);
+        break;
+      case kTraceRealloc:
+        New = realloc(Old, Op.Size);
+        break;
+      case kTraceMemalign:
+        if (posix_memalign(&New, Op.Alignment, Op.Size)) New = nullptr;
+        break;
+      }
+      if (Op.Obj != kNoObject) {
+        if (!New) {
+          fprintf(stderr, "Allocation of %zd bytes failed\n", (size_t)Op.Size);
+          abort();
+        }
+        Set(Op.Obj, New, Op.Size, T);
+      }
+    }
+  }
+};
+
+void PrintMB(const char *Name, int64_t Bytes) {
+  printf("%-16s %10.1fM\n", Name, Bytes / 1048576.0);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t IntervalMs = 10;
+  bool TouchMemory = true;
+  int Opt;
+  while ((Opt = getopt(argc, argv, "i:n")) != -1) {
+    if (Opt == 'i') IntervalMs = std::max(1L, atol(optarg));
+    else if (Opt == 'n') TouchMemory = false;
+    else optind = argc + 1;
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: %s [-i INTERVAL_MS] [-n] TRACE_FILE...\n",
+            argv[0]);
+    return 1;
+  }
+
+  std::vector<ReplayThread> Threads(argc - optind);
+  std::vector<MergeKey> Keys;
+  for (int I = optind; I < argc; I++)
+    if (!LoadTrace(argv[I], I - optind, &Threads[I - optind], &Keys))
+      return 1;
+  size_t NumUnknownFrees = 0;
+  uint32_t NumObjects = AssignObjects(Keys, Threads, &NumUnknownFrees);
+  std::vector<MergeKey>().swap(Keys);
+  size_t NumOps = 0;
+  for (ReplayThread &T : Threads) NumOps += T.Ops.size();
+
+  Replayer R(Threads, NumObjects, TouchMemory);
+  std::vector<Sample> Samples;
+  Samples.reserve(1 << 16);
+  std::atomic<bool> Done(false);
+  size_t BaselineRss = MTMalloc::GetRss();
+  uint64_t Beg = NowNs();
+  // Samples the RSS, and the live bytes, until the replay is done.
+  std::thread Sampler([&] {
+    while (!Done) {
+      int64_t Live = 0;
+      for (ReplayThread &T : Threads)
+        Live += T.LiveBytes.load(std::memory_order_relaxed);
+      Samples.push_back({NowNs() - Beg, MTMalloc::GetRss(), Live});
+      usleep(IntervalMs * 1000);
+    }
+  });
+  std::vector<std::thread> Workers;
+  for (size_t I = 0; I < Threads.size(); I++)
+    Workers.emplace_back([&R, I] { R.Run(I); });
+  for (std::thread &W : Workers) W.join();
+  uint64_t TimeNs = NowNs() - Beg;
+  Done = true;
+  Sampler.join();
+
+  int64_t Live = 0;
+  size_t NumWaits = 0;
+  for (ReplayThread &T : Threads) {
+    Live += T.LiveBytes.load();
+    NumWaits += T.NumWaits;
+  }
+  Samples.push_back({TimeNs, MTMalloc::GetRss(), Live});
+  size_t PeakRss = 0;
+  int64_t PeakLive = 0, PeakOverhead = 0;
+  for (const Sample &S : Samples) {
+    int64_t Overhead = S.Rss - BaselineRss - S.LiveBytes;
+    PeakRss = std::max(PeakRss, S.Rss);
+    PeakLive = std::max(PeakLive, S.LiveBytes);
+    PeakOverhead = std::max(PeakOverhead, Overhead);
+  }
+
+  printf("threads %zd ops %zd objects %u unknown_frees %zd waits %zd\n",
+         Threads.size(), NumOps, NumObjects, NumUnknownFrees, NumWaits);
+  printf("time %.1fms (%.1fns/op)\n", TimeNs / 1e6,
+         NumOps ? static_cast<double>(TimeNs) / NumOps : 0.0);
+  PrintMB("baseline_rss", BaselineRss);
+  PrintMB("peak_rss", PeakRss);
+  PrintMB("final_rss", Samples.back().Rss);
+  PrintMB("peak_live", PeakLive);
+  PrintMB("final_live", Live);
+  PrintMB("peak_overhead", PeakOverhead);
+  // At most ~50 lines: the maximum RSS of each group of samples.
+  size_t Step = (Samples.size() + 49) / 50;
+  printf("%10s %10s %10s\n", "time_ms", "rss_mb", "live_mb");
+  for (size_t I = 0; I < Samples.size(); I += Step) {
+    Sample Max = Samples[I];
+    for (size_t J = I; J < std::min(I + Step, Samples.size()); J++)
+      if (Samples[J].Rss > Max.Rss) Max = Samples[J];
+    printf("%10.1f %10.1f %10.1f\n", Max.TimeNs / 1e6, Max.Rss / 1048576.0,
+           Max.LiveBytes / 1048576.0);
+  }
+}
@@ -8,6 +8,10 @@
 
 #include "mtmalloc.h"
 #include "mtmalloc_large.h"
+#include "mtmalloc_interface.h"
+#include "mtmalloc_trace.h"
+#include <errno.h>
+#include <malloc.h>
 #include <stdlib.h>
 
 #define ALIAS(x) __attribute__((alias(x)))
@@ -18,28 +22,340 @@ static MTMalloc::LargeAllocator large;
 namespace MTMalloc {
 MallocConfig Config;
 Allocator *Allocator::SingletonSelf = &allocator;
+LargeAllocator *Allocator::Large = &large;
 pthread_key_t Allocator::TSDKey;
 pthread_once_t Allocator::TSDOKeyOnce = PTHREAD_ONCE_INIT;
 }
 
+// Serializes the writes to Config (mtm_ctl(), mtm_trace_start()): the
+// fields share words.
+static pthread_mutex_t CtlMu = PTHREAD_MUTEX_INITIALIZER;
+
+static void StartMemoryReleaseThread() {
+  static pthread_once_t Once = PTHREAD_ONCE_INIT;
+  pthread_once(&Once, [] {
+    pthread_t t;
+    pthread_create(&t, nullptr, MTMalloc::Allocator::MemoryReleaseThread,
+                   nullptr);
+    pthread_detach(t);
+  });
+}
 
 struct InitAndExit {
   InitAndExit() {
     MTMalloc::Config.Init();
-    if (MTMalloc::Config.ReleaseFreq) {
+    if (MTMalloc::Config.ReleaseFreq)
+      StartMemoryReleaseThread();
+    if (MTMalloc::Config.MonitorPressure) {
       pthread_t t;
-      pthread_create(&t, nullptr, MTMalloc::Allocator::MemoryReleaseThread,
+      pthread_create(&t, nullptr, MTMalloc::Allocator::PressureMonitorThread,
                      nullptr);
       pthread_detach(t);
     }
+    if (const char *Prefix = getenv("MTM_TRACE"))
+      mtm_trace_start(Prefix);
   }
   ~InitAndExit() {
+    mtm_trace_stop();
     if (MTMalloc::Config.PrintStats)
       allocator.PrintAll();
+    if (MTMalloc::Config.LeakCheckAtExit && mtm_leak_check())
+      _exit(23);  // Like LSan.
   }
 };
 static InitAndExit at_exit;
 
+// Large chunks don't have address tags, so their memory tag is 0 while they
+// are live, and kLargeFreedTag after they are freed (with MTM_USE_SHADOW).
+static const uint8_t kLargeFreedTag = 0xff;
+
+static void *AllocateLarge(size_t Size, size_t Alignment = 4096) {
+  MTMalloc::TLS.LatencyPath = MTMalloc::kMallocLarge;
+  MTMalloc::TLS.Stats.LargeAllocs++;
+  allocator.MaybeEnforceSoftLimit();
+  void *Res = large.Allocate(Size, Alignment);
+  allocator.UpdatePeakLiveBytes();
+  if (MTMalloc::Config.UseShadow) {
+    allocator.InitOnce();  // Maps the shadow.
+    MTMalloc::Tags.SetMemoryTag(Res, large.GetPtrChunkSize(Res), 0);
+  }
+  return Res;
+}
+
+static void DeallocateLarge(void *Ptr) {
+  MTMalloc::TLS.LatencyPath = MTMalloc::kFreeLarge;
+  if (MTMalloc::Config.UseShadow)
+    MTMalloc::Tags.SetMemoryTag(Ptr, large.GetPtrChunkSize(Ptr),
+                                kLargeFreedTag);
+  auto QuarantineSize = MTMalloc::Config.QuarantineSize;
+  // A fenced chunk can't be reused anyway, no need to quarantine it.
+  if (QuarantineSize && !MTMalloc::Config.LargeAllocFence)
+    allocator.QuarantineLargeAndMaybeScan(Ptr, QuarantineSize << 20);
+  else
+    large.Deallocate(Ptr, MTMalloc::Config.LargeAllocFence);
+}
+
+static inline void *Malloc(size_t size) {
+  if (size < 8) size = 1;
+  if (size > MTMalloc::kMaxSizeClass)
+    return AllocateLarge(size);
+  void *res = allocator.Allocate(size);
+  //fprintf(stderr, "malloc %zd %p\n", size, res);
+  return res;
+}
+
+static inline void Free(void *p) {
+  if (!p) return;
+  auto QuarantineSize = MTMalloc::Config.QuarantineSize;
+  if (allocator.IsMine(p))
+    if (QuarantineSize == 0)
+      allocator.Deallocate(p);
+    else
+     allocator.QuarantineAndMaybeScan(p, QuarantineSize << 20);
+  else if (large.IsMine(p))
+    DeallocateLarge(p);
+  else
+    __builtin_trap();  // Not allocated by us.
+}
+
+// With MTM_LATENCY_SAMPLE=N, every N-th malloc() or free() of a thread is
+// timed and recorded by path.
+static inline bool ShouldSampleLatency() {
+  auto Rate = MTMalloc::Config.LatencySample;
+  if (__builtin_expect(!Rate, 1)) return false;
+  auto &TLS = MTMalloc::TLS;
+  if (TLS.LatencyCountdown > 1 && TLS.LatencyCountdown <= Rate) {
+    TLS.LatencyCountdown--;
+    return false;
+  }
+  TLS.LatencyCountdown = Rate;
+  return true;
+}
+
+__attribute__((noinline)) static void *SampledMalloc(size_t Size) {
+  uint64_t Beg = MTMalloc::ReadCycleCounter();
+  MTMalloc::TLS.LatencyPath = MTMalloc::kMallocFast;
+  void *Res = Malloc(Size);
+  allocator.RecordLatency(MTMalloc::ReadCycleCounter() - Beg);
+  return Res;
+}
+
+__attribute__((noinline)) static void SampledFree(void *Ptr) {
+  uint64_t Beg = MTMalloc::ReadCycleCounter();
+  MTMalloc::TLS.LatencyPath = MTMalloc::kFreeFast;
+  Free(Ptr);
+  allocator.RecordLatency(MTMalloc::ReadCycleCounter() - Beg);
+}
+
+// Allocation tracing (mtm_trace_start() or MTM_TRACE=<prefix>): every thread
+// appends its events (see mtmalloc_trace.h) to its own TraceBuffer, which is
+// written to its file when full, with one write(). The buffers are never
+// unmapped: the ones of exited threads are taken by new threads.
+namespace {
+
+using namespace MTMalloc;
+
+constexpr size_t kTraceBufferSize = 1 << 20;
+constexpr size_t kMaxTracePrefix = 256;
+
+struct TraceBuffer {
+  // Only contended by mtm_trace_stop().
+  pthread_mutex_t Mu;
+  int Fd;  // -1 if there is no file for this generation.
+  uint64_t Generation;  // The one Fd was opened for.
+  uint64_t LastTicks;
+  uintptr_t LastAddr;
+  size_t Pos;
+  bool InUse;  // Has an owner thread.
+  TraceBuffer *Next;
+  uint8_t Data[kTraceBufferSize];
+};
+
+pthread_mutex_t TraceMu = PTHREAD_MUTEX_INITIALIZER;  // Guards the following.
+TraceBuffer *TraceBuffers;  // Only ever added to.
+char TracePrefix[kMaxTracePrefix];
+uint64_t TraceGeneration;  // Bumped by mtm_trace_start() and _stop().
+size_t TraceNumFiles;  // In this generation.
+double TraceNsPerTick;
+pthread_key_t TraceKey;
+
+__attribute__((tls_model("initial-exec")))
+__thread TraceBuffer *MyTraceBuffer;
+// Set while a traced call runs: the malloc() and free() done by it (e.g. by
+// realloc()) or by the recording itself are not recorded.
+__attribute__((tls_model("initial-exec")))
+__thread bool InTracedCall;
+
+struct TracedCall {
+  TracedCall() { InTracedCall = true; }
+  ~TracedCall() { InTracedCall = false; }
+};
+
+inline bool ShouldTrace() {
+  return __builtin_expect(Config.Trace, 0) && !InTracedCall;
+}
+
+// B->Mu is held.
+void FlushTrace(TraceBuffer *B) {
+  for (size_t Done = 0; Done < B->Pos;) {
+    ssize_t Res = write(B->Fd, B->Data + Done, B->Pos - Done);
+    if (Res < 0 && errno == EINTR) continue;
+    if (Res <= 0) break;  // The rest of the trace is lost.
+    Done += Res;
+  }
+  B->Pos = 0;
+}
+
+void CloseTrace(TraceBuffer *B) {
+  if (B->Fd < 0) return;
+  FlushTrace(B);
+  close(B->Fd);
+  B->Fd = -1;
+}
+
+// Opens the next file of generation Gen, <prefix>.<pid>.<N>. B->Mu is held.
+void OpenTrace(TraceBuffer *B, uint64_t Gen) {
+  CloseTrace(B);
+  B->Generation = Gen;
+  char Path[kMaxTracePrefix + 64];
+  {
+    ScopedLock Lock(TraceMu, __LINE__);
+    if (Gen != TraceGeneration || !Config.Trace) return;
+    snprintf(Path, sizeof(Path), "%s.%d.%zd", TracePrefix, getpid(),
+             TraceNumFiles++);
+  }
+  B->Fd = open(Path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (B->Fd < 0) return;
+  TraceHeader H = {};
+  memcpy(H.Magic, kTraceMagic, sizeof(H.Magic));
+  H.Version = kTraceVersion;
+  H.Tid = GetTID();
+  H.Pid = getpid();
+  H.BaseTicks = ReadCycleCounter();
+  H.NsPerTick = TraceNsPerTick;
+  memcpy(B->Data, &H, sizeof(H));
+  B->Pos = sizeof(H);
+  B->LastTicks = H.BaseTicks;
+  B->LastAddr = 0;
+}
+
+// The TSD destructor.
+void ReleaseTraceBuffer(void *Arg) {
+  TraceBuffer *B = static_cast<TraceBuffer *>(Arg);
+  {
+    ScopedLock Lock(B->Mu, __LINE__);
+    CloseTrace(B);
+  }
+  ScopedLock Lock(TraceMu, __LINE__);
+  B->InUse = false;
+  MyTraceBuffer = nullptr;
+}
+
+TraceBuffer *GetTraceBuffer() {
+  if (MyTraceBuffer) return MyTraceBuffer;
+  TraceBuffer *B;
+  {
+    ScopedLock Lock(TraceMu, __LINE__);
+    for (B = TraceBuffers; B && B->InUse; B = B->Next) {}
+    if (B) B->InUse = true;
+  }
+  if (!B) {
+    void *Map = mmap(nullptr, sizeof(TraceBuffer), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Map == MAP_FAILED) return nullptr;
+    B = static_cast<TraceBuffer *>(Map);
+    pthread_mutex_init(&B->Mu, nullptr);
+    B->Fd = -1;
+    B->InUse = true;
+    ScopedLock Lock(TraceMu, __LINE__);
+    B->Next = TraceBuffers;
+    TraceBuffers = B;
+  }
+  MyTraceBuffer = B;
+  pthread_setspecific(TraceKey, B);
+  return B;
+}
+
+void RecordTrace(TraceOp Op, uint64_t Ticks, uint64_t EndTicks,
+                 const void *OldAddr, size_t Size, size_t Alignment,
+                 const void *Addr) {
+  TraceBuffer *B = GetTraceBuffer();
+  if (!B) return;
+  ScopedLock Lock(B->Mu, __LINE__);
+  uint64_t Gen = __atomic_load_n(&TraceGeneration, __ATOMIC_ACQUIRE);
+  if (B->Generation != Gen) OpenTrace(B, Gen);
+  if (B->Fd < 0) return;
+  if (B->Pos + kMaxTraceEventSize > kTraceBufferSize) FlushTrace(B);
+  TraceEvent E = {};
+  E.Op = Op;
+  E.Ticks = Ticks;
+  E.EndTicks = EndTicks;
+  E.OldAddr = reinterpret_cast<uintptr_t>(OldAddr);
+  E.Size = Size;
+  E.Alignment = Alignment;
+  E.Addr = reinterpret_cast<uintptr_t>(Addr);
+  B->Pos = EncodeTraceEvent(B->Data + B->Pos, E, &B->LastTicks, &B->LastAddr) -
+           B->Data;
+}
+
+// The traced versions of the entry points call the untraced ones. The time
+// of an allocation is taken after it, and that of a free before it.
+__attribute__((noinline)) void *TracedMalloc(size_t Size) {
+  TracedCall C;
+  void *Res = malloc(Size);
+  if (Res) {
+    uint64_t Ticks = ReadCycleCounter();
+    RecordTrace(kTraceMalloc, Ticks, Ticks, nullptr, Size, 0, Res);
+  }
+  return Res;
+}
+
+__attribute__((noinline)) void TracedFree(void *Ptr) {
+  TracedCall C;
+  if (Ptr) {
+    uint64_t Ticks = ReadCycleCounter();
+    RecordTrace(kTraceFree, Ticks, Ticks, Ptr, 0, 0, nullptr);
+  }
+  free(Ptr);
+}
+
+__attribute__((noinline)) void *TracedCalloc(size_t N, size_t Size) {
+  TracedCall C;
+  void *Res = calloc(N, Size);
+  if (Res) {
+    uint64_t Ticks = ReadCycleCounter();
+    RecordTrace(kTraceCalloc, Ticks, Ticks, nullptr, N * Size, 0, Res);
+  }
+  return Res;
+}
+
+__attribute__((noinline)) void *TracedRealloc(void *Ptr, size_t Size) {
+  TracedCall C;
+  uint64_t Beg = ReadCycleCounter();
+  void *Res = realloc(Ptr, Size);
+  uint64_t End = ReadCycleCounter();
+  if (Res && Ptr)
+    RecordTrace(kTraceRealloc, Beg, End, Ptr, Size, 0, Res);
+  else if (Res)
+    RecordTrace(kTraceMalloc, End, End, nullptr, Size, 0, Res);
+  return Res;
+}
+
+__attribute__((noinline)) int TracedPosixMemalign(void **MemPtr,
+                                                  size_t Alignment,
+                                                  size_t Size) {
+  TracedCall C;
+  int Res = posix_memalign(MemPtr, Alignment, Size);
+  if (!Res && *MemPtr) {
+    uint64_t Ticks = ReadCycleCounter();
+    RecordTrace(kTraceMemalign, Ticks, Ticks, nullptr, Size, Alignment,
+                *MemPtr);
+  }
+  return Res;
+}
+
+}  // namespace
+
 extern "C" {
 
 // tsan callbacks, use with -fsanitize=thread -mllvm -tsan-instrument-atomics=0
@@ -55,6 +371,10 @@ void __mtm_access(void *Ptr) {
               (int)AddressTag, (int)MemoryTag);
       __builtin_trap();
     }
+  } else if (MTMalloc::Config.UseShadow && large.IsMine(Ptr) &&
+             MTMalloc::Tags.GetMemoryTag(Ptr) == kLargeFreedTag) {
+    fprintf(stderr, "ERROR: large-heap-use-after-free %p\n", Ptr);
+    __builtin_trap();
   }
 }
 
@@ -100,29 +420,24 @@ void __bsa_dataonly_scope(int scope_level) {
 }
 
 void *malloc(size_t size) {
-  if (size < 8) size = 1;
-  if (size > MTMalloc::kMaxSizeClass) {
-    MTMalloc::TLS.Stats.LargeAllocs++;
-    return large.Allocate(size);
-  }
-  void *res = allocator.Allocate(size);
-  //fprintf(stderr, "malloc %zd %p\n", size, res);
-  return res;
+  if (ShouldTrace())
+    return TracedMalloc(size);
+  if (ShouldSampleLatency())
+    return SampledMalloc(size);
+  return Malloc(size);
 }
 
 void free(void *p) {
-  if (!p) return;
-  auto QuarantineSize = MTMalloc::Config.QuarantineSize;
-  if (allocator.IsMine(p))
-    if (QuarantineSize == 0)
-      allocator.Deallocate(p);
-    else
-     allocator.QuarantineAndMaybeScan(p, QuarantineSize << 20);
-  else
-    return large.Deallocate(p, MTMalloc::Config.LargeAllocFence);
+  if (ShouldTrace())
+    return TracedFree(p);
+  if (ShouldSampleLatency())
+    return SampledFree(p);
+  Free(p);
 }
 
 void *calloc(size_t nmemb, size_t size) {
+  if (ShouldTrace())
+    return TracedCalloc(nmemb, size);
   void *res = malloc(nmemb * size);
   memset(res, 0, nmemb * size);
   return res;
@@ -131,6 +446,8 @@ void *calloc(size_t nmemb, size_t size) {
 void *realloc(void *p, size_t size) {
   // TODO: implement a better realloc?
   // TODO: properly test realloc.
+  if (ShouldTrace())
+    return TracedRealloc(p, size);
   if (!p)
     return malloc(size);
   size_t OldSize = allocator.IsMine(p) ? allocator.GetPtrChunkSize(p)
@@ -147,6 +464,8 @@ void *memalign(size_t alignment, size_t size) {
 }
 
 int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if (ShouldTrace())
+    return TracedPosixMemalign(memptr, alignment, size);
   if (alignment <= 16) {
     *memptr = malloc(size);
     return 0;
@@ -161,8 +480,7 @@ int posix_memalign(void **memptr, size_t alignment, size_t size) {
     assert(0 == (reinterpret_cast<uintptr_t>(*memptr) % alignment));
     return 0;
   }
-  MTMalloc::TLS.Stats.LargeAllocs++;
-  *memptr = large.Allocate(size, alignment);
+  *memptr = AllocateLarge(size, alignment);
   return 0;
 }
 
@@ -175,13 +493,393 @@ void cfree(void *p) ALIAS("free");
 void *pvalloc(size_t size) ALIAS("valloc");
 // void *__libc_memalign(size_t alignment, size_t size) ALIAS("memalign");
 
-void malloc_usable_size() {
+size_t malloc_usable_size(void *p) {
+  if (!p) return 0;
+  if (allocator.IsMine(p)) return allocator.GetPtrChunkSize(p);
+  if (large.IsMine(p)) return large.GetPtrChunkSize(p);
+  return 0;
+}
+
+// Releases all the free memory. There is no heap top, so Pad is ignored.
+int malloc_trim(size_t Pad) {
+  return allocator.Trim() != 0;
+}
+
+int mtm_trace_start(const char *Prefix) {
+  if (strlen(Prefix) >= kMaxTracePrefix) return ENAMETOOLONG;
+  static pthread_once_t Once = PTHREAD_ONCE_INIT;
+  pthread_once(&Once, [] {
+    pthread_key_create(&TraceKey, ReleaseTraceBuffer);
+    TraceNsPerTick = CycleCounterNsPerTick();
+  });
+  ScopedLock Lock(TraceMu, __LINE__);
+  if (Config.Trace) return EBUSY;
+  strcpy(TracePrefix, Prefix);
+  TraceNumFiles = 0;
+  __atomic_store_n(&TraceGeneration, TraceGeneration + 1, __ATOMIC_RELEASE);
+  ScopedLock CtlLock(CtlMu, __LINE__);
+  Config.Trace = 1;
+  return 0;
+}
+
+void mtm_trace_stop(void) {
+  TraceBuffer *Buffers;
+  {
+    ScopedLock Lock(TraceMu, __LINE__);
+    if (!Config.Trace) return;
+    {
+      ScopedLock CtlLock(CtlMu, __LINE__);
+      Config.Trace = 0;
+    }
+    __atomic_store_n(&TraceGeneration, TraceGeneration + 1, __ATOMIC_RELEASE);
+    Buffers = TraceBuffers;
+  }
+  for (TraceBuffer *B = Buffers; B; B = B->Next) {
+    ScopedLock Lock(B->Mu, __LINE__);
+    CloseTrace(B);
+  }
+}
+
+size_t mtm_release_memory(size_t Bytes) {
+  return allocator.ReleaseMemory(Bytes);
+}
+
+size_t mtm_leak_check(void) {
+  MTMalloc::LeakReport R;
+  if (int Res = allocator.LeakCheck(&R)) {
+    fprintf(stderr, "MTMalloc: LeakCheck failed: %s%s\n",
+            R.RootsError ? "could not scan the roots: " : "", strerror(Res));
+    return 0;
+  }
+  R.Print();
+  return R.TotalBytes();
+}
+
+int mtm_iterate(uintptr_t Begin, uintptr_t End,
+                void (*Callback)(uintptr_t, size_t, void *), void *Arg,
+                int Flags) {
+  return allocator.Iterate(Begin, End, Callback, Arg,
+                           Flags & MTM_ITERATE_STOP_THE_WORLD);
+}
+
+int mtm_heap_snapshot(const char *Path, int Flags) {
+  int Fd = open(Path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (Fd < 0) return errno;
+  uint32_t SnapshotFlags =
+      Flags & MTM_SNAPSHOT_TAGS ? MTMalloc::kSnapshotHasTags : 0;
+  int Res = allocator.WriteSnapshot(Fd, SnapshotFlags) ? 0 : errno;
+  if (close(Fd) && !Res) Res = errno;
+  return Res;
+}
+
+}  // extern "C"
+
+namespace {
+
+// A property of mtm_ctl(). Set is null for the read-only ones.
+struct CtlProperty {
+  const char *Name;
+  uint64_t (*Get)();
+  int (*Set)(uint64_t);
+};
+
+uint64_t CollectLiveBytes(size_t SC) {
+  MTMalloc::Statistics S;
+  allocator.CollectStats(&S);
+  return SC == ~0UL ? S.LiveBytes() + large.GetLiveBytes() : S.LiveBytes(SC);
+}
+
+uint64_t CountUsedBytes() {
+  size_t Used, Quarantined;
+  allocator.CountBytes(&Used, &Quarantined);
+  return Used;
+}
+
+uint64_t CountQuarantinedBytes() {
+  size_t Used, Quarantined;
+  allocator.CountBytes(&Used, &Quarantined);
+  return Quarantined;
 }
 
-void mallinfo() {
+#define CTL_STAT(Name, Expr) \
+  { "stats." Name, [] { return (uint64_t)(Expr); }, nullptr }
+#define CTL_CONFIG(Name, Field, Max)                         \
+  {                                                          \
+    "config." Name, [] { return (uint64_t)Config.Field; },   \
+        [](uint64_t V) {                                     \
+          if (V > (Max)) return EINVAL;                      \
+          Config.Field = V;                                  \
+          return 0;                                          \
+        }                                                    \
+  }
+
+using MTMalloc::Config;
+
+const CtlProperty CtlProperties[] = {
+    CTL_STAT("rss", MTMalloc::GetRss()),
+    CTL_STAT("live_bytes", CollectLiveBytes(~0UL)),
+    CTL_STAT("peak_live_bytes",
+             __atomic_load_n(&allocator.PeakLiveBytes, __ATOMIC_RELAXED)),
+    CTL_STAT("used_bytes", CountUsedBytes()),
+    CTL_STAT("quarantined_bytes", CountQuarantinedBytes()),
+    CTL_STAT("released_bytes",
+             __atomic_load_n(&allocator.ReleasedBytes, __ATOMIC_RELAXED)),
+    CTL_STAT("super_pages",
+             allocator.GetNumSuperPages(0) + allocator.GetNumSuperPages(1)),
+    CTL_STAT("num_scans", allocator.NumScans),
+    CTL_STAT("scan_time_us",
+             allocator.ScanPhaseUs[MTMalloc::kScanPause].Sum),
+    CTL_STAT("last_scan_time_us", allocator.LastScanTimeUs),
+    CTL_STAT("max_scan_time_us",
+             allocator.ScanPhaseUs[MTMalloc::kScanPause].Max),
+    CTL_STAT("soft_limit_hits", allocator.SoftLimitHits),
+    CTL_STAT("large.cached_bytes", large.GetCachedBytes()),
+    CTL_STAT("large.quarantined_bytes", large.GetQuarantinedBytes()),
+    CTL_STAT("large.quarantine_overflows", large.GetNumQuarantineOverflows()),
+    CTL_STAT("large.fenced_bytes", large.GetFencedBytes()),
+    CTL_CONFIG("quarantine_size_mb", QuarantineSize, 255),
+    {"config.release_freq_ms", [] { return (uint64_t)Config.ReleaseFreq; },
+     [](uint64_t V) {
+       if (V > 255) return EINVAL;
+       Config.ReleaseFreq = V;
+       // The thread is not started if it was off at startup.
+       if (V) StartMemoryReleaseThread();
+       return 0;
+     }},
+    CTL_CONFIG("release_decay_ms", ReleaseDecay, 65535),
+    CTL_CONFIG("large_cache_size_mb", LargeCacheSize, 4095),
+    CTL_CONFIG("large_cache_decay_ms", LargeCacheDecay, 65535),
+    CTL_CONFIG("soft_limit_mb", SoftLimit, (1 << 20) - 1),
+    CTL_CONFIG("print_scan", PrintScan, 1),
+    CTL_CONFIG("scan_log", ScanLog, 1),
+    CTL_CONFIG("latency_sample", LatencySample, (1 << 20) - 1),
+};
+
+// The read-only per size class properties, "<Prefix><size class>".
+struct CtlSizeClassProperty {
+  const char *Prefix;
+  uint64_t (*Get)(size_t SC);
+};
+
+const CtlSizeClassProperty CtlSizeClassProperties[] = {
+    {"stats.super_pages.", [](size_t SC) { return MTMalloc::super_pages[SC]; }},
+    {"stats.live_bytes.", CollectLiveBytes},
+};
+
+#undef CTL_STAT
+#undef CTL_CONFIG
+
+// The heap totals for mallinfo2(), malloc_stats() and malloc_info(), from
+// the incremental counters (no SuperPage is looked at).
+struct HeapTotals {
+  MTMalloc::Statistics Stats;
+  size_t Mapped;  // SuperPages.
+  size_t Live;  // Small chunks.
+  size_t Quarantined;  // Small and large chunks.
+  size_t LargeLive, LargeChunks, LargeCached;
+
+  HeapTotals() {
+    allocator.CollectStats(&Stats);
+    Mapped = (allocator.GetNumSuperPages(0) + allocator.GetNumSuperPages(1)) *
+             MTMalloc::kSuperPageSize;
+    Live = Stats.LiveBytes();
+    Quarantined =
+        __atomic_load_n(&allocator.BytesInQuarantine, __ATOMIC_RELAXED) +
+        large.GetQuarantinedBytes();
+    LargeLive = large.GetLiveBytes();
+    LargeChunks = large.GetNumLiveChunks();
+    LargeCached = large.GetCachedBytes();
+  }
+};
+
+// Stat is one of count, mean, p50, p90, p99, p999, max; the values are
+// multiplied by Scale (except count).
+bool GetHistogramStat(const MTMalloc::Histogram &H, const char *Stat,
+                      double Scale, uint64_t *Res) {
+  if (!strcmp(Stat, "count")) *Res = H.Count;
+  else if (!strcmp(Stat, "mean")) *Res = H.Mean() * Scale;
+  else if (!strcmp(Stat, "p50")) *Res = H.Percentile(50) * Scale;
+  else if (!strcmp(Stat, "p90")) *Res = H.Percentile(90) * Scale;
+  else if (!strcmp(Stat, "p99")) *Res = H.Percentile(99) * Scale;
+  else if (!strcmp(Stat, "p999")) *Res = H.Percentile(99.9) * Scale;
+  else if (!strcmp(Stat, "max")) *Res = H.Max * Scale;
+  else return false;
+  return true;
+}
+
+// If Name is "<Prefix><one of Names><Suffix><stat>", returns the index in
+// Names and sets *Stat.
+int MatchHistogramName(const char *Name, const char *Prefix,
+                       const char *const *Names, size_t NumNames,
+                       const char *Suffix, const char **Stat) {
+  size_t PrefixLen = strlen(Prefix), SuffixLen = strlen(Suffix);
+  if (strncmp(Name, Prefix, PrefixLen)) return -1;
+  Name += PrefixLen;
+  for (size_t I = 0; I < NumNames; I++) {
+    size_t Len = strlen(Names[I]);
+    if (strncmp(Name, Names[I], Len) || strncmp(Name + Len, Suffix, SuffixLen))
+      continue;
+    *Stat = Name + Len + SuffixLen;
+    return I;
+  }
+  return -1;
+}
+
+// "stats.scan.<phase>_us.<stat>" for the scan phase histograms and
+// "stats.latency.<path>_ns.<stat>" for the sampled malloc/free latencies.
+bool GetHistogramProperty(const char *Name, uint64_t *Res) {
+  const char *Stat;
+  int Idx = MatchHistogramName(Name, "stats.scan.", MTMalloc::ScanPhaseNames,
+                               MTMalloc::kNumScanPhases, "_us.", &Stat);
+  if (Idx >= 0)
+    return GetHistogramStat(allocator.ScanPhaseUs[Idx], Stat, 1, Res);
+  Idx = MatchHistogramName(Name, "stats.latency.", MTMalloc::LatencyPathNames,
+                           MTMalloc::kNumLatencyPaths, "_ns.", &Stat);
+  if (Idx < 0) return false;
+  // Big, but mtm_ctl() is not expected to be called often.
+  static MTMalloc::LatencyHistograms L;
+  MTMalloc::ScopedLock Lock(CtlMu, __LINE__);
+  allocator.CollectLatency(&L);
+  return GetHistogramStat(L.Paths[Idx], Stat,
+                          MTMalloc::CycleCounterNsPerTick(), Res);
 }
 
-void mallopt() {
+}  // namespace
+
+extern "C" {
+
+int mtm_ctl(const char *Name, uint64_t *OldP, const uint64_t *NewP) {
+  uint64_t Value;
+  if (GetHistogramProperty(Name, &Value)) {
+    if (NewP) return EPERM;
+    if (OldP) *OldP = Value;
+    return 0;
+  }
+  for (const CtlSizeClassProperty &P : CtlSizeClassProperties) {
+    size_t PrefixLen = strlen(P.Prefix);
+    if (strncmp(Name, P.Prefix, PrefixLen)) continue;
+    char *End;
+    unsigned long SC = strtoul(Name + PrefixLen, &End, 10);
+    if (End == Name + PrefixLen || *End || SC >= MTMalloc::kNumSizeClasses)
+      return ENOENT;
+    if (NewP) return EPERM;
+    if (OldP) *OldP = P.Get(SC);
+    return 0;
+  }
+  for (const CtlProperty &P : CtlProperties) {
+    if (strcmp(Name, P.Name)) continue;
+    if (NewP && !P.Set) return EPERM;
+    if (OldP) *OldP = P.Get();
+    if (!NewP) return 0;
+    MTMalloc::ScopedLock Lock(CtlMu, __LINE__);
+    return P.Set(*NewP);
+  }
+  return ENOENT;
+}
+
+// The SuperPages are reported as the arena and the large chunks as the
+// mmapped ones; the quarantine counts as free.
+struct mallinfo2 mallinfo2() {
+  HeapTotals T;
+  struct mallinfo2 Res = {};
+  Res.arena = T.Mapped;
+  Res.hblks = T.LargeChunks;
+  Res.hblkhd = T.LargeLive;
+  Res.usmblks = __atomic_load_n(&allocator.PeakLiveBytes, __ATOMIC_RELAXED);
+  Res.uordblks = T.Live;
+  Res.fordblks = T.Mapped - std::min(T.Mapped, T.Live);
+  Res.keepcost = T.LargeCached;
+  return Res;
+}
+
+// The int fields are truncated, as in glibc.
+struct mallinfo mallinfo() {
+  struct mallinfo2 MI = mallinfo2();
+  struct mallinfo Res = {};
+  Res.arena = MI.arena;
+  Res.hblks = MI.hblks;
+  Res.hblkhd = MI.hblkhd;
+  Res.usmblks = MI.usmblks;
+  Res.uordblks = MI.uordblks;
+  Res.fordblks = MI.fordblks;
+  Res.keepcost = MI.keepcost;
+  return Res;
+}
+
+// None of the glibc parameters apply (use mtm_ctl() instead): they are
+// accepted and ignored, so that callers checking the result don't fail.
+// Returns 0, like glibc, for the unknown ones.
+int mallopt(int Param, int Value) {
+  switch (Param) {
+  case M_MXFAST:
+  case M_TRIM_THRESHOLD:
+  case M_TOP_PAD:
+  case M_MMAP_THRESHOLD:
+  case M_MMAP_MAX:
+  case M_CHECK_ACTION:
+  case M_PERTURB:
+  case M_ARENA_TEST:
+  case M_ARENA_MAX:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// In the glibc format, but the mmap lines are the current large chunks, not
+// the maxima, and labeled so.
+void malloc_stats() {
+  HeapTotals T;
+  fprintf(stderr,
+          "Arena 0:\n"
+          "system bytes     = %10zu\n"
+          "in use bytes     = %10zu\n"
+          "Total (incl. mmap):\n"
+          "system bytes     = %10zu\n"
+          "in use bytes     = %10zu\n"
+          "mmap regions     = %10zu\n"
+          "mmap bytes       = %10zu\n"
+          "quarantine bytes = %10zu\n"
+          "peak live bytes  = %10zu\n",
+          T.Mapped, T.Live, T.Mapped + T.LargeLive + T.LargeCached,
+          T.Live + T.LargeLive, T.LargeChunks, T.LargeLive, T.Quarantined,
+          (size_t)__atomic_load_n(&allocator.PeakLiveBytes, __ATOMIC_RELAXED));
+}
+
+// Same structure as the glibc one, with a <size> per size class that has
+// SuperPages: the live chunks and the free space of its SuperPages. The
+// peak is of the live bytes, not of the system memory, and is labeled so.
+int malloc_info(int Options, FILE *Out) {
+  if (Options) return EINVAL;
+  HeapTotals T;
+  fprintf(Out, "<malloc version=\"1\">\n<heap nr=\"0\">\n<sizes>\n");
+  for (size_t SC = 0; SC < MTMalloc::kNumSizeClasses; SC++) {
+    size_t NumSuperPages = MTMalloc::super_pages[SC];
+    if (!NumSuperPages) continue;
+    size_t ChunkSize = MTMalloc::SCDescr[SC].ChunkSize();
+    size_t Live = T.Stats.LiveBytes(SC);
+    size_t Free = NumSuperPages * MTMalloc::kSuperPageSize;
+    Free -= std::min(Free, Live);
+    fprintf(Out,
+            "  <size from=\"%zu\" to=\"%zu\" total=\"%zu\" count=\"%zu\" "
+            "live=\"%zu\" superpages=\"%zu\"/>\n",
+            ChunkSize, ChunkSize, Free, Free / ChunkSize, Live, NumSuperPages);
+  }
+  fprintf(Out,
+          "</sizes>\n"
+          "<total type=\"quarantine\" size=\"%zu\"/>\n"
+          "<total type=\"mmap\" count=\"%zu\" size=\"%zu\"/>\n"
+          "<total type=\"cached\" size=\"%zu\"/>\n"
+          "<total type=\"peak_live\" size=\"%zu\"/>\n"
+          "<system type=\"current\" size=\"%zu\"/>\n"
+          "<aspace type=\"total\" size=\"%zu\"/>\n"
+          "<aspace type=\"mprotect\" size=\"%zu\"/>\n"
+          "</heap>\n</malloc>\n",
+          T.Quarantined, T.LargeChunks, T.LargeLive, T.LargeCached,
+          (size_t)__atomic_load_n(&allocator.PeakLiveBytes, __ATOMIC_RELAXED),
+          MTMalloc::GetRss(),
+          T.Mapped + T.LargeLive + T.LargeCached, large.GetFencedBytes());
+  return 0;
 }
 }  // extern "C"
 
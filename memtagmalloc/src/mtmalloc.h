@@ -40,9 +40,12 @@
 
 #include "mtmalloc_config.h"
 #include "mtmalloc_util.h"
+#include "mtmalloc_large.h"
 #include "mtmalloc_size_classes.h"
 #include "mtmalloc_shadow.h"
 #include "mtmalloc_tags.h"
+#include "mtmalloc_pressure.h"
+#include "mtmalloc_snapshot.h"
 
 #include <type_traits>
 #include <sys/mman.h>
@@ -54,7 +57,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
 #include <dirent.h>
+#include <errno.h>
+#include <setjmp.h>
 #include <signal.h>
 #include <algorithm>
 
@@ -64,9 +70,6 @@
 
 namespace MTMalloc {
 
-static const size_t kSuperPageSize = 1 << 19; // 2Mb
-// Even better is to have super pages of different sizes.
-
 const size_t kMaxThreads = 1 << 12;
 
 // We can map a larger region for the allocator but QEMU doesn't like that:
@@ -89,7 +92,6 @@ const size_t kSecondRangeMeta = 0x710000000000ULL;
 // like the Sanitizer allocator or Scudo malloc do, but that hits hard on TLB
 // and it will make the range checks in the GC scan more complicated.
 static constexpr size_t kNumSizeClassRanges = 2;
-static constexpr size_t kSizeAlignmentForSecondRange = 1024;
 
 const size_t kMeta[kNumSizeClassRanges] = {
     kPrimaryMetaSpace,
@@ -102,8 +104,37 @@ FixedShadow<kSecondRangeMeta, kFirstSuperPage[1], kAllocatorSize / 2,
             kSuperPageSize, kSuperPageSize / kSizeAlignmentForSecondRange>
     SecondRangeMeta;
 
+// Per 4K page of the allocator space: the time when the release thread
+// first saw the page free, see SuperPage::MaybeReleaseToOs().
+const size_t kPageAgeSpace = 0x730000000000ULL;
+static constexpr size_t kReleasePageSize = 1 << 12;
+FixedShadow<kPageAgeSpace, kAllocatorSpace, kAllocatorSize, kReleasePageSize,
+            sizeof(uint16_t)>
+    PageAge;
+
+// Per SuperPage: the link in the release queue (see
+// Allocator::QueueForRelease()) and the counters that let the release
+// thread and the stats skip the state array. The counters are updated with
+// relaxed atomics and may be off while the chunks change state.
+struct SuperPageInfo {
+  uint32_t Next;    // 1 + index of the next SuperPage in the queue, or 0.
+  uint32_t Queued;  // atomic
+  uint32_t NumUsed;  // atomic, USED_MIXED or USED_DATA chunks.
+  uint32_t QuarantinedBytes;  // atomic, QUARANTINED or MARKED chunks.
+};
+const size_t kSuperPageInfoSpace = 0x740000000000ULL;
+FixedShadow<kSuperPageInfoSpace, kAllocatorSpace, kAllocatorSize,
+            kSuperPageSize, sizeof(SuperPageInfo)>
+    SuperPageInfos;
+
+// All the metadata shadows above (and LargePageState) are in this range.
+const size_t kMetaSpaceBeg = kPrimaryMetaSpace;
+const size_t kMetaSpaceEnd =
+    kSuperPageInfoSpace + decltype(SuperPageInfos)::kShadowSize;
+
 static AddressAndMemoryTags<kAllocatorSpace, kAllocatorSize,
-                            kSizeAlignmentForSecondRange>
+                            kSizeAlignmentForSecondRange, kLargeAllocSpace,
+                            kLargeAllocSize>
     Tags;
 
 const size_t kSizeOfLocalQuarantine = 1 << 20;
@@ -154,58 +185,6 @@ constexpr size_t SizeClassToSize(SizeClass sc) {
   return SCDescr[sc.v].ChunkSize();
 }
 
-// Factoid: a division by a constant can be replaced with
-// a multiplication by a constant followed by a shift.
-// Compilers do it all the time.
-// Factoid: when computing Left / Div, where Left is in [0,kSuperPageSize)
-// and Div is in [16, MaxSizeClass] the division can be replaced by
-// a multiplication followed by a right shift by 35 for *most* values of Div.
-// We choose the size classes such that this works for every size class.
-// So, instead of dividing by the size in the hot spot, we multiply by a
-// specially prepared constant, see ComputeMulForDiv().
-// Related reading: https://arxiv.org/pdf/1902.01961.pdf
-
-static constexpr uint32_t kDivMulShift = 35;
-
-uint32_t ComputeMulForDiv(uint32_t Div, uint32_t Shift) {
-  uint32_t Mul = (1ULL << Shift) / Div;
-  if (Div & (Div - 1)) Mul++;
-  return Mul;
-}
-
-bool IsCorrectDivToMul(uint32_t Div, uint32_t Mul, uint32_t Shift,
-                       uint32_t MaxLeft) {
-  for (uint64_t Left = 1; Left <= MaxLeft; Left++) {
-    uint32_t D1 = Left / Div;
-    uint32_t D2 = (Left * Mul) >> Shift;
-    if (D1 != D2) return false;
-  }
-  return true;
-}
-
-static uint32_t DivBySizeViaMul(uint32_t Left, uint32_t DivMul) {
-  uint64_t T = Left;
-  return (T * DivMul) >> kDivMulShift;
-}
-
-
-static constexpr size_t kStateArrayAlignment = 32;
-
-constexpr size_t SizeOfInlineMeta(size_t NumChunks, size_t RangeNum) {
-  if (RangeNum == 1) return 0;
-  return //kStateArrayAlignment +
-      RoundUpTo(NumChunks, kStateArrayAlignment);
-}
-
-constexpr size_t ComputeNumChunks(size_t ChunkSize, size_t RangeNum) {
-  size_t Approx = kSuperPageSize / ChunkSize;
-  for (size_t NumChunks = Approx; NumChunks > 0; NumChunks--)
-    if (SizeOfInlineMeta(NumChunks, RangeNum) + NumChunks * ChunkSize <=
-        kSuperPageSize)
-      return NumChunks;
-  __builtin_trap();
-}
-
 template <class CallBack>
 size_t FindByte_Plain(uint8_t *Bytes, uint8_t Value, size_t N,
                     size_t StartPosHint, CallBack CB) {
@@ -282,6 +261,33 @@ size_t FindByte(uint8_t *Bytes, uint8_t Value, size_t N,
 	return FindByte_Plain(Bytes, Value, N, StartPosHint, CB);
 #endif
 }
+// Calls CB(Idx) for every Idx < N where Bytes[Idx] is USED_MIXED or
+// USED_DATA (1 or 3), i.e. has bit 0 set and bit 2 clear, which none of the
+// other states (0, 5, 7, 255) has. Reads RoundUpTo(N, 8) bytes.
+template <class CallBack>
+void FindUsed(const uint8_t *Bytes, size_t N, CallBack CB) {
+  const uint64_t kLowBits = 0x0101010101010101ULL;
+  for (size_t Idx = 0; Idx < N; Idx += 8) {
+    uint64_t Tuple;
+    memcpy(&Tuple, &Bytes[Idx], sizeof(Tuple));
+    uint64_t Bits = Tuple & ~(Tuple >> 2) & kLowBits;
+    if (!Bits) continue;
+#ifdef __x86_64__
+    uint64_t Mask = _pext_u64(Bits, kLowBits);
+#else
+    uint64_t Mask = 0;
+    for (; Bits; Bits &= Bits - 1) Mask |= 1ULL << (__builtin_ctzll(Bits) / 8);
+#endif
+    while (Mask) {
+      size_t BitIdx = __builtin_ctz(Mask);
+      Mask &= Mask - 1;
+      size_t Pos = Idx + BitIdx;
+      if (Pos >= N) break;
+      CB(Pos);
+    }
+  }
+}
+
 struct SuperPage {
 
   enum state_t {
@@ -312,6 +318,17 @@ struct SuperPage {
     return (uint8_t*)this + Idx * SCD.ChunkSize();
   }
 
+  SuperPageInfo *Info() {
+    return reinterpret_cast<SuperPageInfo *>(
+        SuperPageInfos.GetShadowPtr(This()));
+  }
+  size_t NumUsed() {
+    return __atomic_load_n(&Info()->NumUsed, __ATOMIC_RELAXED);
+  }
+  size_t QuarantinedBytes() {
+    return __atomic_load_n(&Info()->QuarantinedBytes, __ATOMIC_RELAXED);
+  }
+
   template <typename Callback>
   void IterateStates(Callback CB) {
     auto SCD = GetSCD();
@@ -397,6 +414,7 @@ struct SuperPage {
       TRAP();
     }
     *HintPtr = Pos + 1; // RoundDownTo(Pos, 32);
+    __atomic_add_fetch(&Info()->NumUsed, 1, __ATOMIC_RELAXED);
     void *Res = AddressOfChunk(Pos, SCD);
     Res = Tags.ApplyAddressTag(Res, Tags.GetMemoryTag(Res));
     if (0) {
@@ -442,11 +460,28 @@ struct SuperPage {
       __atomic_store_n(&S[Idx], MARKED, __ATOMIC_RELAXED);
   }
 
-  void MoveFromQuarantineToAvailable() {
-    IterateStates([](uint8_t &S) {
-      if (S == QUARANTINED) S = AVAILABLE;
+  // Returns the number of chunks that became available.
+  size_t MoveFromQuarantineToAvailable() {
+    size_t Res = 0;
+    IterateStates([&](uint8_t &S) {
+      if (S == QUARANTINED) {
+        S = AVAILABLE;
+        Res++;
+      }
       if (S == MARKED) S = QUARANTINED;
     });
+    if (Res)
+      __atomic_sub_fetch(&Info()->QuarantinedBytes, Res * GetSCD().ChunkSize(),
+                         __ATOMIC_RELAXED);
+    return Res;
+  }
+
+  // Returns true if the SuperPage may have memory to release after some of
+  // its chunks became available: if all the chunks are available, or if
+  // its chunks are big enough to be released page-by-page.
+  bool WorthReleasing(SizeClassDescr SCD) {
+    return SCD.ChunkSize() >= kReleasePageSize ||
+           (!NumUsed() && !QuarantinedBytes());
   }
 
   __attribute__((always_inline))
@@ -474,12 +509,20 @@ struct SuperPage {
     return NewMemoryTag;
   }
 
+  // Returns WorthReleasing().
   __attribute__((always_inline))
-  void Deallocate(void *Ptr) {
+  bool Deallocate(void *Ptr) {
     auto SCD = GetSCD();
     auto S = ComputeStatePtr(Ptr, SCD);
     UpdateMemoryTagOnFree(Ptr, SCD.ChunkSize());
     ExchangeAndCheckForDoubleFree(Ptr, S, AVAILABLE);
+    __atomic_sub_fetch(&Info()->NumUsed, 1, __ATOMIC_RELAXED);
+    if (!WorthReleasing(SCD)) return false;
+    ForgetReleased(SCD.ChunkSize() >= kReleasePageSize
+                       ? RoundDownTo(reinterpret_cast<uintptr_t>(Ptr),
+                                     kReleasePageSize)
+                       : This());
+    return true;
   }
 
   size_t Quarantine(void *Ptr) {
@@ -498,32 +541,52 @@ struct SuperPage {
     // benchmarking.
     // memset(Ptr, 0xfb, SCD.ChunkSize());
     ExchangeAndCheckForDoubleFree(Ptr, S, NewValue);
+    __atomic_sub_fetch(&Info()->NumUsed, 1, __ATOMIC_RELAXED);
+    // Small chunks: when the SuperPage becomes free, see PostScan().
+    if (SCD.ChunkSize() >= kReleasePageSize)
+      ForgetReleased(
+          RoundDownTo(reinterpret_cast<uintptr_t>(Ptr), kReleasePageSize));
     if (NewValue == AVAILABLE)
       return 0;
+    __atomic_add_fetch(&Info()->QuarantinedBytes, SCD.ChunkSize(),
+                       __ATOMIC_RELAXED);
     return SCD.ChunkSize();
   }
 
-  void MarkAllLivePointers(size_t NumSuperPages[kNumSizeClassRanges]) {
+  // The parts of the address space where a pointer may point to a
+  // quarantined chunk, fixed for the duration of a scan.
+  struct ScanBounds {
+    size_t SuperPageRegionSize[kNumSizeClassRanges];
+    size_t LargeRegionSize;  // 0 if there are no quarantined large chunks.
+  };
+
+  // Marks the chunks pointed to by the words in [Beg, End).
+  static void MarkRange(uint8_t *Beg, uint8_t *End, const ScanBounds &B) {
     static_assert(kNumSizeClassRanges == 2);  // not sure if we want to generalize.
+    for (uint8_t *Word = Beg; Word < End; Word += sizeof(void *)) {
+      // This is a very hot load.  I've tried using AVX512 for this
+      // (_mm512_load_si512/_mm512_cmpgt_epu64_mask) but it was slower.
+      uintptr_t Value = *(uintptr_t *)Word;
+      // if (Value <= kFirstSuperPage || Value >= LastSuperPage) continue;
+      if (Value - kFirstSuperPage[0] >= B.SuperPageRegionSize[0] &&
+          Value - kFirstSuperPage[1] >= B.SuperPageRegionSize[1]) {
+        if (Value - kLargeAllocSpace < B.LargeRegionSize)
+          LargeAllocator::Mark(Value);
+        continue;
+      }
+      reinterpret_cast<SuperPage *>((RoundDownTo(Value, kSuperPageSize)))
+          ->Mark(Value);
+    }
+  }
+
+  void MarkAllLivePointers(const ScanBounds &B) {
     auto SCD = GetSCD();
     size_t ChunkSize = SCD.ChunkSize();
-    size_t SuperPageRegionSize[2] = {NumSuperPages[0] * kSuperPageSize,
-                                     NumSuperPages[1] * kSuperPageSize};
     uint8_t *S = State(SCD.NumChunks, SCD.RangeNum);
     for (size_t Idx = 0, N = SCD.NumChunks; Idx < N; Idx++) {
       if (S[Idx] == USED_MIXED) {
         uint8_t *P = AddressOfChunk(Idx, SCD);
-        for (uint8_t *Word = P; Word < P + ChunkSize; Word += sizeof(void *)) {
-          // This is a very hot load.  I've tried using AVX512 for this
-          // (_mm512_load_si512/_mm512_cmpgt_epu64_mask) but it was slower.
-          uintptr_t Value = *(uintptr_t *)Word;
-          // if (Value <= kFirstSuperPage || Value >= LastSuperPage) continue;
-          if (Value - kFirstSuperPage[0] >= SuperPageRegionSize[0] &&
-              Value - kFirstSuperPage[1] >= SuperPageRegionSize[1])
-            continue;
-          reinterpret_cast<SuperPage *>((RoundDownTo(Value, kSuperPageSize)))
-              ->Mark(Value);
-        }
+        MarkRange(P, P + ChunkSize, B);
       }
     }
   }
@@ -544,44 +607,239 @@ struct SuperPage {
     return CountStates(QUARANTINED);
   }
 
-  // Very basic release to OS.
+  // Release to OS, driven by the release thread.
+  // Free memory is released with a delay, so that the pages of chunks that
+  // are freed and soon allocated again don't refault: the release thread
+  // records in PageAge when it first saw a chunk (or an empty SuperPage)
+  // free, and the older it gets, the more likely it is to be released.
+  // Once released, the age becomes kReleasedAge until the chunk (or a chunk
+  // of the SuperPage) is freed again, so the released memory is not
+  // released (and counted) over and over: mincore() can't tell, since
+  // pages shared with a used chunk stay resident, and MADV_FREE-d pages
+  // are resident until the kernel takes them.
+  // The probability follows a smoothstep curve from 0 to 1 over
+  // Config.ReleaseDecay miliseconds (like the jemalloc decay), and is
+  // applied by comparing it against a per-page hash, so the fraction of
+  // the released pages follows the curve.
+  // SuperPages with chunks of at least kReleasePageSize are released
+  // page-by-page, others only when all chunks are free.
   // Possible improvements:
-  // * release parts of the SuperPage.
   // * use 8-byte or 16-byte CAS (and loads).
   // * Try not to release already released SuperPage.
-  // * Choose pages to try-to-release better than randomly.
   // Can we use this?
   // https://www.kernel.org/doc/html/latest/admin-guide/mm/pagemap.html
-  void MaybeReleaseToOs() {
+
+  // Ticks are kPageAgeTickMs long, 0 means "not seen free".
+  static constexpr size_t kPageAgeTickMs = 16;
+  static constexpr uint16_t kReleasedAge = 0xffff;
+  static uint16_t PageAgeNow() {
+    uint16_t Now = usec() / 1000 / kPageAgeTickMs;
+    return Now && Now != kReleasedAge ? Now : 1;
+  }
+
+  static uint16_t *PageAgePtr(uintptr_t Page) {
+    return reinterpret_cast<uint16_t *>(PageAge.GetShadowPtr(Page));
+  }
+
+  static bool IsReleased(uintptr_t Page) {
+    return __atomic_load_n(PageAgePtr(Page), __ATOMIC_RELAXED) == kReleasedAge;
+  }
+
+  // Called when a chunk is freed: its Page (or, for small chunks, the
+  // SuperPage) was used since it was released.
+  static void ForgetReleased(uintptr_t Page) {
+    if (IsReleased(Page))
+      __atomic_store_n(PageAgePtr(Page), 0, __ATOMIC_RELAXED);
+  }
+
+  // Returns true if the free Page has been free long enough to be released.
+  static bool IsOldEnough(uintptr_t Page, uint16_t Now) {
+    uint16_t *Age = PageAgePtr(RoundDownTo(Page, kReleasePageSize));
+    if (!*Age) *Age = Now;
+    size_t Decay = Config.ReleaseDecay;
+    size_t Elapsed = static_cast<uint16_t>(Now - *Age) * kPageAgeTickMs;
+    if (Elapsed >= Decay) return true;
+    // smoothstep(x) = 3x^2 - 2x^3 in 16-bit fixed point.
+    uint64_t X = (Elapsed << 16) / Decay;
+    uint64_t Smooth = (X * X * (3 * (1 << 16) - 2 * X)) >> 32;
+    uint64_t Hash = ((Page >> 12) * 0x9E3779B97F4A7C15ULL) >> 48;
+    return Hash < Smooth;
+  }
+
+  static void ReleasePages(uintptr_t Beg, uintptr_t End) {
+    void *Ptr = reinterpret_cast<void *>(Beg);
+    if (Config.ReleaseMadvFree && !madvise(Ptr, End - Beg, MADV_FREE))
+      return;
+    madvise(Ptr, End - Beg, MADV_DONTNEED);  // Also if MADV_FREE is EINVAL.
+  }
+
+  static constexpr size_t kPagesPerSuperPage =
+      kSuperPageSize / kReleasePageSize;
+
+  // Sets bit 0 of Vec[I] if the I-th page of the SuperPage is resident.
+  void GetResidentPages(unsigned char Vec[kPagesPerSuperPage]) {
+    if (mincore(this, kSuperPageSize, Vec))
+      memset(Vec, 1, kPagesPerSuperPage);
+  }
+
+  // Returns true if any page that intersects with [Beg, End) is resident.
+  bool IsResident(uintptr_t Beg, uintptr_t End,
+                  const unsigned char Vec[kPagesPerSuperPage]) {
+    for (size_t I = (Beg - This()) / kReleasePageSize;
+         I < (End - This() + kReleasePageSize - 1) / kReleasePageSize; I++)
+      if (Vec[I] & 1) return true;
+    return false;
+  }
+
+  // The state array as 8-byte words, so that the release can move 8 chunks
+  // to RELEASING with one CAS. The array is 8-byte aligned, its tail after
+  // NumChunks is always AVAILABLE, and the words are little-endian.
+  uint64_t *StateWords(SizeClassDescr SCD) {
+    return reinterpret_cast<uint64_t *>(State(SCD.NumChunks, SCD.RangeNum));
+  }
+
+  // Returns the number of released bytes. Sets *Pending if there is free
+  // resident memory that is not old enough to be released yet. With Force,
+  // all free memory is old enough.
+  size_t MaybeReleaseToOs(uint16_t Now, bool *Pending, bool Force = false) {
     // fprintf(stderr, "MaybeReleaseToOs %p\n", this);
     auto SCD = GetSCD();
+    if (SCD.ChunkSize() >= kReleasePageSize)
+      return ReleaseFreePages(SCD, Now, Pending, Force);
     size_t NumChunks = SCD.NumChunks;
-    size_t Ava = CountAvailable();
-    if (Ava != NumChunks) return;
+    if (NumUsed() || QuarantinedBytes()) {
+      *PageAgePtr(This()) = 0;
+      return 0;
+    }
+    if (IsReleased(This())) return 0;
+    unsigned char Vec[kPagesPerSuperPage];
+    GetResidentPages(Vec);
+    if (!IsResident(This(), This() + NumChunks * SCD.ChunkSize(), Vec))
+      return 0;  // Never touched.
+    if (!Force && !IsOldEnough(This(), Now)) {
+      *Pending = true;
+      return 0;
+    }
+    uint64_t *W = StateWords(SCD);
+    size_t NumWords = RoundUpTo(NumChunks, 8) / 8;
     size_t NumReadyToRelease = 0;
-    IterateStates([&](uint8_t &S) {
-      uint8_t ExpectedState = AVAILABLE;
-      uint8_t NewState = RELEASING;
-      if (__atomic_compare_exchange_n(&S, &ExpectedState, NewState, false,
-                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
-        NumReadyToRelease++;
-    });
-    if (NumReadyToRelease == NumChunks) {
-      madvise(this, kSuperPageSize, MADV_DONTNEED);
-      if (SCD.RangeNum == 1)  // state is stored separately.
-        IterateStates([](uint8_t &S) {
-          __atomic_store_n(&S, AVAILABLE, __ATOMIC_RELAXED);
-        });
-    } else {
-      IterateStates([](uint8_t &S) {
-        if (__atomic_load_n(&S, __ATOMIC_RELAXED) == RELEASING)
-          __atomic_store_n(&S, AVAILABLE, __ATOMIC_RELAXED);
-      });
+    for (; NumReadyToRelease < NumWords; NumReadyToRelease++) {
+      uint64_t Expected = 0;  // 8 AVAILABLE chunks.
+      if (!__atomic_compare_exchange_n(&W[NumReadyToRelease], &Expected,
+                                       ~0ULL /*8 x RELEASING*/, false,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;  // The counters were off.
     }
+    bool Released = NumReadyToRelease == NumWords;
+    if (Released) {
+      ReleasePages(This(), End());
+      *PageAgePtr(This()) = kReleasedAge;
+    }
+    // With MADV_DONTNEED the inline state is now all zeros (AVAILABLE).
+    if (!Released || SCD.RangeNum == 1 || Config.ReleaseMadvFree)
+      for (size_t I = 0; I < NumReadyToRelease; I++)
+        __atomic_store_n(&W[I], 0, __ATOMIC_RELAXED);
     if (0)
-      fprintf(
-          stderr, "SP %p: %s\n", this,
-          NumReadyToRelease == NumChunks ? "released" : "failed to release");
+      fprintf(stderr, "SP %p: %s\n", this,
+              Released ? "released" : "failed to release");
+    return Released ? kSuperPageSize : 0;
+  }
+
+  // Releases the whole pages of old enough free chunks. A chunk is moved
+  // to RELEASING while its pages are released, so that it is not allocated.
+  // The state (if inline) is never released, since it is after the chunks.
+  // A page shared by two chunks is released once both are free, so the
+  // free chunks that are already released are moved to RELEASING too: a
+  // page is released if all the chunks it intersects with are, and these
+  // pages are neither released nor counted again.
+  size_t ReleaseFreePages(SizeClassDescr SCD, uint16_t Now, bool *Pending,
+                          bool Force) {
+    size_t ChunkSize = SCD.ChunkSize();
+    size_t N = SCD.NumChunks;
+    if (NumUsed() + QuarantinedBytes() / ChunkSize >= N) {
+      // Nothing is free; forget the ages so that the chunks start over
+      // when they are freed.
+      for (size_t Idx = 0; Idx < N; Idx++)
+        *PageAgePtr(RoundDownTo(This() + Idx * ChunkSize, kReleasePageSize)) =
+            0;
+      return 0;
+    }
+    unsigned char Vec[kPagesPerSuperPage];
+    GetResidentPages(Vec);
+    uint8_t *S = State(N, SCD.RangeNum);
+    uint64_t *W = StateWords(SCD);
+    // The age of a chunk is the age of the page it starts on; since chunks
+    // are at least a page, no two chunks start on the same page.
+    auto ChunkAge = [&](size_t Idx) {
+      return PageAgePtr(RoundDownTo(This() + Idx * ChunkSize, kReleasePageSize));
+    };
+    bool AnyNew = false, AnyReleasing = false;
+    for (size_t WordIdx = 0; WordIdx < RoundUpTo(N, 8) / 8; WordIdx++) {
+      uint64_t Old = __atomic_load_n(&W[WordIdx], __ATOMIC_RELAXED);
+      uint64_t New = Old;
+      bool WordHasNew = false;
+      for (size_t Idx = WordIdx * 8; Idx < std::min(N, WordIdx * 8 + 8);
+           Idx++) {
+        size_t Shift = 8 * (Idx % 8);
+        uintptr_t Beg = This() + Idx * ChunkSize;
+        if (((Old >> Shift) & 0xff) != AVAILABLE) {
+          *ChunkAge(Idx) = 0;
+          continue;
+        }
+        if (*ChunkAge(Idx) != kReleasedAge) {
+          if (!IsResident(Beg, Beg + ChunkSize, Vec)) continue;
+          if (!Force && !IsOldEnough(Beg, Now)) {
+            *Pending = true;
+            continue;
+          }
+          WordHasNew = true;
+        }
+        New |= uint64_t(RELEASING) << Shift;
+      }
+      // If some chunks were allocated since, we'll try again next time.
+      if (New != Old &&
+          __atomic_compare_exchange_n(&W[WordIdx], &Old, New, false,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        AnyReleasing = true;
+        AnyNew |= WordHasNew;
+      }
+    }
+    if (!AnyReleasing) return 0;
+    // Release the whole pages of every run of RELEASING chunks, but for
+    // the ones that are released already.
+    size_t ReleasedBytes = 0;
+    for (size_t Idx = 0; Idx < N;) {
+      if (S[Idx] != RELEASING) {
+        Idx++;
+        continue;
+      }
+      size_t RunEnd = Idx;
+      while (RunEnd < N && S[RunEnd] == RELEASING) RunEnd++;
+      uintptr_t Beg = RoundUpTo(This() + Idx * ChunkSize, kReleasePageSize);
+      uintptr_t End = RoundDownTo(This() + RunEnd * ChunkSize, kReleasePageSize);
+      uintptr_t ToReleaseBeg = 0;
+      for (uintptr_t Page = Beg; AnyNew && Page <= End;
+           Page += kReleasePageSize) {
+        bool Done = Page == End;
+        if (!Done) {
+          Done = true;
+          for (size_t C = (Page - This()) / ChunkSize;
+               C <= (Page + kReleasePageSize - 1 - This()) / ChunkSize; C++)
+            Done &= *ChunkAge(C) == kReleasedAge;
+        }
+        if (!Done && !ToReleaseBeg) ToReleaseBeg = Page;
+        if (Done && ToReleaseBeg) {
+          ReleasePages(ToReleaseBeg, Page);
+          ReleasedBytes += Page - ToReleaseBeg;
+          ToReleaseBeg = 0;
+        }
+      }
+      for (; Idx < RunEnd; Idx++) {
+        if (AnyNew) *ChunkAge(Idx) = kReleasedAge;
+        __atomic_store_n(&S[Idx], AVAILABLE, __ATOMIC_RELAXED);
+      }
+    }
+    return ReleasedBytes;
   }
 };
 
@@ -599,16 +857,35 @@ SuperPage *GetSuperPage(size_t RangeNum, size_t Idx) {
 }
 
 
+// Per-thread (TLS.Stats) and merged (Allocator::CollectStats()) counters.
+// The allocation and deallocation counts are always on, the rest is updated
+// only with PrintStats or the tsan callbacks.
 struct Statistics {
   uint64_t AllocsPerSizeClass[kNumSizeClasses];
+  uint64_t FreesPerSizeClass[kNumSizeClasses];
   uint64_t AccessesPerSizeClass[kNumSizeClasses];
   uint64_t LargeAllocs;
   uint64_t AccessOther;
 
-  void MergeFrom(Statistics *From) {
+  // Bytes in live small chunks (including the unused tails of the chunks).
+  size_t LiveBytes() const {
+    size_t Res = 0;
+    for (size_t i = 0; i < kNumSizeClasses; i++)
+      Res += LiveBytes(i);
+    return Res;
+  }
+  size_t LiveBytes(size_t SC) const {
+    // Frees may be ahead in a snapshot of live threads' counters.
+    uint64_t Allocs = AllocsPerSizeClass[SC], Frees = FreesPerSizeClass[SC];
+    return Allocs > Frees ? (Allocs - Frees) * SCDescr[SC].ChunkSize() : 0;
+  }
+
+  void MergeFrom(const Statistics *From) {
     for (size_t i = 0; i < kNumSizeClasses; i++) {
       __atomic_fetch_add(&AllocsPerSizeClass[i], From->AllocsPerSizeClass[i],
                          __ATOMIC_RELAXED);
+      __atomic_fetch_add(&FreesPerSizeClass[i], From->FreesPerSizeClass[i],
+                         __ATOMIC_RELAXED);
       __atomic_fetch_add(&AccessesPerSizeClass[i],
                          From->AccessesPerSizeClass[i], __ATOMIC_RELAXED);
     }
@@ -619,8 +896,9 @@ struct Statistics {
   void Print() {
     for (uint8_t i = 0; i < kNumSizeClasses; i++)
       if (auto Allocs = AllocsPerSizeClass[i])
-        fprintf(stderr, "stat.allocs sc %d\tsize\t%zd\tcount %zd\n", i,
-                SizeClassToSize({i}), Allocs);
+        fprintf(stderr, "stat.allocs sc %d\tsize\t%zd\tcount %zd\tlive %zd\n",
+                i, SizeClassToSize({i}), Allocs,
+                Allocs - FreesPerSizeClass[i]);
     if (LargeAllocs) fprintf(stderr, "stat.large_allocs %zd\n", LargeAllocs);
     for (uint8_t i = 0; i < kNumSizeClasses; i++)
       if (auto Accesses = AccessesPerSizeClass[i])
@@ -630,14 +908,57 @@ struct Statistics {
   }
 };
 
+// The paths of malloc() and free() for the sampled latencies
+// (MTM_LATENCY_SAMPLE). The allocator records in TLS.LatencyPath the
+// slowest path it took.
+enum LatencyPath {
+  kMallocFast,       // From the current SuperPage of the thread.
+  kMallocSlow,       // AllocateSlower(): searching for another SuperPage.
+  kMallocSuperPage,  // AllocateSuperPage().
+  kMallocScan,       // Scan() (e.g. because of the soft limit).
+  kMallocLarge,      // LargeAllocator.
+  kFreeFast,         // Deallocate() or Quarantine().
+  kFreeScan,         // The quarantine is full: Scan().
+  kFreeLarge,        // LargeAllocator.
+  kNumLatencyPaths
+};
+
+inline constexpr const char *LatencyPathNames[kNumLatencyPaths] = {
+    "malloc_fast", "malloc_slow", "malloc_super_page", "malloc_scan",
+    "malloc_large", "free_fast",   "free_scan",         "free_large"};
+
+// Sampled latencies of malloc() and free() by path, in ReadCycleCounter()
+// ticks. Mapped on the first sample of a thread.
+struct LatencyHistograms {
+  Histogram Paths[kNumLatencyPaths];
+
+  void MergeFrom(const LatencyHistograms &From) {
+    for (size_t P = 0; P < kNumLatencyPaths; P++)
+      Paths[P].MergeFrom(From.Paths[P]);
+  }
+};
+
 struct ThreadLocalAllocator {
   uint32_t Rand;
+  // Calls to the next latency sample, and the path of the current call.
+  uint32_t LatencyCountdown;
+  uint8_t LatencyPath;
+  // Set by Allocator::UnregisterThread(): nothing is recorded after that.
+  bool Exited;
+  LatencyHistograms *Latency;
   size_t LocalQuarantineSize;
+  // Bytes allocated minus freed by this thread that are not yet added to
+  // Allocator::LiveBytes.
+  int64_t LocalLiveBytes;
   struct {
     SuperPage *SP;
     size_t LastIdxHint;
   } PerSC[kNumSizeClasses];
   Statistics Stats;
+  // The list of the live threads, see Allocator::RegisterThread().
+  ThreadLocalAllocator *Prev, *Next;
+  // The stack pointer while parked by Allocator::StopTheWorld(), or 0.
+  uintptr_t ParkedSp;
 };
 
 __attribute__((tls_model("initial-exec")))
@@ -650,19 +971,74 @@ static inline uint32_t RandR(uint32_t *State) {
   return NewState >> 16;
 }
 
-struct ScopedLock {
-  ScopedLock(pthread_mutex_t &Mu, int line) : Mu(Mu) {
-    //fprintf(stderr, "Trying    %p line %d\n", &Mu, line);
-    pthread_mutex_lock(&Mu);
-    //fprintf(stderr, "Acquired  %p line %d\n", &Mu, line);
+// The result of Allocator::LeakCheck(): the live chunks that are not
+// reachable from the roots, by size class (the last one is for the large
+// chunks), and the first few of them.
+struct LeakReport {
+  static constexpr size_t kMaxExamples = 16;
+  size_t NumLeaks[kNumSizeClasses + 1];
+  size_t LeakedBytes[kNumSizeClasses + 1];
+  struct {
+    uintptr_t Beg;
+    size_t Size;
+  } Examples[kMaxExamples];
+  size_t NumExamples;
+  size_t TimeUs;
+  // Not 0 (an errno value) if the roots could not be found, so there is no
+  // result.
+  int RootsError;
+
+  void Add(size_t SC, uintptr_t Beg, size_t Size) {
+    NumLeaks[SC]++;
+    LeakedBytes[SC] += Size;
+    if (NumExamples < kMaxExamples) Examples[NumExamples++] = {Beg, Size};
   }
-  ~ScopedLock() {
-    //fprintf(stderr, "Releasing %p\n", &Mu);
-    pthread_mutex_unlock(&Mu);
+
+  size_t TotalLeaks() const {
+    size_t Res = 0;
+    for (size_t SC = 0; SC <= kNumSizeClasses; SC++) Res += NumLeaks[SC];
+    return Res;
+  }
+
+  size_t TotalBytes() const {
+    size_t Res = 0;
+    for (size_t SC = 0; SC <= kNumSizeClasses; SC++) Res += LeakedBytes[SC];
+    return Res;
+  }
+
+  void Print() const {
+    fprintf(stderr, "MTMalloc: LeakCheck: %zd leaks, %zd bytes (%zd us)\n",
+            TotalLeaks(), TotalBytes(), TimeUs);
+    for (size_t SC = 0; SC <= kNumSizeClasses; SC++) {
+      if (!NumLeaks[SC]) continue;
+      if (SC == kNumSizeClasses)
+        fprintf(stderr, "  large: %zd leaks, %zd bytes\n", NumLeaks[SC],
+                LeakedBytes[SC]);
+      else
+        fprintf(stderr, "  size class %zd (%zd bytes): %zd leaks, %zd bytes\n",
+                SC, SCDescr[SC].ChunkSize(), NumLeaks[SC], LeakedBytes[SC]);
+    }
+    for (size_t I = 0; I < NumExamples; I++)
+      fprintf(stderr, "  leaked %zd bytes at %p\n", Examples[I].Size,
+              reinterpret_cast<void *>(Examples[I].Beg));
   }
-  pthread_mutex_t &Mu;
 };
 
+// The phases of Scan(), timed separately. The other threads are not
+// stopped: they scan in the SIGUSR2 handler and continue on their own, so
+// Wait is the time the scanning thread waits for the last of them.
+enum ScanPhase {
+  kScanStop,   // PrepareScan() and signaling the threads.
+  kScanMark,   // ScanLoop() in the scanning thread.
+  kScanWait,   // Until all the threads are out of ScanLoop().
+  kScanSweep,  // PostScan() and LargeAllocator::FinishScan().
+  kScanPause,  // All of the above.
+  kNumScanPhases
+};
+
+inline constexpr const char *ScanPhaseNames[kNumScanPhases] = {
+    "stop", "mark", "wait", "sweep", "pause"};
+
 struct Allocator {
   static pthread_key_t TSDKey;
   static pthread_once_t TSDOKeyOnce;
@@ -674,23 +1050,67 @@ struct Allocator {
   pthread_mutex_t Mu;
   pthread_cond_t Cv;
   static Allocator *SingletonSelf;
+  // Large chunks are scanned and quarantined together with the small ones.
+  static LargeAllocator *Large;
   size_t NumScans;
+  size_t LastScanTimeUs;
+  // Durations of the phases of every scan, in microseconds. Under Mu.
+  Histogram ScanPhaseUs[kNumScanPhases];
+  // The threads that took part in the current scan, and the work they did
+  // (SuperPages and large scan tasks).
+  size_t NumScanWorkers;  // atomic
+  size_t ScanWorkDone;  // atomic
   size_t NumSuperPages[kNumSizeClassRanges];  // atomic
   size_t GetNumSuperPages(size_t RangeNum) {
     return __atomic_load_n(&NumSuperPages[RangeNum], __ATOMIC_ACQUIRE);
   }
 
   size_t BytesInQuarantine; // atomic outside of scan.
+  size_t ReleasedBytes;  // atomic, by the release thread.
+  // The release queue: a lock-free stack of SuperPages that may have free
+  // memory to release (1 + index of the top SuperPage, or 0). The release
+  // thread waits on it (as a futex) while it is empty.
+  uint32_t ReleaseQueueHead;  // atomic
   size_t ScanPos[kNumSizeClassRanges];  // atomic
   size_t LastQurantineSize;
 
   size_t DataOnlyScopeLevel;
+  // Until when (in usec()) the quarantine is kept smaller after memory
+  // pressure, see OnMemoryPressure().
+  size_t PressureUntil;  // atomic
+  // The RSS above which MaybeEnforceSoftLimit() acts (0: Config.SoftLimit).
+  size_t SoftLimitNext;  // atomic
+  // The SuperPages and large chunks when the RSS was last looked at.
+  size_t SoftLimitCheckedAt;  // atomic
+  size_t SoftLimitHits;
+  // The live threads, whose TLS.Stats are merged on demand by
+  // CollectStats(); the stats of the exited threads are merged into Stats.
+  pthread_mutex_t ThreadsMu;
+  ThreadLocalAllocator *Threads;
+  // Bytes in live small chunks, which the threads add in steps of at least
+  // kLiveBytesFlush, and its maximum (together with the large chunks).
+  int64_t LiveBytes;  // atomic
+  size_t PeakLiveBytes;  // atomic
+  // The latencies of the exited threads. Under ThreadsMu.
+  LatencyHistograms ExitedLatency;
+  // Threads currently inside ScanLoop(); the scanning thread waits for
+  // them before looking at the marks.
+  size_t ActiveScanWorkers;  // atomic
+  // Set while Iterate() has stopped the world: the SIGUSR2 handler parks
+  // the threads (counted in NumParked) instead of scanning.
+  int WorldStopped;  // atomic
+  size_t NumParked;  // atomic
 
   __attribute__((noinline))
   size_t ScanLoop() {
+    __atomic_add_fetch(&ActiveScanWorkers, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&NumScanWorkers, 1, __ATOMIC_RELAXED);
     const size_t kPosIncrement = 1024;
     size_t NumSuperPages[kNumSizeClassRanges] = {GetNumSuperPages(0),
                                                  GetNumSuperPages(1)};
+    SuperPage::ScanBounds B = {
+        {NumSuperPages[0] * kSuperPageSize, NumSuperPages[1] * kSuperPageSize},
+        Large ? Large->GetScanRegionSize() : 0};
     size_t NumDone = 0;
     for (size_t RangeNum : {0, 1}) {
       size_t N = NumSuperPages[RangeNum];
@@ -702,9 +1122,17 @@ struct Allocator {
         size_t EndIdx = std::min(N, Pos + kPosIncrement);
         NumDone += EndIdx - Pos;
         for (size_t SPIdx = Pos; SPIdx < EndIdx; SPIdx++)
-          GetSuperPage(RangeNum, SPIdx)->MarkAllLivePointers(NumSuperPages);
+          GetSuperPage(RangeNum, SPIdx)->MarkAllLivePointers(B);
       }
     }
+    if (Large)
+      while (Large->ScanNextTask([&](uintptr_t Beg, uintptr_t End) {
+        SuperPage::MarkRange(reinterpret_cast<uint8_t *>(Beg),
+                             reinterpret_cast<uint8_t *>(End), B);
+      }))
+        NumDone++;
+    __atomic_add_fetch(&ScanWorkDone, NumDone, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&ActiveScanWorkers, 1, __ATOMIC_SEQ_CST);
     return NumDone;
     // fprintf(stderr, "ScanLoop TID %d done %zd\n", gettid(), NumDone);
   }
@@ -721,10 +1149,15 @@ struct Allocator {
         size_t NumChunks = SCD.NumChunks;
         size_t ChunkSize = SCD.ChunkSize();
         // if (!WasInQuarantine) continue; // nothing to do.
-        SP->MoveFromQuarantineToAvailable();
+        size_t NumMoved = SP->MoveFromQuarantineToAvailable();
         size_t NowInQuorantine = SP->CountQuarantined();
         if (NowInQuorantine)
           NewBytesInQuarantine += ChunkSize * NowInQuorantine;
+        if (NumMoved && SP->WorthReleasing(SCD)) {
+          // Quarantine() did it for the big chunks.
+          if (ChunkSize < kReleasePageSize) SP->ForgetReleased(SP->This());
+          if (Config.ReleaseFreq) QueueForRelease(SP);
+        }
         if (Verbose)
           fprintf(stderr,
                   "--- %p SC %d marked %zd quarantined %zd=>%zd available "
@@ -741,11 +1174,18 @@ struct Allocator {
 
   __attribute__((noinline))
   void Scan() {
+    uint64_t PhaseBeg[kNumScanPhases + 1];
+    PhaseBeg[kScanStop] = nsec();
+    TLS.LatencyPath = TLS.LatencyPath < kFreeFast ? kMallocScan : kFreeScan;
     for (size_t RangeNum : {0, 1})
       __atomic_store_n(&ScanPos[RangeNum], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&NumScanWorkers, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ScanWorkDone, 0, __ATOMIC_RELAXED);
+    // Before waking up the other threads, so that they find the large tasks.
+    if (Large) Large->PrepareScan();
     size_t NumSeenThreads = KillAllThreadsButMyself();
     NumScans++;
-    size_t time1 = usec();
+    PhaseBeg[kScanMark] = nsec();
     bool Verbose = Config.PrintScan;
     if (Verbose)
       fprintf(stderr, "scan1 %p %p %zd %zd\n", (void *)kFirstSuperPage[0],
@@ -753,20 +1193,82 @@ struct Allocator {
               GetNumSuperPages(1));
 
     size_t NumDoneInThisThread = ScanLoop();
+    PhaseBeg[kScanWait] = nsec();
+    // All the work has been taken, but other threads may still be doing it.
+    while (__atomic_load_n(&ActiveScanWorkers, __ATOMIC_SEQ_CST))
+      sched_yield();
+    PhaseBeg[kScanSweep] = nsec();
     size_t NewBytesInQuarantine = PostScan(Verbose);
-    size_t time2 = usec();
-
-    // if (Verbose)
-    fprintf(
-        stderr,
-        "Scan %zd: tid %d BytesInQuarantine %zdM => %zdM; "
-        "SuperPages %zd / %zd Allocated %zdM RSS %zdM time %zd threads %zd\n",
-        NumScans, GetTID(), BytesInQuarantine >> 20, NewBytesInQuarantine >> 20,
-        GetNumSuperPages(0) + GetNumSuperPages(1), NumDoneInThisThread,
-        ((GetNumSuperPages(0) + GetNumSuperPages(1)) * kSuperPageSize) >> 20,
-        GetRss() >> 20, time2 - time1, NumSeenThreads);
+    if (Large) NewBytesInQuarantine += Large->FinishScan();
+    PhaseBeg[kScanPause] = nsec();
+
+    size_t PhaseUs[kNumScanPhases];
+    for (size_t P = kScanStop; P < kScanPause; P++)
+      PhaseUs[P] = (PhaseBeg[P + 1] - PhaseBeg[P]) / 1000;
+    PhaseUs[kScanPause] = (PhaseBeg[kScanPause] - PhaseBeg[kScanStop]) / 1000;
+    for (size_t P = 0; P < kNumScanPhases; P++)
+      ScanPhaseUs[P].Add(PhaseUs[P]);
+    LastScanTimeUs = PhaseUs[kScanPause];
+    size_t NumWorkers = __atomic_load_n(&NumScanWorkers, __ATOMIC_RELAXED);
+    size_t WorkDone = __atomic_load_n(&ScanWorkDone, __ATOMIC_RELAXED);
+
+    if (Config.ScanLog) {
+      // One JSON object per line.
+      fprintf(stderr,
+              "{\"scan\": %zd, \"tid\": %d, \"pause_us\": %zd, "
+              "\"stop_us\": %zd, \"mark_us\": %zd, \"wait_us\": %zd, "
+              "\"sweep_us\": %zd, \"threads\": %zd, \"workers\": %zd, "
+              "\"work\": %zd, \"self_work\": %zd, \"quarantine_before\": %zd, "
+              "\"quarantine_after\": %zd, \"super_pages\": %zd, "
+              "\"rss\": %zd}\n",
+              NumScans, GetTID(), PhaseUs[kScanPause], PhaseUs[kScanStop],
+              PhaseUs[kScanMark], PhaseUs[kScanWait], PhaseUs[kScanSweep],
+              NumSeenThreads, NumWorkers, WorkDone, NumDoneInThisThread,
+              BytesInQuarantine, NewBytesInQuarantine,
+              GetNumSuperPages(0) + GetNumSuperPages(1), GetRss());
+    } else {
+      fprintf(
+          stderr,
+          "Scan %zd: tid %d BytesInQuarantine %zdM => %zdM; "
+          "SuperPages %zd / %zd Allocated %zdM RSS %zdM time %zd threads %zd\n",
+          NumScans, GetTID(), BytesInQuarantine >> 20,
+          NewBytesInQuarantine >> 20, GetNumSuperPages(0) + GetNumSuperPages(1),
+          NumDoneInThisThread,
+          ((GetNumSuperPages(0) + GetNumSuperPages(1)) * kSuperPageSize) >> 20,
+          GetRss() >> 20, PhaseUs[kScanPause], NumSeenThreads);
+    }
     LastQurantineSize = BytesInQuarantine = NewBytesInQuarantine;
+  }
+
+  // Prints the sampled malloc/free latency percentiles, in nanoseconds.
+  void PrintLatency() {
+    if (!Config.LatencySample) return;
+    LatencyHistograms L;
+    CollectLatency(&L);
+    double NsPerTick = CycleCounterNsPerTick();
+    for (size_t P = 0; P < kNumLatencyPaths; P++) {
+      const Histogram &H = L.Paths[P];
+      if (!H.Count) continue;
+      fprintf(stderr,
+              "stat.latency_%s_ns count %zd mean %.0f p50 %.0f p90 %.0f "
+              "p99 %.0f max %.0f\n",
+              LatencyPathNames[P], H.Count, H.Mean() * NsPerTick,
+              H.Percentile(50) * NsPerTick, H.Percentile(90) * NsPerTick,
+              H.Percentile(99) * NsPerTick, H.Max * NsPerTick);
+    }
+  }
 
+  // Prints the scan phase percentiles, in microseconds.
+  void PrintScanPhases() {
+    if (!NumScans) return;
+    for (size_t P = 0; P < kNumScanPhases; P++) {
+      const Histogram &H = ScanPhaseUs[P];
+      fprintf(stderr,
+              "stat.scan_%s_us count %zd mean %zd p50 %zd p90 %zd p99 %zd "
+              "max %zd\n",
+              ScanPhaseNames[P], H.Count, H.Mean(), H.Percentile(50),
+              H.Percentile(90), H.Percentile(99), H.Max);
+    }
   }
 
   __attribute__((always_inline))
@@ -776,25 +1278,128 @@ struct Allocator {
     SizeClass SC  = SizeToSizeClass(Size, SCD);
 
     auto &PerSC = TLS.PerSC[SC.v];
-    if (Config.PrintStats) TLS.Stats.AllocsPerSizeClass[SC.v]++;
 
     if (PerSC.SP)
       if (void *Res = PerSC.SP->TryAllocate(DataOnlyScopeLevel, SCD,
-                                            &PerSC.LastIdxHint))
+                                            &PerSC.LastIdxHint)) {
+        CountAllocation(SC, SCD);
         return Res;
+      }
     return AllocateSlower(Size);
   }
 
+  static constexpr int64_t kLiveBytesFlush = 1 << 20;
+
+  __attribute__((always_inline))
+  void CountAllocation(SizeClass SC, SizeClassDescr SCD) {
+    TLS.Stats.AllocsPerSizeClass[SC.v]++;
+    if ((TLS.LocalLiveBytes += SCD.ChunkSize()) >= kLiveBytesFlush)
+      FlushLiveBytes();
+  }
+
+  __attribute__((always_inline))
+  void CountDeallocation(SizeClass SC) {
+    // A thread may free without ever allocating.
+    if (__builtin_expect(!TLS.Rand, 0)) InitThread();
+    TLS.Stats.FreesPerSizeClass[SC.v]++;
+    if ((TLS.LocalLiveBytes -= SCDescr[SC.v].ChunkSize()) <= -kLiveBytesFlush)
+      FlushLiveBytes();
+  }
+
   __attribute__((noinline))
-  void *AllocateSlower(size_t Size) {
-    if (!TLS.Rand) {
-      SingletonSelf = this;
-      pthread_once(&InitAllOnce, InitSingleton);
-      pthread_once(&TSDOKeyOnce, TSDCreate);
-      pthread_setspecific(TSDKey, (void*)32UL);
-      // fprintf(stderr, "Thread first seen tid %d TLS %p\n", GetTID(), &TLS);
-      TLS.Rand = pthread_self();
+  void FlushLiveBytes() {
+    __atomic_add_fetch(&LiveBytes, TLS.LocalLiveBytes, __ATOMIC_RELAXED);
+    TLS.LocalLiveBytes = 0;
+    UpdatePeakLiveBytes();
+  }
+
+  // Also called after every large allocation.
+  void UpdatePeakLiveBytes() {
+    int64_t Live = __atomic_load_n(&LiveBytes, __ATOMIC_RELAXED) +
+                   (Large ? Large->GetLiveBytes() : 0);
+    size_t Peak = __atomic_load_n(&PeakLiveBytes, __ATOMIC_RELAXED);
+    while (Live > (int64_t)Peak &&
+           !__atomic_compare_exchange_n(&PeakLiveBytes, &Peak, Live, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
     }
+  }
+
+  // Called once per thread, on its first allocation or deallocation, so that
+  // its stats are merged on exit (see TSDOnThreadExit()). TLS.Rand is set
+  // first: pthread_setspecific() may allocate.
+  __attribute__((noinline))
+  void InitThread() {
+    InitOnce();
+    TLS.Rand = pthread_self();
+    pthread_once(&TSDOKeyOnce, TSDCreate);
+    pthread_setspecific(TSDKey, (void*)32UL);
+    RegisterThread();
+  }
+
+  void RegisterThread() {
+    ScopedLock Lock(ThreadsMu, __LINE__);
+    TLS.Prev = nullptr;
+    TLS.Next = Threads;
+    if (Threads) Threads->Prev = &TLS;
+    Threads = &TLS;
+  }
+
+  // Called on thread exit. Whatever the thread allocates or frees after
+  // that (e.g. in other TSD destructors) is not counted in the stats.
+  void UnregisterThread() {
+    if (TLS.Exited) return;
+    TLS.Exited = true;
+    FlushLiveBytes();
+    ScopedLock Lock(ThreadsMu, __LINE__);
+    Stats.MergeFrom(&TLS.Stats);
+    memset(&TLS.Stats, 0, sizeof(TLS.Stats));
+    if (LatencyHistograms *L = TLS.Latency) {
+      TLS.Latency = nullptr;
+      ExitedLatency.MergeFrom(*L);
+      munmap(L, sizeof(*L));
+    }
+    (TLS.Prev ? TLS.Prev->Next : Threads) = TLS.Next;
+    if (TLS.Next) TLS.Next->Prev = TLS.Prev;
+    TLS.Prev = TLS.Next = nullptr;
+  }
+
+  // Called on a sampled malloc() or free(), with the elapsed ticks.
+  void RecordLatency(uint64_t Ticks) {
+    if (!TLS.Rand) InitThread();
+    // A later TSD destructor: its histograms would never be merged.
+    if (TLS.Exited) return;
+    if (!TLS.Latency) {
+      void *Map = mmap(nullptr, sizeof(LatencyHistograms),
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1, 0);
+      if (Map == MAP_FAILED) return;
+      ScopedLock Lock(ThreadsMu, __LINE__);  // For CollectLatency().
+      TLS.Latency = reinterpret_cast<LatencyHistograms *>(Map);
+    }
+    TLS.Latency->Paths[TLS.LatencyPath].Add(Ticks);
+  }
+
+  void CollectLatency(LatencyHistograms *Res) {
+    ScopedLock Lock(ThreadsMu, __LINE__);
+    *Res = ExitedLatency;
+    for (ThreadLocalAllocator *T = Threads; T; T = T->Next)
+      if (T->Latency) Res->MergeFrom(*T->Latency);
+  }
+
+  // Merges the stats of all the threads, live and exited, into *Res.
+  // The counters of the live threads are read while they are being updated,
+  // so the result is approximate, but cheap: no SuperPage is looked at.
+  void CollectStats(Statistics *Res) {
+    ScopedLock Lock(ThreadsMu, __LINE__);
+    *Res = Stats;
+    for (ThreadLocalAllocator *T = Threads; T; T = T->Next)
+      Res->MergeFrom(&T->Stats);
+  }
+
+  __attribute__((noinline))
+  void *AllocateSlower(size_t Size) {
+    TLS.LatencyPath = kMallocSlow;
+    if (!TLS.Rand) InitThread();
     // Remember that on the first call the size class table is not yet set up.
     SizeClassDescr SCD;
     SizeClass SC  = SizeToSizeClass(Size, SCD);
@@ -809,11 +1414,14 @@ struct Allocator {
         if (Idx >= N) Idx -= N;
         if (Meta[Idx] == SC.v) {
           auto SP = PerSC->SP = GetSuperPage(SCD.RangeNum, Idx);
-          if (void *Res =
-                  SP->TryAllocate(DataOnlyScopeLevel, SCD, &PerSC->LastIdxHint))
+          if (void *Res = SP->TryAllocate(DataOnlyScopeLevel, SCD,
+                                          &PerSC->LastIdxHint)) {
+            CountAllocation(SC, SCD);
             return Res;
+          }
         }
       }
+      MaybeEnforceSoftLimit();
       AllocateSuperPage(Size);
       PerSC->LastIdxHint = 0;
     }
@@ -897,7 +1505,9 @@ struct Allocator {
     uintptr_t StartSP = RoundDownTo(P, kSuperPageSize);
     if (StartSP < kAllocatorSpace) TRAP();
     if (StartSP >= kAllocatorSpace + kAllocatorSize) TRAP();
-    reinterpret_cast<SuperPage*>(StartSP)->Deallocate(Ptr);
+    auto SP = reinterpret_cast<SuperPage*>(StartSP);
+    if (SP->Deallocate(Ptr) && Config.ReleaseFreq) QueueForRelease(SP);
+    CountDeallocation(SP->GetSC());
   }
 
   void Quarantine(void *Ptr) {
@@ -908,15 +1518,28 @@ struct Allocator {
     if (StartSP >= kAllocatorSpace + kAllocatorSize) TRAP();
 //    fprintf(stderr, "Quarantine: %p %zd %zd\n", Ptr, TLS.LocalQuarantineSize,
 //            BytesInQuarantine);
-    TLS.LocalQuarantineSize += A2SP(StartSP)->Quarantine(Ptr);
+    auto SP = A2SP(StartSP);
+    TLS.LocalQuarantineSize += SP->Quarantine(Ptr);
+    CountDeallocation(SP->GetSC());
   }
 
   void QuarantineAndMaybeScan(void *Ptr, size_t MaxQuarantineSize) {
     Quarantine(Ptr);
+    MaybeScan(MaxQuarantineSize);
+  }
+
+  // Large chunks go through the same quarantine budget as the small ones.
+  void QuarantineLargeAndMaybeScan(void *Ptr, size_t MaxQuarantineSize) {
+    TLS.LocalQuarantineSize += Large->Quarantine(Ptr);
+    MaybeScan(MaxQuarantineSize);
+  }
+
+  void MaybeScan(size_t MaxQuarantineSize) {
     if (TLS.LocalQuarantineSize >= kSizeOfLocalQuarantine) {
       size_t TotalQuarantineSize = __atomic_add_fetch(
           &BytesInQuarantine, TLS.LocalQuarantineSize, __ATOMIC_RELAXED);
       TLS.LocalQuarantineSize = 0;
+      if (UnderPressure()) MaxQuarantineSize /= kPressureQuarantineDivisor;
       size_t Limit = MaxQuarantineSize + LastQurantineSize;
       if (TotalQuarantineSize > Limit) {
         ScopedLock Lock(Mu, __LINE__);
@@ -927,14 +1550,233 @@ struct Allocator {
     }
   }
 
+  // Pushes SP to the release queue, unless it is already there.
+  // Called on every deallocation, so the common case is just one load.
+  void QueueForRelease(SuperPage *SP, bool Wake = true) {
+    SuperPageInfo *Info = SP->Info();
+    if (__atomic_load_n(&Info->Queued, __ATOMIC_RELAXED)) return;
+    if (__atomic_exchange_n(&Info->Queued, 1, __ATOMIC_ACQUIRE)) return;
+    uint32_t Idx = (SP->This() - kAllocatorSpace) / kSuperPageSize + 1;
+    uint32_t Head = __atomic_load_n(&ReleaseQueueHead, __ATOMIC_RELAXED);
+    do {
+      Info->Next = Head;
+    } while (!__atomic_compare_exchange_n(&ReleaseQueueHead, &Head, Idx, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (!Head && Wake) FutexWake(&ReleaseQueueHead);
+  }
+
+  // Takes all the SuperPages from the release queue and tries to release
+  // their free memory. The ones with free memory that is not old enough
+  // yet are queued again, unless the release thread has been turned off
+  // (config.release_freq_ms 0), which would make it spin. Returns the
+  // number of released bytes.
+  size_t ReleaseQueuedSuperPages() {
+    // Taking the whole stack at once avoids the ABA problem of popping.
+    uint32_t Idx = __atomic_exchange_n(&ReleaseQueueHead, 0, __ATOMIC_ACQUIRE);
+    const size_t kReleaseBatch = 64;  // SuperPages per PageAgeNow() call.
+    uint16_t Now = SuperPage::PageAgeNow();
+    size_t Released = 0;
+    for (size_t NumDone = 1; Idx; NumDone++) {
+      SuperPage *SP = A2SP(kAllocatorSpace + (Idx - 1) * kSuperPageSize);
+      SuperPageInfo *Info = SP->Info();
+      Idx = Info->Next;
+      // From now on SP may be queued again.
+      __atomic_store_n(&Info->Queued, 0, __ATOMIC_RELEASE);
+      bool Pending = false;
+      Released += SP->MaybeReleaseToOs(Now, &Pending);
+      if (Pending && Config.ReleaseFreq) QueueForRelease(SP, /*Wake=*/false);
+      if (NumDone % kReleaseBatch == 0) Now = SuperPage::PageAgeNow();
+    }
+    __atomic_add_fetch(&ReleasedBytes, Released, __ATOMIC_RELAXED);
+    return Released;
+  }
+
+  // Releases all the free memory of the SuperPages (regardless of the
+  // decay) and the cached large mappings. The SuperPages are split between
+  // the calling thread and up to kMaxReleaseThreads helper threads, while
+  // the calling thread also purges the large cache. Must be called with no
+  // locks held: pthread_create() allocates the TLS of the new threads with
+  // malloc, which may need Mu (e.g. to enforce the soft limit).
+  // Returns the number of released bytes.
+  size_t ReleaseAll() {
+    const size_t kMaxReleaseThreads = 7;
+    const size_t kSuperPagesPerThread = 1024;
+    ReleaseAllState State = {this, {0, 0}, 0};
+    size_t NumThreads = std::min<size_t>(
+        {kMaxReleaseThreads, (size_t)sysconf(_SC_NPROCESSORS_ONLN) - 1,
+         (GetNumSuperPages(0) + GetNumSuperPages(1)) / kSuperPagesPerThread});
+    pthread_t Threads[kMaxReleaseThreads];
+    size_t NumStarted = 0;
+    for (; NumStarted < NumThreads; NumStarted++)
+      if (pthread_create(&Threads[NumStarted], nullptr, ReleaseAllThread,
+                         &State))
+        break;  // Fine, we'll do with fewer threads.
+    size_t Released = Large ? Large->PurgeCache(/*Force=*/true) : 0;
+    ReleaseAllLoop(&State);
+    for (size_t I = 0; I < NumStarted; I++)
+      pthread_join(Threads[I], nullptr);
+    Released += __atomic_load_n(&State.Bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ReleasedBytes, Released, __ATOMIC_RELAXED);
+    return Released;
+  }
+
+  // Shared by the threads of one ReleaseAll().
+  struct ReleaseAllState {
+    Allocator *Self;
+    size_t Pos[kNumSizeClassRanges];  // atomic
+    size_t Bytes;  // atomic
+  };
+
+  void ReleaseAllLoop(ReleaseAllState *State) {
+    const size_t kPosIncrement = 64;
+    uint16_t Now = SuperPage::PageAgeNow();
+    size_t Released = 0;
+    for (size_t RangeNum : {0, 1}) {
+      size_t N = GetNumSuperPages(RangeNum);
+      while (true) {
+        size_t Pos = __atomic_fetch_add(&State->Pos[RangeNum], kPosIncrement,
+                                        __ATOMIC_RELAXED);
+        if (Pos >= N) break;
+        for (size_t SPIdx = Pos; SPIdx < std::min(N, Pos + kPosIncrement);
+             SPIdx++) {
+          bool Pending = false;
+          Released += GetSuperPage(RangeNum, SPIdx)
+                          ->MaybeReleaseToOs(Now, &Pending, /*Force=*/true);
+        }
+      }
+    }
+    __atomic_add_fetch(&State->Bytes, Released, __ATOMIC_RELAXED);
+  }
+
+  size_t Trim() { return ReleaseAll(); }
+
+  static void *ReleaseAllThread(void *Arg) {
+    auto *State = reinterpret_cast<ReleaseAllState *>(Arg);
+    State->Self->ReleaseAllLoop(State);
+    return nullptr;
+  }
+
+  // Tries to give at least Bytes back to the OS. If the free memory can't
+  // cover Bytes but the quarantine can, scans first, so that the released
+  // quarantine is released in the same pass. Otherwise releases the free
+  // memory, and scans (and releases again) only if that was not enough.
+  // Mu is held only for the scans, see ReleaseAll().
+  // Returns the number of released bytes.
+  size_t ReleaseMemory(size_t Bytes) {
+    size_t UsedBytes, QuarantinedBytes;
+    CountBytes(&UsedBytes, &QuarantinedBytes);
+    size_t MappedBytes =
+        (GetNumSuperPages(0) + GetNumSuperPages(1)) * kSuperPageSize;
+    // An upper bound: some of it may have been released already.
+    size_t FreeBytes =
+        MappedBytes - std::min(MappedBytes, UsedBytes + QuarantinedBytes);
+    if (Large) {
+      FreeBytes += Large->GetCachedBytes();
+      QuarantinedBytes += Large->GetQuarantinedBytes();
+    }
+    auto LockedScan = [&] {
+      ScopedLock Lock(Mu, __LINE__);
+      Scan();
+    };
+    bool ScanFirst = FreeBytes < Bytes && QuarantinedBytes;
+    if (ScanFirst) LockedScan();
+    size_t Released = ReleaseAll();
+    if (Released < Bytes && QuarantinedBytes && !ScanFirst) {
+      LockedScan();
+      Released += ReleaseAll();
+    }
+    return Released;
+  }
+
+  // Called before mapping more memory, with no locks held. Above
+  // Config.SoftLimit, gives the excess back to the OS, scanning if the free
+  // memory is not enough. If the RSS is still above the limit after that,
+  // the next attempt happens only after it grows by another 1/8 of the limit.
+  // GetRss() is a few syscalls, so the RSS is looked at only after the
+  // SuperPages and the live large chunks grow by 1/64 of the limit.
+  void MaybeEnforceSoftLimit() {
+    if (!Config.SoftLimit) return;
+    size_t Limit = static_cast<size_t>(Config.SoftLimit) << 20;
+    size_t Mapped =
+        (GetNumSuperPages(0) + GetNumSuperPages(1)) * kSuperPageSize +
+        (Large ? Large->GetLiveBytes() : 0);
+    size_t Checked = __atomic_load_n(&SoftLimitCheckedAt, __ATOMIC_RELAXED);
+    if (Mapped < Checked + Limit / 64) {
+      // The heap shrank: measure the growth from here.
+      if (Mapped < Checked)
+        __atomic_store_n(&SoftLimitCheckedAt, Mapped, __ATOMIC_RELAXED);
+      return;
+    }
+    __atomic_store_n(&SoftLimitCheckedAt, Mapped, __ATOMIC_RELAXED);
+    size_t Rss = GetRss();
+    size_t Next = __atomic_load_n(&SoftLimitNext, __ATOMIC_RELAXED);
+    if (Rss < Limit) {
+      if (Next) __atomic_store_n(&SoftLimitNext, 0, __ATOMIC_RELAXED);
+      return;
+    }
+    if (Rss < Next) return;
+    InitOnce();  // Scan() needs the SIGUSR2 handler.
+    {
+      ScopedLock Lock(Mu, __LINE__);
+      // Maybe some other thread has just done it, or is doing it.
+      Rss = GetRss();
+      if (Rss < std::max(Limit, SoftLimitNext)) return;
+      SoftLimitHits++;
+      // No more attempts until this one is done: the release may allocate
+      // (e.g. for its threads), and get here again.
+      __atomic_store_n(&SoftLimitNext, ~0UL, __ATOMIC_RELAXED);
+    }
+    size_t Released = ReleaseMemory(Rss - Limit);
+    Rss = GetRss();
+    __atomic_store_n(&SoftLimitNext, std::max(Limit, Rss + Limit / 8),
+                     __ATOMIC_RELAXED);
+    if (Config.PrintScan)
+      fprintf(stderr, "Soft limit: released %zdM RSS %zdM\n", Released >> 20,
+              Rss >> 20);
+  }
+
+  static constexpr size_t kPressureHoldMs = 10000;
+  static constexpr size_t kPressureQuarantineDivisor = 4;
+
+  bool UnderPressure() {
+    size_t Until = __atomic_load_n(&PressureUntil, __ATOMIC_RELAXED);
+    return Until && usec() < Until;
+  }
+
+  // Shrinks the quarantine budget for kPressureHoldMs, scans and releases
+  // all the free memory right away. Returns the number of released bytes.
+  size_t OnMemoryPressure() {
+    __atomic_store_n(&PressureUntil, usec() + kPressureHoldMs * 1000,
+                     __ATOMIC_RELAXED);
+    size_t Released = ReleaseMemory(~0UL);
+    if (Config.PrintScan)
+      fprintf(stderr, "Memory pressure: released %zdM RSS %zdM\n",
+              Released >> 20, GetRss() >> 20);
+    return Released;
+  }
+
+  void PressureMonitorThread() {
+    InitOnce();  // Scan() needs the SIGUSR2 handler.
+    PressureMonitor M;
+    if (!M.Init(getenv("MTM_PRESSURE_FILE"), Config.PressureStall)) {
+      fprintf(stderr, "MTMalloc: no memory pressure to monitor\n");
+      return;
+    }
+    while (true)
+      if (M.Wait(PressureMonitor::kWindowUs / 1000)) OnMemoryPressure();
+  }
+  static void *PressureMonitorThread(void *) {
+    SingletonSelf->PressureMonitorThread();
+    return nullptr;
+  }
+
+  // Sleeps while there is nothing to release, and handles the queued
+  // SuperPages at most every Config.ReleaseFreq miliseconds.
   void MemoryReleaseThread() {
     // fprintf(stderr, "MemoryReleaseThread\n");
-    for (size_t Iter = 0; ; Iter++) {
-      size_t RangeNum = Iter % kNumSizeClassRanges;
-      size_t N = GetNumSuperPages(RangeNum);
-      if (!N) continue;
-      size_t Idx = Iter % N;
-      GetSuperPage(RangeNum, Idx)->MaybeReleaseToOs();
+    while (true) {
+      FutexWait(&ReleaseQueueHead, 0);
+      ReleaseQueuedSuperPages();
       usleep(1000 * Config.ReleaseFreq);
     }
   }
@@ -944,9 +1786,40 @@ struct Allocator {
   }
 
   void ScanSigHandler() {
+    if (__atomic_load_n(&WorldStopped, __ATOMIC_ACQUIRE)) {
+      // The registers are saved in the signal frame, above this frame.
+      TLS.ParkedSp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+      __atomic_add_fetch(&NumParked, 1, __ATOMIC_SEQ_CST);
+      while (__atomic_load_n(&WorldStopped, __ATOMIC_ACQUIRE)) sched_yield();
+      TLS.ParkedSp = 0;
+      __atomic_sub_fetch(&NumParked, 1, __ATOMIC_SEQ_CST);
+      return;
+    }
     ScanLoop();
   }
 
+  // Parks all the other threads in the SIGUSR2 handler. Returns false (with
+  // the world resumed) if some of them don't stop within a second, e.g.
+  // because they block SIGUSR2. Requires Mu, so that no scan is running.
+  bool StopTheWorld() {
+    __atomic_store_n(&WorldStopped, 1, __ATOMIC_RELEASE);
+    size_t NumOthers = KillAllThreadsButMyself() - 1;
+    for (size_t Deadline = usec() + 1000000;
+         __atomic_load_n(&NumParked, __ATOMIC_SEQ_CST) < NumOthers;
+         sched_yield()) {
+      if (usec() > Deadline) {
+        ResumeTheWorld();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void ResumeTheWorld() {
+    __atomic_store_n(&WorldStopped, 0, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&NumParked, __ATOMIC_SEQ_CST)) sched_yield();
+  }
+
   static void ScanSigHandler(int, siginfo_t *, void *) {
     SingletonSelf->ScanSigHandler();
   }
@@ -976,37 +1849,55 @@ struct Allocator {
   }
 
   static void TSDOnThreadExit(void *TSD) {
-    SingletonSelf->Stats.MergeFrom(&TLS.Stats);
+    SingletonSelf->UnregisterThread();
     // fprintf(stderr, "TSDOnThreadExit tid %d TSD %p\n", GetTID(), TSD);
   }
 
   static void TSDCreate() { pthread_key_create(&TSDKey, TSDOnThreadExit); }
 
+  // SCArray, or the table in the file named by MTM_SIZE_CLASSES (see
+  // mtm_size_class_gen), if it is valid.
+  static void LoadSizeClasses(size_t *Sizes) {
+    memcpy(Sizes, SCArray, sizeof(SCArray));
+    const char *Path = getenv("MTM_SIZE_CLASSES");
+    if (!Path) return;
+    char Buf[8192];
+    int Fd = open(Path, O_RDONLY | O_CLOEXEC);
+    ssize_t Len = Fd < 0 ? -1 : read(Fd, Buf, sizeof(Buf));
+    int Errno = errno;
+    if (Fd >= 0) close(Fd);
+    size_t Loaded[kNumSizeClasses];
+    const char *Error = Len < 0                ? strerror(Errno)
+                        : Len == sizeof(Buf) ? "the file is too large"
+                                             : ParseSizeClasses(Buf, Len, Loaded);
+    if (Error) {
+      fprintf(stderr, "MTMalloc: ignoring MTM_SIZE_CLASSES=%s: %s\n", Path,
+              Error);
+      return;
+    }
+    memcpy(Sizes, Loaded, sizeof(Loaded));
+  }
+
   __attribute__((noinline))
   void InitAll() {
+    StartCycleCounterCalibration();
     Config.Init();
     if (Config.HandleSigUsr2) SetScanSigHandler();
     if (Config.HandleSigSegv) SetSegvHandler();
 
+    // All the sizes satisfy IsCorrectDivToMul (which is slow): the loaded
+    // table is checked by CheckSizeClasses(), and so is SCArray, by the
+    // SizeClasses.Parse test.
+    size_t Sizes[kNumSizeClasses];
+    LoadSizeClasses(Sizes);
     for (size_t i = 0; i < kNumSizeClasses; i++) {
-      size_t ChunkSize = SCArray[i];
-      while (!IsCorrectDivToMul(ChunkSize,
-                                ComputeMulForDiv(ChunkSize, kDivMulShift),
-                                kDivMulShift, kSuperPageSize))
-        ChunkSize += kSizeAlignmentForSecondRange;
-      if (ChunkSize != SCArray[i])
-        fprintf(stderr, "Fix up the size: %zd => %zd\n", SCArray[i], ChunkSize);
+      size_t ChunkSize = Sizes[i];
       assert((ChunkSize % 16) == 0);
       assert(ChunkSize / 16 < (1 << 16));  // fits into uint16_t.
       SCDescr[i].RangeNum = (ChunkSize % kSizeAlignmentForSecondRange) == 0;
       SCDescr[i].ChunkSizeDiv16 = ChunkSize / 16;
       SCDescr[i].NumChunks = ComputeNumChunks(ChunkSize, SCDescr[i].RangeNum);
       SCDescr[i].ChunkSizeMulDiv = ComputeMulForDiv(ChunkSize, kDivMulShift);
-      if (!IsCorrectDivToMul(ChunkSize, SCDescr[i].ChunkSizeMulDiv,
-                             kDivMulShift, kSuperPageSize)) {
-        fprintf(stderr, "!IsCorrectDivToMul(%zd)\n", ChunkSize);
-        assert(0);
-      }
     }
     void *mmap_res = mmap((void *)kAllocatorSpace, kAllocatorSize, PROT_NONE,
                           MAP_FIXED | MAP_ANONYMOUS | MAP_NORESERVE |
@@ -1016,12 +1907,20 @@ struct Allocator {
 
     SuperPageMetadata.Init();
     SecondRangeMeta.Init();
+    PageAge.Init();
+    SuperPageInfos.Init();
     Tags.Init();
   }
 
   static void InitSingleton() { SingletonSelf->InitAll(); }
 
+  void InitOnce() {
+    SingletonSelf = this;
+    pthread_once(&InitAllOnce, InitSingleton);
+  }
+
   SuperPage *AllocateSuperPage(size_t Size) {
+    TLS.LatencyPath = kMallocSuperPage;
     ScopedLock Lock(Mu, __LINE__);
     // if (!GetNumSuperPages(0) && !GetNumSuperPages(1)) InitAll();
     SizeClassDescr SCD;
@@ -1071,12 +1970,407 @@ struct Allocator {
     } else TRAP();
   }
 
+  // Approximate, from the per-SuperPage counters.
+  void CountBytes(size_t *UsedBytes, size_t *QuarantinedBytes) {
+    *UsedBytes = *QuarantinedBytes = 0;
+    for (size_t RangeNum : {0, 1})
+      for (size_t SPIdx = 0, N = GetNumSuperPages(RangeNum); SPIdx < N;
+           SPIdx++) {
+        auto SP = GetSuperPage(RangeNum, SPIdx);
+        *UsedBytes += SP->NumUsed() * SP->GetSCD().ChunkSize();
+        *QuarantinedBytes += SP->QuarantinedBytes();
+      }
+  }
+
+  // Writes the heap snapshot (see mtmalloc_snapshot.h) to Fd, in 1Mb writes.
+  // Holds Mu, so that no scan or new SuperPage happens meanwhile, but the
+  // chunk states keep changing. Returns false on a write error.
+  bool WriteSnapshot(int Fd, uint32_t Flags) {
+    static_assert(+kSnapshotAvailable == +SuperPage::AVAILABLE &&
+                      +kSnapshotUsedMixed == +SuperPage::USED_MIXED &&
+                      +kSnapshotUsedData == +SuperPage::USED_DATA &&
+                      +kSnapshotQuarantined == +SuperPage::QUARANTINED &&
+                      +kSnapshotMarked == +SuperPage::MARKED &&
+                      +kSnapshotReleasing == +SuperPage::RELEASING,
+                  "");
+    static constexpr size_t kBufSize = 1 << 20;
+    struct Writer {
+      int Fd;
+      uint8_t *Buf;
+      size_t Pos;
+      bool Ok;
+      void Write(const void *Data, size_t Size) {
+        while (Size) {
+          size_t N = std::min(Size, kBufSize - Pos);
+          memcpy(Buf + Pos, Data, N);
+          Pos += N;
+          Data = reinterpret_cast<const uint8_t *>(Data) + N;
+          Size -= N;
+          if (Pos == kBufSize) Flush();
+        }
+      }
+      void Flush() {
+        for (size_t Done = 0; Done < Pos && Ok;) {
+          ssize_t Res = write(Fd, Buf + Done, Pos - Done);
+          if (Res > 0) Done += Res;
+          else if (Res < 0 && errno != EINTR) Ok = false;
+        }
+        Pos = 0;
+      }
+    };
+    void *Buf = mmap(nullptr, kBufSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Buf == MAP_FAILED) return false;
+    Writer W = {Fd, reinterpret_cast<uint8_t *>(Buf), 0, true};
+
+    ScopedLock Lock(Mu, __LINE__);
+    SnapshotHeader H = {};
+    memcpy(H.Magic, kSnapshotMagic, sizeof(H.Magic));
+    H.Version = kSnapshotVersion;
+    H.Flags = Flags;
+    H.SuperPageSize = kSuperPageSize;
+    H.PageSize = kReleasePageSize;
+    H.NumSizeClasses = kNumSizeClasses;
+    H.NumSuperPages = GetNumSuperPages(0) + GetNumSuperPages(1);
+    H.Rss = GetRss();
+    if (Large) {
+      H.LargeLiveBytes = Large->GetLiveBytes();
+      H.LargeQuarantinedBytes = Large->GetQuarantinedBytes();
+      H.LargeCachedBytes = Large->GetCachedBytes();
+    }
+    W.Write(&H, sizeof(H));
+    for (size_t SC = 0; SC < kNumSizeClasses; SC++) {
+      SnapshotSizeClass S = {static_cast<uint32_t>(SCDescr[SC].ChunkSize()),
+                             static_cast<uint32_t>(SCDescr[SC].NumChunks)};
+      W.Write(&S, sizeof(S));
+    }
+    const size_t kPages = SuperPage::kPagesPerSuperPage;
+    unsigned char Vec[kPages];
+    uint8_t Resident[kPages / 8];
+    for (size_t RangeNum : {0, 1}) {
+      for (size_t SPIdx = 0, N = GetNumSuperPages(RangeNum); SPIdx < N;
+           SPIdx++) {
+        SuperPage *SP = GetSuperPage(RangeNum, SPIdx);
+        SizeClassDescr SCD = SP->GetSCD();
+        SnapshotSuperPage S = {SP->This(), SP->GetSC().v,
+                               static_cast<uint8_t>(RangeNum), 0,
+                               static_cast<uint32_t>(SCD.NumChunks)};
+        W.Write(&S, sizeof(S));
+        W.Write(SP->State(SCD.NumChunks, RangeNum), SCD.NumChunks);
+        if (Flags & kSnapshotHasTags)
+          for (size_t Idx = 0; Idx < SCD.NumChunks; Idx++) {
+            uint8_t Tag = Tags.GetMemoryTag(SP->AddressOfChunk(Idx, SCD));
+            W.Write(&Tag, 1);
+          }
+        SP->GetResidentPages(Vec);
+        memset(Resident, 0, sizeof(Resident));
+        for (size_t I = 0; I < kPages; I++)
+          Resident[I / 8] |= (Vec[I] & 1) << (I % 8);
+        W.Write(Resident, sizeof(Resident));
+      }
+    }
+    W.Flush();
+    munmap(Buf, kBufSize);
+    return W.Ok;
+  }
+
+  // Calls CB(Beg, Size, Arg) for every live chunk (small or large) with the
+  // (untagged) Beg in [Begin, End). By default the chunk states of each
+  // SuperPage, and the list of the large chunks, are copied before the
+  // callbacks, so CB runs with no locks held and may allocate; chunks
+  // allocated or freed during the walk may or may not be reported.
+  // With Stop, the other threads are parked for the whole walk, so the
+  // result is exact, but CB must not allocate or take any lock that another
+  // thread may hold. Returns 0 or an errno value.
+  int Iterate(uintptr_t Begin, uintptr_t End,
+              void (*CB)(uintptr_t, size_t, void *), void *Arg, bool Stop) {
+    InitOnce();  // StopTheWorld() needs the SIGUSR2 handler.
+    if (Stop && !Config.HandleSigUsr2) return ENOTSUP;
+    // The states of one SuperPage (padded for FindUsed). The large chunks
+    // are copied into a buffer of their own, mapped once their number is
+    // known.
+    const size_t kBufSize = RoundUpTo(kSuperPageSize / 16, 8);
+    void *Buf = mmap(nullptr, kBufSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (Buf == MAP_FAILED) return ENOMEM;
+    uint8_t *States = reinterpret_cast<uint8_t *>(Buf);
+    int Res = 0;
+    if (Stop) {
+      pthread_mutex_lock(&Mu);
+      // A parked thread must not hold the lock of the large allocator.
+      if (Large) Large->Lock();
+      if (!StopTheWorld()) {
+        if (Large) Large->Unlock();
+        pthread_mutex_unlock(&Mu);
+        munmap(Buf, kBufSize);
+        return EAGAIN;
+      }
+    }
+    for (size_t RangeNum : {0, 1}) {
+      for (size_t SPIdx = 0; SPIdx < GetNumSuperPages(RangeNum); SPIdx++) {
+        SuperPage *SP = GetSuperPage(RangeNum, SPIdx);
+        if (SP->End() <= Begin || SP->This() >= End) continue;
+        SizeClassDescr SCD = SP->GetSCD();
+        size_t N = SCD.NumChunks;
+        memcpy(States, SP->State(N, RangeNum), N);
+        memset(States + N, 0, RoundUpTo(N, 8) - N);
+        FindUsed(States, N, [&](size_t Idx) {
+          auto Beg = reinterpret_cast<uintptr_t>(SP->AddressOfChunk(Idx, SCD));
+          if (Beg >= Begin && Beg < End) CB(Beg, SCD.ChunkSize(), Arg);
+        });
+      }
+    }
+    if (Large && Begin < kLargeAllocSpace + kLargeAllocSize &&
+        End > kLargeAllocSpace) {
+      using LargeChunk = std::pair<uintptr_t, size_t>;
+      size_t NumLarge = 0;
+      if (!Stop) Large->Lock();
+      Large->ForEachLiveChunk([&](uintptr_t, size_t) { NumLarge++; });
+      size_t LargeBufSize =
+          RoundUpTo((NumLarge + 1) * sizeof(LargeChunk), kReleasePageSize);
+      NumLarge = 0;
+      void *LargeBuf = mmap(nullptr, LargeBufSize, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      auto *LargeChunks = reinterpret_cast<LargeChunk *>(LargeBuf);
+      if (LargeBuf != MAP_FAILED)
+        Large->ForEachLiveChunk([&](uintptr_t Beg, size_t Size) {
+          if (Beg >= Begin && Beg < End) LargeChunks[NumLarge++] = {Beg, Size};
+        });
+      if (!Stop) Large->Unlock();
+      if (LargeBuf == MAP_FAILED) Res = ENOMEM;
+      for (size_t I = 0; I < NumLarge; I++)
+        CB(LargeChunks[I].first, LargeChunks[I].second, Arg);
+      if (LargeBuf != MAP_FAILED) munmap(LargeBuf, LargeBufSize);
+    }
+    if (Stop) {
+      ResumeTheWorld();
+      if (Large) Large->Unlock();
+      pthread_mutex_unlock(&Mu);
+    }
+    munmap(Buf, kBufSize);
+    return Res;
+  }
+
+  // The leak check. Like the GC scan, it looks for pointers in the live
+  // chunks, but it marks the chunks transitively reachable from the roots:
+  // the writable mappings outside of the heap (globals, the stacks, with the
+  // registers of the stopped threads in their signal frames, and the memory
+  // of other allocators). The live chunks left unmarked are leaks. As in
+  // LSan, any word that points into a chunk keeps it alive, and as in the GC
+  // scan, USED_DATA chunks are not looked into. The world is stopped for
+  // the duration. Returns 0 or an errno value.
+  int LeakCheck(LeakReport *R) {
+    uint64_t Beg = nsec();
+    memset(R, 0, sizeof(*R));
+    InitOnce();  // StopTheWorld() needs the SIGUSR2 handler.
+    if (!Config.HandleSigUsr2) return ENOTSUP;
+    pthread_mutex_lock(&Mu);
+    // A parked thread must not hold the locks that the check needs.
+    if (Large) Large->Lock();
+    pthread_mutex_lock(&ThreadsMu);
+    int Res = EAGAIN;
+    if (StopTheWorld()) {
+      // Spills the callee-saved registers of this thread into this frame,
+      // which LeakCheckStopped() scans.
+      jmp_buf Registers;
+      setjmp(Registers);
+      Res = LeakCheckStopped(R);
+      ResumeTheWorld();
+    }
+    pthread_mutex_unlock(&ThreadsMu);
+    if (Large) Large->Unlock();
+    pthread_mutex_unlock(&Mu);
+    R->TimeUs = (nsec() - Beg) / 1000;
+    return Res;
+  }
+
+  __attribute__((noinline))
+  int LeakCheckStopped(LeakReport *R) {
+    struct Extent {
+      uintptr_t Beg, End;
+      bool operator<(const Extent &O) const { return Beg < O.Beg; }
+    };
+    using LargeChunk = std::pair<uintptr_t, size_t>;  // Size | 1: marked.
+    size_t N[kNumSizeClassRanges] = {GetNumSuperPages(0), GetNumSuperPages(1)};
+    size_t MaxChunks = 0, NumLarge = 0;
+    for (size_t RangeNum : {0, 1})
+      for (size_t SPIdx = 0; SPIdx < N[RangeNum]; SPIdx++)
+        MaxChunks += GetSuperPage(RangeNum, SPIdx)->GetSCD().NumChunks;
+    if (Large) Large->ForEachLiveChunk([&](uintptr_t, size_t) { NumLarge++; });
+    MaxChunks += NumLarge;
+
+    // One mark bit per 16 bytes of the heap, the large chunks (sorted), the
+    // mark stack, the address ranges that are not roots, and the stack
+    // pointers of the threads. MAP_NORESERVE: only the used part is touched.
+    const size_t kMaxExcluded = kMaxThreads + 16;
+    size_t BitmapSize[kNumSizeClassRanges] = {N[0] * kSuperPageSize / 16 / 8,
+                                              N[1] * kSuperPageSize / 16 / 8};
+    size_t BufSize = RoundUpTo(
+        BitmapSize[0] + BitmapSize[1] + NumLarge * sizeof(LargeChunk) +
+            MaxChunks * sizeof(uintptr_t) + kMaxExcluded * sizeof(Extent) +
+            (kMaxThreads + 1) * sizeof(uintptr_t),
+        kReleasePageSize);
+    void *Buf = mmap(nullptr, BufSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (Buf == MAP_FAILED) return ENOMEM;
+    uint8_t *Bitmap[kNumSizeClassRanges] = {
+        reinterpret_cast<uint8_t *>(Buf),
+        reinterpret_cast<uint8_t *>(Buf) + BitmapSize[0]};
+    auto *LargeChunks =
+        reinterpret_cast<LargeChunk *>(Bitmap[1] + BitmapSize[1]);
+    auto *Stack = reinterpret_cast<uintptr_t *>(LargeChunks + NumLarge);
+    auto *Excluded = reinterpret_cast<Extent *>(Stack + MaxChunks);
+    auto *Sps = reinterpret_cast<uintptr_t *>(Excluded + kMaxExcluded);
+    size_t StackSize = 0, NumExcluded = 0, NumSps = 0;
+
+    // Not roots: the heap and its metadata, this buffer, the allocators
+    // themselves (e.g. with stale large cache entries), and the TLS of the
+    // threads (pointing to their current SuperPages, i.e. to chunk 0).
+    auto Exclude = [&](uintptr_t Beg, size_t Size) {
+      if (NumExcluded < kMaxExcluded)
+        Excluded[NumExcluded++] = {Beg, Beg + Size};
+    };
+    Exclude(kAllocatorSpace, kAllocatorSize << Config.UseAliases);
+    Exclude(kLargeAllocSpace, kLargeAllocSize);
+    Exclude(kMetaSpaceBeg, kMetaSpaceEnd - kMetaSpaceBeg);
+    Tags.ForEachShadowMapping(Exclude);
+    Exclude(reinterpret_cast<uintptr_t>(Buf), BufSize);
+    Exclude(reinterpret_cast<uintptr_t>(this), sizeof(*this));
+    if (Large) {
+      Exclude(reinterpret_cast<uintptr_t>(Large), sizeof(*Large));
+      Large->ForEachMetadataMapping(Exclude);
+      NumLarge = 0;
+      Large->ForEachLiveChunk([&](uintptr_t Beg, size_t Size) {
+        LargeChunks[NumLarge++] = {Beg, Size};
+      });
+      std::sort(LargeChunks, LargeChunks + NumLarge);
+    }
+    // The frames below the stack pointers are dead.
+    Sps[NumSps++] = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+    for (ThreadLocalAllocator *T = Threads; T; T = T->Next) {
+      Exclude(reinterpret_cast<uintptr_t>(T), sizeof(*T));
+      if (T->ParkedSp && NumSps <= kMaxThreads) Sps[NumSps++] = T->ParkedSp;
+    }
+    std::sort(Excluded, Excluded + NumExcluded);
+
+    auto FindLarge = [&](uintptr_t P) -> LargeChunk * {
+      LargeChunk *C = std::upper_bound(
+          LargeChunks, LargeChunks + NumLarge, P,
+          [](uintptr_t P, const LargeChunk &C) { return P < C.first; });
+      if (C == LargeChunks || P >= C[-1].first + (C[-1].second & ~1UL))
+        return nullptr;
+      return C - 1;
+    };
+    auto IsMarked = [&](size_t RangeNum, uintptr_t Chunk) {
+      size_t Bit = (Chunk - kFirstSuperPage[RangeNum]) / 16;
+      return Bitmap[RangeNum][Bit / 8] & (1 << (Bit % 8));
+    };
+    auto MarkWord = [&](uintptr_t P) {
+      for (size_t RangeNum : {0, 1}) {
+        if (P - kFirstSuperPage[RangeNum] >= N[RangeNum] * kSuperPageSize)
+          continue;
+        SuperPage *SP = A2SP(RoundDownTo(P, kSuperPageSize));
+        SizeClassDescr SCD = SP->GetSCD();
+        size_t Idx = DivBySizeViaMul(P % kSuperPageSize, SCD.ChunkSizeMulDiv);
+        if (Idx >= SCD.NumChunks) return;
+        uint8_t S = SP->State(SCD.NumChunks, RangeNum)[Idx];
+        if (S != SuperPage::USED_MIXED && S != SuperPage::USED_DATA) return;
+        auto Chunk = reinterpret_cast<uintptr_t>(SP->AddressOfChunk(Idx, SCD));
+        if (IsMarked(RangeNum, Chunk)) return;
+        size_t Bit = (Chunk - kFirstSuperPage[RangeNum]) / 16;
+        Bitmap[RangeNum][Bit / 8] |= 1 << (Bit % 8);
+        Stack[StackSize++] = Chunk;
+        return;
+      }
+      if (P - kLargeAllocSpace >= kLargeAllocSize) return;
+      LargeChunk *C = FindLarge(P);
+      if (!C || (C->second & 1)) return;
+      C->second |= 1;
+      Stack[StackSize++] = C->first;
+    };
+    auto MarkWords = [&](uintptr_t Beg, uintptr_t End) {
+      for (uintptr_t W = RoundUpTo(Beg, sizeof(uintptr_t)); W + 8 <= End;
+           W += sizeof(uintptr_t))
+        MarkWord(*reinterpret_cast<uintptr_t *>(W));
+    };
+    auto MarkRoots = [&](uintptr_t Beg, uintptr_t End) {
+      for (size_t I = 0; I < NumExcluded && Beg < End; I++) {
+        const Extent &E = Excluded[I];
+        if (E.End <= Beg) continue;
+        if (E.Beg >= End) break;
+        if (E.Beg > Beg) MarkWords(Beg, E.Beg);
+        Beg = std::max(Beg, E.End);
+      }
+      if (Beg < End) MarkWords(Beg, End);
+    };
+
+    R->RootsError = IterateMappings(
+        [&](uintptr_t Beg, uintptr_t End, const char *Perms) {
+          if (Perms[0] != 'r' || Perms[1] != 'w' || Perms[3] != 'p') return;
+          for (size_t I = 0; I < NumSps; I++)
+            if (Sps[I] >= Beg && Sps[I] < End)
+              Beg = RoundDownTo(Sps[I], kReleasePageSize);
+          LargeAllocator::IterateResidentPages(Beg, End - Beg, MarkRoots);
+        });
+    // Without all the roots, reachable chunks would be reported as leaks.
+    if (R->RootsError) {
+      munmap(Buf, BufSize);
+      return R->RootsError;
+    }
+    while (StackSize) {
+      uintptr_t Chunk = Stack[--StackSize];
+      if (Chunk - kLargeAllocSpace < kLargeAllocSize) {
+        LargeChunk *C = FindLarge(Chunk);
+        LargeAllocator::IterateResidentPages(C->first, C->second & ~1UL,
+                                             MarkWords);
+        continue;
+      }
+      SuperPage *SP = A2SP(RoundDownTo(Chunk, kSuperPageSize));
+      SizeClassDescr SCD = SP->GetSCD();
+      if (*SP->ComputeStatePtr(reinterpret_cast<void *>(Chunk), SCD) ==
+          SuperPage::USED_MIXED)
+        MarkWords(Chunk, Chunk + SCD.ChunkSize());
+    }
+
+    for (size_t RangeNum : {0, 1}) {
+      for (size_t SPIdx = 0; SPIdx < N[RangeNum]; SPIdx++) {
+        SuperPage *SP = GetSuperPage(RangeNum, SPIdx);
+        SizeClassDescr SCD = SP->GetSCD();
+        FindUsed(SP->State(SCD.NumChunks, RangeNum), SCD.NumChunks,
+                 [&](size_t Idx) {
+                   auto Chunk = reinterpret_cast<uintptr_t>(
+                       SP->AddressOfChunk(Idx, SCD));
+                   if (!IsMarked(RangeNum, Chunk))
+                     R->Add(SP->GetSC().v, Chunk, SCD.ChunkSize());
+                 });
+      }
+    }
+    for (size_t I = 0; I < NumLarge; I++)
+      if (!(LargeChunks[I].second & 1))
+        R->Add(kNumSizeClasses, LargeChunks[I].first, LargeChunks[I].second);
+    munmap(Buf, BufSize);
+    return 0;
+  }
+
   void PrintAll() {
-    fprintf(stderr, "RSS: %zdM SPs: {%zd %zd}\n", GetRss() >> 20,
-            GetNumSuperPages(0), GetNumSuperPages(1));
+    size_t UsedBytes, QuarantinedBytes;
+    CountBytes(&UsedBytes, &QuarantinedBytes);
+    fprintf(stderr,
+            "RSS: %zdM SPs: {%zd %zd} Used: %zdM Quarantined: %zdM "
+            "Released: %zdM SoftLimitHits: %zd\n",
+            GetRss() >> 20, GetNumSuperPages(0), GetNumSuperPages(1),
+            UsedBytes >> 20, QuarantinedBytes >> 20,
+            __atomic_load_n(&ReleasedBytes, __ATOMIC_RELAXED) >> 20,
+            SoftLimitHits);
     for (uint8_t i = 0; i < kNumSizeClasses; i++) SuperPage::PrintSizes({i});
-    Stats.MergeFrom(&TLS.Stats);
-    Stats.Print();
+    Statistics S;
+    CollectStats(&S);
+    fprintf(stderr, "Live: %zdM Peak: %zdM\n",
+            (S.LiveBytes() + (Large ? Large->GetLiveBytes() : 0)) >> 20,
+            __atomic_load_n(&PeakLiveBytes, __ATOMIC_RELAXED) >> 20);
+    S.Print();
+    PrintScanPhases();
+    PrintLatency();
   }
 };
 
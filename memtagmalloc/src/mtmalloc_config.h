@@ -25,6 +25,20 @@ struct MallocConfig {
   uint64_t HandleSigSegv     : 1;
   uint64_t ReleaseFreq       : 8;  // 0 .. 255 (in miliseconds; 0 means off).
   uint64_t UseMTE            : 1;
+  uint64_t LargeCacheSize    : 12; // 0..4095 (in Mb; 0 means off).
+  uint64_t LargeCacheDecay   : 16; // 0..65535 (in miliseconds).
+  uint64_t LargeFenceBudget  : 17; // 0..65536 (in Mb).
+  uint64_t LargeHugePage     : 8;  // 0..255 (in Mb; 0 means off).
+  uint64_t LargeHugeTLB      : 1;
+  uint64_t ReleaseDecay      : 16; // 0..65535 (in miliseconds).
+  uint64_t ReleaseMadvFree   : 1;
+  uint64_t MonitorPressure   : 1;
+  uint64_t PressureStall     : 11; // 0..2000 (in miliseconds per 2 seconds).
+  uint64_t SoftLimit         : 20; // 0..1048575 (in Mb; 0 means off).
+  uint64_t ScanLog           : 1;
+  uint64_t LatencySample     : 20; // 0..1048575 (1 in N calls; 0 means off).
+  uint64_t LeakCheckAtExit   : 1;
+  uint64_t Trace             : 1;  // Set by mtm_trace_start().
 
   void Init() {
     if (Initialized) return;
@@ -41,6 +55,22 @@ struct MallocConfig {
     HandleSigSegv = EnvToBool("MTM_HANDLE_SIGSEGV", true);
     ReleaseFreq = EnvToLong("MTM_RELEASE_FREQ", 50, 0, 255);
     UseMTE = EnvToBool("MTM_USE_MTE", false);
+    LargeCacheSize = EnvToLong("MTM_LARGE_CACHE_SIZE_MB", 64, 0, 4095);
+    LargeCacheDecay = EnvToLong("MTM_LARGE_CACHE_DECAY_MS", 5000, 0, 65535);
+    LargeFenceBudget =
+        EnvToLong("MTM_LARGE_FENCE_BUDGET_MB", 16384, 0, 65536);
+    LargeHugePage = EnvToLong("MTM_LARGE_HUGE_PAGE_MB", 32, 0, 255);
+    LargeHugeTLB = EnvToBool("MTM_LARGE_HUGETLB", false);
+    ReleaseDecay = EnvToLong("MTM_RELEASE_DECAY_MS", 10000, 0, 65535);
+    ReleaseMadvFree = EnvToBool("MTM_RELEASE_MADV_FREE", false);
+    MonitorPressure = EnvToBool("MTM_MONITOR_PRESSURE", false);
+    PressureStall = EnvToLong("MTM_PRESSURE_STALL_MS", 200, 1, 2000);
+    SoftLimit = EnvToLong("MTM_SOFT_LIMIT_MB", 0, 0, (1 << 20) - 1);
+    ScanLog = EnvToBool("MTM_SCAN_LOG", false);
+    LatencySample = EnvToLong("MTM_LATENCY_SAMPLE", 0, 0, (1 << 20) - 1);
+    LeakCheckAtExit = EnvToBool("MTM_LEAK_CHECK_AT_EXIT", false);
+    // Later changes come from mtm_ctl(), not from the environment.
+    Initialized = 1;
   }
 
   MallocConfig() { Init(); }
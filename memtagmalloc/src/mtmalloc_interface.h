@@ -0,0 +1,95 @@
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+// MemTagMalloc-specific functions, in addition to the standard malloc API.
+
+#ifndef __MTMALLOC_INTERFACE_H__
+#define __MTMALLOC_INTERFACE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Tries to give at least Bytes of memory back to the OS, e.g. on a memory
+// pressure signal: releases the free memory right away, and runs a GC scan
+// if the quarantine needs to be reclaimed for that. Returns the number of
+// released bytes (may be less or more than Bytes).
+size_t mtm_release_memory(size_t Bytes);
+
+// Reads and/or writes the named property, similar to jemalloc's mallctl().
+// If OldP is not null, *OldP gets the current value; then, if NewP is not
+// null, the property is set to *NewP. Returns 0 on success, ENOENT for an
+// unknown name, EPERM when writing a read-only property and EINVAL when
+// *NewP is out of range. The properties are:
+//   stats.rss, stats.live_bytes, stats.live_bytes.<size class>,
+//   stats.peak_live_bytes, stats.used_bytes, stats.quarantined_bytes,
+//   stats.released_bytes, stats.super_pages, stats.super_pages.<size class>,
+//   stats.num_scans, stats.scan_time_us, stats.last_scan_time_us,
+//   stats.max_scan_time_us, stats.scan.<phase>_us.<stat> (phase is one of
+//   stop, mark, wait, sweep, pause; stat is one of count, mean, p50, p90,
+//   p99, p999, max), stats.latency.<path>_ns.<stat> (path is one of
+//   malloc_fast, malloc_slow, malloc_super_page, malloc_scan, malloc_large,
+//   free_fast, free_scan, free_large), stats.soft_limit_hits,
+//   stats.large.cached_bytes, stats.large.quarantined_bytes,
+//   stats.large.quarantine_overflows (large chunks freed w/o quarantine,
+//   because it held too many of them), stats.large.fenced_bytes
+//   (read-only);
+//   config.quarantine_size_mb, config.release_freq_ms,
+//   config.release_decay_ms, config.large_cache_size_mb,
+//   config.large_cache_decay_ms, config.soft_limit_mb, config.print_scan,
+//   config.scan_log, config.latency_sample
+//   (read-write, same as the corresponding MTM_* environment variables).
+int mtm_ctl(const char *Name, uint64_t *OldP, const uint64_t *NewP);
+
+// Flags of mtm_heap_snapshot().
+#define MTM_SNAPSHOT_TAGS 1  // Also dump the memory tag of every chunk.
+
+// Writes a binary snapshot of the heap (the state of every chunk of every
+// SuperPage, see mtmalloc_snapshot.h) to the file at Path, for offline
+// analysis with mtm_snapshot_reader. Returns 0 or an errno value.
+int mtm_heap_snapshot(const char *Path, int Flags);
+
+// Stops the world and reports (to stderr) the live allocations that are not
+// reachable from the globals, the stacks and the registers, grouped by size
+// class. Costs about as much as one GC scan. Returns the number of leaked
+// bytes (0 also if the check could not run, e.g. if /proc/self/maps could
+// not be read to find the roots, which is reported too).
+// MTM_LEAK_CHECK_AT_EXIT=1 runs it at exit, and exits with code 23 if there
+// are leaks.
+size_t mtm_leak_check(void);
+
+// Starts recording every malloc, calloc, realloc, posix_memalign and free
+// (with the size and the address, in a compact binary format, see
+// mtmalloc_trace.h) to one file per thread, <Prefix>.<pid>.<N>, until
+// mtm_trace_stop(). The files can be replayed with mtm_trace_replay.
+// MTM_TRACE=<Prefix> records the whole run. Returns 0 or an errno value
+// (EBUSY: already recording).
+int mtm_trace_start(const char *Prefix);
+
+// Stops recording and writes out what is still buffered.
+void mtm_trace_stop(void);
+
+// Flags of mtm_iterate().
+#define MTM_ITERATE_STOP_THE_WORLD 1
+
+// Calls Callback(Base, Size, Arg) for every live allocation whose (untagged)
+// Base is in [Begin, End), Size being the usable size. By default the heap
+// is walked while the other threads keep running: the callback may allocate,
+// and allocations made or freed during the walk may or may not be reported.
+// With MTM_ITERATE_STOP_THE_WORLD the other threads are stopped for the whole
+// walk, so the result is exact, but the callback must not allocate, free, or
+// take locks (including the stdio ones) that other threads may hold.
+// Returns 0 or an errno value (EAGAIN: some threads could not be stopped).
+int mtm_iterate(uintptr_t Begin, uintptr_t End,
+                void (*Callback)(uintptr_t Base, size_t Size, void *Arg),
+                void *Arg, int Flags);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // __MTMALLOC_INTERFACE_H__
@@ -5,83 +5,788 @@
 #ifndef __MTMCLLOC_LARGE_H
 #define __MTMCLLOC_LARGE_H
 
+#include <algorithm>
+#include <errno.h>
 #include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/mman.h>
 
 #include "mtmalloc_config.h"
+#include "mtmalloc_shadow.h"
 #include "mtmalloc_util.h"
 
 // Super-simple allocator for large memory regions.
 // It need to be enhanced in multiple dimensions.
 namespace MTMalloc {
+
+// All large allocations come from this reserved range, so the ownership
+// check is a range check (and the range can have a shadow, just like the
+// small heap).
+const size_t kLargeAllocSpace = 0x640000000000ULL;
+const size_t kLargeAllocSize  = 1ULL << 40;
+
+// One byte per page of the range, used by the GC scan to mark the pages of
+// the quarantined chunks that are still referenced.
+const size_t kLargeAllocPageStateSpace = 0x720000000000ULL;
+using LargePageState =
+    FixedShadow<kLargeAllocPageStateSpace, kLargeAllocSpace, kLargeAllocSize,
+                1 << 12>;
+
+// Metadata for the large chunks: an open-addressing hash table (with linear
+// probing) mapping the chunk address to its size. A lookup touches a single
+// 16-byte entry, instead of a separate header page in front of every chunk.
+// The chunks are also kept in a dense array, so that they can be
+// iterated quickly. The table is doubled (and rehashed) once it is 3/4 full.
+// Not thread-safe, the users need to synchronize.
+class LargeChunkTable {
+  static constexpr size_t kInitialSizeLog = 20;
+  static constexpr size_t kPageSizeLog = 12;
+  static constexpr size_t kNotFound = ~0UL;
+  struct Entry {
+    uintptr_t Beg;  // 0 means empty.
+    uint32_t NumPages;
+    uint32_t DenseIdx;
+  };
+  struct Chunk {
+    uintptr_t Beg;
+    size_t Size;
+  };
+
+ public:
+  void Insert(uintptr_t Beg, size_t Size) {
+    if (NumEntries == MaxEntries(SizeLog)) Grow();
+    size_t Idx = Hash(Beg);
+    while (Table[Idx].Beg) {
+      if (Table[Idx].Beg == Beg) TRAP();
+      Idx = (Idx + 1) & Mask();
+    }
+    Table[Idx] = {Beg, static_cast<uint32_t>(Size >> kPageSizeLog),
+                  static_cast<uint32_t>(NumEntries)};
+    Dense[NumEntries++] = {Beg, Size};
+  }
+
+  // Returns 0 if Beg is not the beginning of a known chunk.
+  size_t Find(uintptr_t Beg) {
+    size_t Idx = Lookup(Beg);
+    return Idx == kNotFound ? 0 : EntrySize(Table[Idx]);
+  }
+
+  // Calls CB(Beg, Size) for every chunk.
+  template <typename Callback>
+  void ForEach(Callback CB) {
+    for (size_t I = 0; I < NumEntries; I++)
+      CB(Dense[I].Beg, Dense[I].Size);
+  }
+
+  // Returns the size of the removed chunk, or 0.
+  size_t Erase(uintptr_t Beg) {
+    size_t Idx = Lookup(Beg);
+    if (Idx == kNotFound) return 0;
+    size_t Size = EntrySize(Table[Idx]);
+    // Move the last dense element into the hole.
+    uint32_t DenseIdx = Table[Idx].DenseIdx;
+    Dense[DenseIdx] = Dense[--NumEntries];
+    Table[Lookup(Dense[DenseIdx].Beg)].DenseIdx = DenseIdx;
+    // Backward-shift deletion: move up the entries that would become
+    // unreachable from their home slot.
+    for (size_t J = (Idx + 1) & Mask(); Table[J].Beg; J = (J + 1) & Mask()) {
+      size_t Home = Hash(Table[J].Beg);
+      bool Reachable = Idx < J ? (Home > Idx && Home <= J)
+                               : (Home > Idx || Home <= J);
+      if (Reachable) continue;
+      Table[Idx] = Table[J];
+      Idx = J;
+    }
+    Table[Idx] = {};
+    return Size;
+  }
+
+  size_t Size() const { return NumEntries; }
+
+  // The mapping with the table (full of chunk addresses), or 0, and its size.
+  uintptr_t Mapping() const { return reinterpret_cast<uintptr_t>(Table); }
+  size_t MappingSize() const { return Table ? MapSize(SizeLog) : 0; }
+
+ private:
+  static size_t MaxEntries(size_t Log) { return (1UL << Log) / 4 * 3; }
+  static size_t MapSize(size_t Log) {
+    return (sizeof(Entry) << Log) + MaxEntries(Log) * sizeof(Chunk);
+  }
+  size_t Mask() const { return (1UL << SizeLog) - 1; }
+
+  size_t Hash(uintptr_t Beg) const {
+    return ((Beg >> kPageSizeLog) * 0x9E3779B97F4A7C15ULL) >> (64 - SizeLog);
+  }
+
+  static size_t EntrySize(Entry E) {
+    return static_cast<size_t>(E.NumPages) << kPageSizeLog;
+  }
+
+  size_t Lookup(uintptr_t Beg) {
+    if (!Table || !Beg) return kNotFound;
+    for (size_t Idx = Hash(Beg); Table[Idx].Beg; Idx = (Idx + 1) & Mask())
+      if (Table[Idx].Beg == Beg) return Idx;
+    return kNotFound;
+  }
+
+  // Maps the table on first use, or maps one twice as large, moves the
+  // chunks there and unmaps the old one.
+  void Grow() {
+    size_t NewSizeLog = Table ? SizeLog + 1 : kInitialSizeLog;
+    void *Res = mmap(0, MapSize(NewSizeLog), PROT_READ | PROT_WRITE,
+                     MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (Res == MAP_FAILED) TRAP();
+    Entry *OldTable = Table;
+    Chunk *OldDense = Dense;
+    size_t OldSizeLog = SizeLog, OldNumEntries = NumEntries;
+    Table = reinterpret_cast<Entry *>(Res);
+    Dense = reinterpret_cast<Chunk *>(Table + (1UL << NewSizeLog));
+    SizeLog = NewSizeLog;
+    NumEntries = 0;
+    for (size_t I = 0; I < OldNumEntries; I++)
+      Insert(OldDense[I].Beg, OldDense[I].Size);
+    if (OldTable) munmap(OldTable, MapSize(OldSizeLog));
+  }
+
+  Entry *Table = nullptr;  // Mapped on first use.
+  Chunk *Dense = nullptr;
+  size_t SizeLog = 0;  // The table has 1 << SizeLog entries.
+  size_t NumEntries = 0;
+};
+
 class LargeAllocator {
-  static constexpr size_t kCpuPageSize = 1 << 12;
-  static constexpr size_t kLeftHeaderMagic =  0x039C823525B0237EULL;
-  static constexpr size_t kRightHeaderMagic = 0x1C2C5300098D85ADULL;
+  static constexpr size_t kPageSize = 1 << 12;
+  // Allocations of at least Config.LargeHugePage Mb are aligned (and sized)
+  // to kHugePageSize and are backed by transparent huge pages, or by
+  // hugetlbfs pages with Config.LargeHugeTLB (if the system has them).
+  // The chunks have no headers, so the user region is aligned too.
+  static constexpr size_t kHugePageSize = 1 << 21;
+
+  // Recently freed (non-fenced) mappings are kept in a cache so that
+  // workloads churning large buffers don't pay for mmap/munmap and for
+  // the page faults on every allocation. Cached mappings are MADV_FREE-ed,
+  // so the kernel may take the pages back under memory pressure.
+  // Bucket B holds mappings with sizes in
+  // [2^(kMinCacheLog+B), 2^(kMinCacheLog+B+1)).
+  static constexpr size_t kMinCacheLog = 18;
+  static constexpr size_t kNumCacheBuckets = 16;
+  static constexpr size_t kCacheEntriesPerBucket = 8;
+  struct CachedMapping {
+    uintptr_t Map;
+    size_t Size;
+    size_t FreeTime;  // usec().
+  };
+  struct CacheBucket {
+    CachedMapping Entries[kCacheEntriesPerBucket];
+    size_t NumEntries;
+  };
+
+  // Allocations come from [kLargeAllocSpace, kLargeAllocSpace +
+  // kLargeAllocSize), which is reserved as PROT_NONE. A fenced region is
+  // mapped back as PROT_NONE with the same flags as the reservation, so the
+  // kernel merges adjacent fenced regions (and the unused parts of the
+  // range) into a single VMA. Fenced regions are kept in a FIFO; once they
+  // exceed Config.LargeFenceBudget the oldest ones are recycled, i.e. their
+  // address space becomes available for new allocations. So, fencing costs a
+  // bounded amount of address space and VMAs, and the most recently freed
+  // regions are the last to be reused.
+  static constexpr int kReservedMapFlags =
+      MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE;
+  static constexpr size_t kMaxFencedRegions = 4096;
+  static constexpr size_t kMaxFreeExtents = 1024;
+  struct Extent {
+    uintptr_t Beg, End;
+  };
+
+  // GC support: the live chunks are scanned for pointers, and the
+  // quarantined chunks are kept until the scan finds no pointers to them.
+  // The live chunks are split into tasks of kScanTaskSize bytes, so that a
+  // single huge chunk is scanned by all the scanning threads.
+  // Mu is not held during the scan: the chunks freed meanwhile are only
+  // unlinked, and are released (i.e. may become PROT_NONE) after it.
+  static constexpr size_t kScanTaskSize = 1 << 16;
+  static constexpr size_t kMaxQuarantinedChunks = 1024;
+  enum page_state_t {
+    PAGE_DEFAULT = 0,
+    PAGE_QUARANTINED = 5,
+    PAGE_MARKED = 7,
+  };
+  struct ScanChunk {
+    uintptr_t Beg;
+    size_t Size;
+    size_t TaskEnd;  // Tasks of all the chunks up to this one, inclusive.
+  };
+  struct DeferredRelease {
+    uintptr_t Map;
+    size_t Size;
+    bool Protect;
+  };
+
  public:
 
-  void *Allocate(size_t Size, size_t Alignment = kCpuPageSize) {
-    if (Alignment < kCpuPageSize) Alignment = kCpuPageSize;
-    size_t RoundedSize = RoundUpTo(Size, kCpuPageSize);
-    size_t SizeWithHeader = RoundedSize + kCpuPageSize;
-    size_t SizeWithSlackForAlignment = SizeWithHeader;
-    if (Alignment > kCpuPageSize)
-      SizeWithSlackForAlignment += Alignment;
-    uintptr_t Map = reinterpret_cast<uintptr_t>(
-        mmap(0, SizeWithSlackForAlignment, PROT_READ | PROT_WRITE,
-             MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0));
-    uintptr_t EndMap = Map + SizeWithSlackForAlignment;
-    if (Map == -1) __builtin_trap();
-    uintptr_t Ret = RoundUpTo(Map + 1, Alignment);
-    uintptr_t End = Ret + RoundedSize;
-    assert(Ret > Map);
-    assert(End <= EndMap);
-    uintptr_t Hdr = Ret - kCpuPageSize;
-    assert(Hdr >= Map);
-    if (Map < Hdr)  // deallocate left slack.
-      munmap(reinterpret_cast<void*>(Map), Hdr - Map);
-    if (End < EndMap)  // deallocate right slack.
-      munmap(reinterpret_cast<void*>(End), EndMap - End);
-    uintptr_t *Header = reinterpret_cast<uintptr_t*>(Hdr);
-    if (Config.LargeAllocVerbose)
-      fprintf(
-          stderr,
-          "LargeAllocator::Allocate:   %p SizeWithHeader %zd Alignment %zd\n",
-          Header, SizeWithHeader, Alignment);
-    Header[0] = kLeftHeaderMagic;
-    Header[1] = SizeWithHeader;
-    Header[2] = kRightHeaderMagic;
-    return Header + kCpuPageSize / sizeof(Header[0]);
+  void *Allocate(size_t Size, size_t Alignment = kPageSize) {
+    if (Alignment < kPageSize) Alignment = kPageSize;
+    bool Huge = Config.LargeHugePage &&
+                Size >= static_cast<size_t>(Config.LargeHugePage) << 20;
+    if (Huge && Alignment < kHugePageSize) Alignment = kHugePageSize;
+    size_t RoundedSize = RoundUpTo(Size, Huge ? kHugePageSize : kPageSize);
+    CachedMapping Cached = AllocateFromCache(RoundedSize, Alignment);
+    if (Cached.Map) {
+      // The cached mapping may have been allocated w/o MADV_HUGEPAGE.
+      if (Huge)
+        madvise(reinterpret_cast<void *>(Cached.Map), Cached.Size,
+                MADV_HUGEPAGE);
+      return RegisterChunk(Cached.Map, Cached.Size, Alignment);
+    }
+    uintptr_t Map = AllocateFromReservedRange(RoundedSize, Alignment, Huge);
+    if (!Map) __builtin_trap();  // The range is exhausted by live allocations.
+    return RegisterChunk(Map, RoundedSize, Alignment);
+  }
+
+  bool IsMine(void *Ptr) {
+    return reinterpret_cast<uintptr_t>(Ptr) - kLargeAllocSpace <
+           kLargeAllocSize;
   }
 
   size_t GetPtrChunkSize(void *Ptr) {
-    auto Header = GetHeader(Ptr);
-    return Header[1] - kCpuPageSize;
+    ScopedLock Lock(Mu, __LINE__);
+    size_t Size = Chunks.Find(reinterpret_cast<uintptr_t>(Ptr));
+    if (!Size) __builtin_trap();
+    return Size;
   }
 
   void Deallocate(void *Ptr, bool Protect) {
-    auto Header = GetHeader(Ptr);
-    size_t MmapSize = Header[1];
+    uintptr_t Map = reinterpret_cast<uintptr_t>(Ptr);
+    size_t MmapSize;
+    {
+      ScopedLock Lock(Mu, __LINE__);
+      MmapSize = Chunks.Erase(Map);
+      LiveBytes -= MmapSize;
+      if (MmapSize && Scanning) {
+        DeferRelease({Map, MmapSize, Protect});
+        return;
+      }
+    }
+    if (!MmapSize) __builtin_trap();  // Double-free or a wild pointer.
+    ReleaseChunk(Map, MmapSize, Protect);
+  }
+
+  // Puts the chunk into quarantine, until a GC scan finds no pointers to it.
+  // Returns the number of quarantined bytes, 0 if the quarantine is full
+  // and the chunk was deallocated right away (counted in
+  // GetNumQuarantineOverflows()).
+  size_t Quarantine(void *Ptr) {
+    uintptr_t Map = reinterpret_cast<uintptr_t>(Ptr);
+    size_t Size;
+    {
+      ScopedLock Lock(Mu, __LINE__);
+      Size = Chunks.Erase(Map);
+      LiveBytes -= Size;
+      if (Size && NumQuarantined < kMaxQuarantinedChunks) {
+        Quarantined[NumQuarantined++] = {Map, Map + Size};
+        QuarantinedBytes += Size;
+        LargePageState::SetRange(Map, Size, PAGE_QUARANTINED);
+        return Size;
+      }
+      if (Size) {
+        NumQuarantineOverflows++;
+        if (Scanning) {
+          DeferRelease({Map, Size, false});
+          return 0;
+        }
+      }
+    }
+    if (!Size) __builtin_trap();  // Double-free or a wild pointer.
+    ReleaseChunk(Map, Size, false);
+    return 0;
+  }
+
+  // Prepares the scan tasks, and defers the release of the chunks freed
+  // from now on until FinishScan, so that no chunk is unmapped while being
+  // scanned. Called by the thread that runs the scan.
+  void PrepareScan() {
+    ScopedLock Lock(Mu, __LINE__);
+    Scanning = true;
+    NumScanQuarantined = NumQuarantined;
+    if (Chunks.Size() > MaxScanChunks) {
+      if (ScanChunks) munmap(ScanChunks, sizeof(ScanChunk) * MaxScanChunks);
+      MaxScanChunks = std::max(kMinScanChunks, 2 * Chunks.Size());
+      void *Res = mmap(0, sizeof(ScanChunk) * MaxScanChunks,
+                       PROT_READ | PROT_WRITE,
+                       MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+      if (Res == MAP_FAILED) TRAP();
+      ScanChunks = reinterpret_cast<ScanChunk *>(Res);
+    }
+    __atomic_store_n(&NumScanTasks, 0, __ATOMIC_RELAXED);
+    size_t NumTasks = 0;
+    NumScanChunks = 0;
+    Chunks.ForEach([&](uintptr_t Beg, size_t Size) {
+      NumTasks += RoundUpTo(Size, kScanTaskSize) / kScanTaskSize;
+      ScanChunks[NumScanChunks++] = {Beg, Size, NumTasks};
+    });
+    ScanRegionSize =
+        NumQuarantined ? ReservedRangeBumpPos - kLargeAllocSpace : 0;
+    __atomic_store_n(&ScanTaskPos, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&NumScanTasks, NumTasks, __ATOMIC_RELEASE);
+  }
+
+  // Size of the part of the range where Mark() needs to be called,
+  // 0 if there are no quarantined chunks.
+  size_t GetScanRegionSize() const {
+    return __atomic_load_n(&ScanRegionSize, __ATOMIC_RELAXED);
+  }
+
+  // Grabs the next scan task and calls CB(Beg, End) for the resident parts
+  // of it. Returns false if there are no more tasks. Can be called
+  // concurrently from multiple threads between PrepareScan and FinishScan.
+  template <typename Callback>
+  bool ScanNextTask(Callback CB) {
+    size_t NumTasks = __atomic_load_n(&NumScanTasks, __ATOMIC_ACQUIRE);
+    size_t Task = __atomic_fetch_add(&ScanTaskPos, 1, __ATOMIC_RELAXED);
+    if (Task >= NumTasks) return false;
+    // A late thread may still hold the NumTasks of the previous scan, more
+    // than the tasks of ScanChunks now.
+    ScanChunk *End = ScanChunks + NumScanChunks;
+    ScanChunk *C = std::upper_bound(
+        ScanChunks, End, Task,
+        [](size_t T, const ScanChunk &C) { return T < C.TaskEnd; });
+    if (C == End) return false;
+    size_t FirstTask =
+        C->TaskEnd - RoundUpTo(C->Size, kScanTaskSize) / kScanTaskSize;
+    uintptr_t Beg = C->Beg + (Task - FirstTask) * kScanTaskSize;
+    size_t Size = std::min(kScanTaskSize, C->Beg + C->Size - Beg);
+    IterateResidentPages(Beg, Size, CB);
+    return true;
+  }
+
+  static void Mark(uintptr_t Ptr) {
+    uint8_t *S = LargePageState::GetShadowPtr(RoundDownTo(Ptr, kPageSize));
+    if (__atomic_load_n(S, __ATOMIC_RELAXED) == PAGE_QUARANTINED)
+      __atomic_store_n(S, PAGE_MARKED, __ATOMIC_RELAXED);
+  }
+
+  // Deallocates the quarantined chunks that were not marked by the scan,
+  // and the chunks freed during the scan. Returns the number of bytes still
+  // in quarantine.
+  size_t FinishScan() {
+    Extent Victims[kMaxQuarantinedChunks];
+    size_t NumVictims = 0, NewQuarantinedBytes = 0, NumDeferred;
+    {
+      ScopedLock Lock(Mu, __LINE__);
+      // The chunks quarantined during the scan were not (fully) scanned
+      // for, they stay until the next one.
+      size_t NumKept = 0;
+      for (size_t I = 0; I < NumQuarantined; I++) {
+        Extent E = Quarantined[I];
+        uint8_t *S = LargePageState::GetShadowPtr(E.Beg);
+        size_t NumPages = (E.End - E.Beg) / kPageSize;
+        if (I >= NumScanQuarantined || memchr(S, PAGE_MARKED, NumPages)) {
+          memset(S, PAGE_QUARANTINED, NumPages);
+          NewQuarantinedBytes += E.End - E.Beg;
+          Quarantined[NumKept++] = E;
+        } else {
+          memset(S, PAGE_DEFAULT, NumPages);
+          Victims[NumVictims++] = E;
+        }
+      }
+      NumQuarantined = NumKept;
+      __atomic_store_n(&QuarantinedBytes, NewQuarantinedBytes,
+                       __ATOMIC_RELAXED);
+      __atomic_store_n(&ScanRegionSize, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&NumScanTasks, 0, __ATOMIC_RELAXED);
+      Scanning = false;
+      // Nothing is added to Deferred until the next PrepareScan, which
+      // can't come before this one returns.
+      NumDeferred = NumDeferredReleases;
+      NumDeferredReleases = 0;
+    }
+    for (size_t I = 0; I < NumVictims; I++)
+      ReleaseChunk(Victims[I].Beg, Victims[I].End - Victims[I].Beg, false);
+    for (size_t I = 0; I < NumDeferred; I++)
+      ReleaseChunk(Deferred[I].Map, Deferred[I].Size, Deferred[I].Protect);
+    return NewQuarantinedBytes;
+  }
+
+  // Unmaps the cached mappings that are older than the decay period,
+  // or all of them if Force is true. Returns the number of bytes unmapped.
+  size_t PurgeCache(bool Force) {
+    CachedMapping Victims[kNumCacheBuckets * kCacheEntriesPerBucket];
+    size_t NumVictims = 0;
+    {
+      ScopedLock Lock(Mu, __LINE__);
+      size_t Now = usec();
+      size_t Decay = Config.LargeCacheDecay * 1000UL;
+      for (auto &B : Cache) {
+        for (size_t I = 0; I < B.NumEntries;) {
+          if (Force || Now - B.Entries[I].FreeTime >= Decay)
+            Victims[NumVictims++] = RemoveCacheEntry(B, I);
+          else
+            I++;
+        }
+      }
+    }
+    return UnmapVictims(Victims, NumVictims);
+  }
+
+  size_t GetCachedBytes() const {
+    return __atomic_load_n(&CachedBytes, __ATOMIC_RELAXED);
+  }
+  size_t GetNumCacheHits() const {
+    return __atomic_load_n(&NumCacheHits, __ATOMIC_RELAXED);
+  }
+  size_t GetFencedBytes() const {
+    return __atomic_load_n(&FencedBytes, __ATOMIC_RELAXED);
+  }
+  size_t GetQuarantinedBytes() const {
+    return __atomic_load_n(&QuarantinedBytes, __ATOMIC_RELAXED);
+  }
+  // The chunks freed with a full quarantine, i.e. w/o one.
+  size_t GetNumQuarantineOverflows() const {
+    return __atomic_load_n(&NumQuarantineOverflows, __ATOMIC_RELAXED);
+  }
+  size_t GetLiveBytes() const {
+    return __atomic_load_n(&LiveBytes, __ATOMIC_RELAXED);
+  }
+  size_t GetNumLiveChunks() {
+    ScopedLock Lock(Mu, __LINE__);
+    return Chunks.Size();
+  }
+
+  // Lock() keeps the set of live chunks fixed, e.g. while mtm_iterate()
+  // walks them; ForEachLiveChunk() requires it.
+  void Lock() { pthread_mutex_lock(&Mu); }
+  void Unlock() { pthread_mutex_unlock(&Mu); }
+
+  // Calls CB(Beg, Size) for every live chunk.
+  template <typename Callback>
+  void ForEachLiveChunk(Callback CB) {
+    Chunks.ForEach(CB);
+  }
+
+  // Calls CB(Beg, Size) for the internal mappings that hold chunk addresses,
+  // which the leak check must not take for roots.
+  template <typename Callback>
+  void ForEachMetadataMapping(Callback CB) {
+    if (Chunks.Mapping()) CB(Chunks.Mapping(), Chunks.MappingSize());
+    if (ScanChunks)
+      CB(reinterpret_cast<uintptr_t>(ScanChunks),
+         sizeof(ScanChunk) * MaxScanChunks);
+  }
+
+  // Calls CB(Beg, End) for every maximal run of resident pages in
+  // [Beg, Beg + Size). Pages that were never touched (or were released
+  // since) contain only zeros, so e.g. the GC scan can skip them.
+  template <typename Callback>
+  static void IterateResidentPages(uintptr_t Beg, size_t Size, Callback CB) {
+    constexpr size_t kBatch = 4096;  // pages per mincore call.
+    unsigned char Vec[kBatch];
+    uintptr_t End = Beg + Size, RunBeg = 0;
+    for (uintptr_t Pos = Beg; Pos < End; Pos += kBatch * kPageSize) {
+      size_t Len = std::min(End - Pos, kBatch * kPageSize);
+      if (mincore(reinterpret_cast<void *>(Pos), Len, Vec))
+        memset(Vec, 1, sizeof(Vec));  // Don't know, assume resident.
+      for (size_t I = 0; I < Len / kPageSize; I++) {
+        uintptr_t Page = Pos + I * kPageSize;
+        if (Vec[I] & 1) {
+          if (!RunBeg) RunBeg = Page;
+        } else if (RunBeg) {
+          CB(RunBeg, Page);
+          RunBeg = 0;
+        }
+      }
+    }
+    if (RunBeg) CB(RunBeg, End);
+  }
+
+ private:
+  // Requires Mu and Scanning. Deferred grows as needed.
+  void DeferRelease(DeferredRelease D) {
+    if (NumDeferredReleases == MaxDeferredReleases) {
+      size_t NewMax = std::max<size_t>(kPageSize / sizeof(D),
+                                       2 * MaxDeferredReleases);
+      void *Res = mmap(0, NewMax * sizeof(D), PROT_READ | PROT_WRITE,
+                       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+      if (Res == MAP_FAILED) TRAP();
+      if (Deferred) {
+        memcpy(Res, Deferred, NumDeferredReleases * sizeof(D));
+        munmap(Deferred, MaxDeferredReleases * sizeof(D));
+      }
+      Deferred = reinterpret_cast<DeferredRelease *>(Res);
+      MaxDeferredReleases = NewMax;
+    }
+    Deferred[NumDeferredReleases++] = D;
+  }
+
+  void ReleaseChunk(uintptr_t Map, size_t Size, bool Protect) {
     if (Config.LargeAllocVerbose)
-      fprintf(stderr, "LargeAllocator::Deallocate: %p %zd %s\n", Header,
-              MmapSize, Protect ? "protect" : "recycle");
+      fprintf(stderr, "LargeAllocator::Deallocate: %p %zd %s\n",
+              reinterpret_cast<void *>(Map), Size,
+              Protect ? "protect" : "recycle");
     if (Protect)
-      mmap(Header, MmapSize, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED,
-           -1, 0);
+      Fence(Map, Size);
+    else if (!DeallocateToCache(Map, Size))
+      ReleaseMapping(Map, Size);
+  }
+
+  void *RegisterChunk(uintptr_t Map, size_t Size, size_t Alignment) {
+    if (Config.LargeAllocVerbose)
+      fprintf(stderr, "LargeAllocator::Allocate:   %p Size %zd Alignment %zd\n",
+              reinterpret_cast<void *>(Map), Size, Alignment);
+    ScopedLock Lock(Mu, __LINE__);
+    Chunks.Insert(Map, Size);
+    LiveBytes += Size;
+    return reinterpret_cast<void *>(Map);
+  }
+
+  static size_t CacheBucketIdx(size_t MmapSize) {
+    return MostSignificantSetBitIndex(MmapSize) - kMinCacheLog;
+  }
+
+  // Returns the best-fitting cached mapping of at least MmapSize bytes
+  // whose user region satisfies Alignment, or an empty CachedMapping.
+  CachedMapping AllocateFromCache(size_t MmapSize, size_t Alignment) {
+    if (!Config.LargeCacheSize || MmapSize < (1UL << kMinCacheLog)) return {};
+    size_t BucketIdx = CacheBucketIdx(MmapSize);
+    if (BucketIdx >= kNumCacheBuckets) return {};
+    ScopedLock Lock(Mu, __LINE__);
+    auto &B = Cache[BucketIdx];
+    size_t Best = kCacheEntriesPerBucket;
+    // Iterate from the most recently freed entry: it is more likely to be
+    // still backed by physical pages.
+    for (size_t I = B.NumEntries; I-- > 0;) {
+      auto &E = B.Entries[I];
+      if (E.Size < MmapSize || !IsAligned(E.Map, Alignment))
+        continue;
+      if (Best == kCacheEntriesPerBucket || E.Size < B.Entries[Best].Size)
+        Best = I;
+      if (E.Size == MmapSize) break;
+    }
+    if (Best == kCacheEntriesPerBucket) return {};
+    __atomic_add_fetch(&NumCacheHits, 1, __ATOMIC_RELAXED);
+    return RemoveCacheEntry(B, Best);
+  }
+
+  // Returns false if the mapping can not be cached and needs to be unmapped.
+  bool DeallocateToCache(uintptr_t Map, size_t MmapSize) {
+    if (!Config.LargeCacheSize || MmapSize < (1UL << kMinCacheLog)) return false;
+    size_t BucketIdx = CacheBucketIdx(MmapSize);
+    if (BucketIdx >= kNumCacheBuckets) return false;
+    size_t Limit = static_cast<size_t>(Config.LargeCacheSize) << 20;
+    if (MmapSize > Limit) return false;
+    void *Ptr = reinterpret_cast<void *>(Map);
+    if (madvise(Ptr, MmapSize, MADV_FREE) && errno == EINVAL)
+      madvise(Ptr, MmapSize, MADV_DONTNEED);  // Pre-4.5 kernel.
+
+    CachedMapping Victims[kNumCacheBuckets * kCacheEntriesPerBucket + 1];
+    size_t NumVictims = 0;
+    {
+      ScopedLock Lock(Mu, __LINE__);
+      auto &B = Cache[BucketIdx];
+      if (B.NumEntries == kCacheEntriesPerBucket)
+        Victims[NumVictims++] = RemoveCacheEntry(B, 0);  // the oldest.
+      B.Entries[B.NumEntries++] = {Map, MmapSize, usec()};
+      CachedBytes += MmapSize;
+      // Evict the oldest mappings until we fit into the limit.
+      while (CachedBytes > Limit) {
+        CacheBucket *Oldest = nullptr;
+        for (auto &Other : Cache)
+          if (Other.NumEntries &&
+              (!Oldest ||
+               Other.Entries[0].FreeTime < Oldest->Entries[0].FreeTime))
+            Oldest = &Other;
+        Victims[NumVictims++] = RemoveCacheEntry(*Oldest, 0);
+      }
+    }
+    UnmapVictims(Victims, NumVictims);
+    PurgeCache(false);
+    return true;
+  }
+
+  // Entries in a bucket are sorted by FreeTime.
+  CachedMapping RemoveCacheEntry(CacheBucket &B, size_t Idx) {
+    CachedMapping E = B.Entries[Idx];
+    for (size_t I = Idx + 1; I < B.NumEntries; I++)
+      B.Entries[I - 1] = B.Entries[I];
+    B.NumEntries--;
+    CachedBytes -= E.Size;
+    return E;
+  }
+
+  size_t UnmapVictims(CachedMapping *Victims, size_t NumVictims) {
+    size_t Res = 0;
+    for (size_t I = 0; I < NumVictims; I++) {
+      ReleaseMapping(Victims[I].Map, Victims[I].Size);
+      Res += Victims[I].Size;
+    }
+    return Res;
+  }
+
+  // Returns the memory to the OS. Never munmap anything inside the reserved
+  // range: the kernel could place some other mapping there.
+  void ReleaseMapping(uintptr_t Map, size_t Size) {
+    if (mmap(reinterpret_cast<void *>(Map), Size, PROT_NONE, kReservedMapFlags,
+             -1, 0) != reinterpret_cast<void *>(Map))
+      TRAP();
+    ScopedLock Lock(Mu, __LINE__);
+    AddFreeExtent({Map, Map + Size});
+  }
+
+  void Fence(uintptr_t Map, size_t Size) {
+    void *Res = mmap(reinterpret_cast<void *>(Map), Size, PROT_NONE,
+                     kReservedMapFlags, -1, 0);
+    if (Res != reinterpret_cast<void *>(Map)) TRAP();
+    ScopedLock Lock(Mu, __LINE__);
+    Extent &Newest = Fenced[(FencedHead + NumFenced - 1) % kMaxFencedRegions];
+    if (NumFenced && Newest.End == Map)
+      Newest.End += Size;
+    else if (NumFenced && Newest.Beg == Map + Size)
+      Newest.Beg = Map;
     else
-      munmap(Header, MmapSize);
+      Fenced[(FencedHead + NumFenced++) % kMaxFencedRegions] = {Map, Map + Size};
+    FencedBytes += Size;
+    size_t Budget = static_cast<size_t>(Config.LargeFenceBudget) << 20;
+    while (NumFenced && (FencedBytes > Budget || NumFenced == kMaxFencedRegions))
+      RecycleOldestFencedRegion();
   }
- private:
-  uintptr_t *GetHeader(void *Ptr) {
-    uintptr_t *Header =
-        reinterpret_cast<uintptr_t *>(Ptr) - kCpuPageSize / sizeof(Header[0]);
-    if (Header[0] != kLeftHeaderMagic && Header[2] != kRightHeaderMagic)
-      __builtin_trap();
-    return Header;
+
+  void RecycleOldestFencedRegion() {
+    Extent E = Fenced[FencedHead];
+    FencedHead = (FencedHead + 1) % kMaxFencedRegions;
+    NumFenced--;
+    FencedBytes -= E.End - E.Beg;
+    // Already PROT_NONE and has no pages, can be reused as is.
+    AddFreeExtent(E);
+  }
+
+  // Requires Mu. FreeExtents is sorted and coalesced.
+  void AddFreeExtent(Extent E) {
+    if (E.Beg == E.End) return;
+    if (E.End == ReservedRangeBumpPos) {
+      ReservedRangeBumpPos = E.Beg;
+      if (NumFreeExtents &&
+          FreeExtents[NumFreeExtents - 1].End == ReservedRangeBumpPos)
+        ReservedRangeBumpPos = FreeExtents[--NumFreeExtents].Beg;
+      return;
+    }
+    Extent *Beg = FreeExtents, *End = FreeExtents + NumFreeExtents;
+    Extent *Right = std::upper_bound(
+        Beg, End, E, [](Extent A, Extent B) { return A.Beg < B.Beg; });
+    Extent *Left = Right == Beg ? nullptr : Right - 1;
+    bool MergeLeft = Left && Left->End == E.Beg;
+    bool MergeRight = Right != End && Right->Beg == E.End;
+    if (MergeLeft && MergeRight) {
+      Left->End = Right->End;
+      std::copy(Right + 1, End, Right);
+      NumFreeExtents--;
+    } else if (MergeLeft) {
+      Left->End = E.End;
+    } else if (MergeRight) {
+      Right->Beg = E.Beg;
+    } else if (NumFreeExtents < kMaxFreeExtents) {
+      std::copy_backward(Right, End, End + 1);
+      *Right = E;
+      NumFreeExtents++;
+    }
+    // Otherwise, the extent is lost (but stays reserved).
+  }
+
+  // Requires Mu. Returns the address of the new mapping, or 0.
+  uintptr_t TakeFreeExtent(size_t Size, size_t Alignment) {
+    for (size_t I = 0; I < NumFreeExtents; I++) {
+      Extent E = FreeExtents[I];
+      uintptr_t Beg = RoundUpTo(E.Beg, Alignment);
+      if (Beg + Size > E.End) continue;
+      std::copy(FreeExtents + I + 1, FreeExtents + NumFreeExtents,
+                FreeExtents + I);
+      NumFreeExtents--;
+      AddFreeExtent({E.Beg, Beg});
+      AddFreeExtent({Beg + Size, E.End});
+      return Beg;
+    }
+    uintptr_t OldBumpPos = ReservedRangeBumpPos;
+    uintptr_t Beg = RoundUpTo(OldBumpPos, Alignment);
+    if (Beg + Size > kLargeAllocSpace + kLargeAllocSize) return 0;
+    ReservedRangeBumpPos = Beg + Size;
+    AddFreeExtent({OldBumpPos, Beg});
+    return Beg;
+  }
+
+  // The range (and its page state) is process-wide: the allocator has one
+  // instance, the tests create their own ones in turn. So it is reserved
+  // once, rather than MAP_FIXED over again by every instance.
+  static void ReserveRange() {
+    static pthread_once_t Once = PTHREAD_ONCE_INIT;
+    pthread_once(&Once, [] {
+      void *Res = mmap(reinterpret_cast<void *>(kLargeAllocSpace),
+                       kLargeAllocSize, PROT_NONE, kReservedMapFlags, -1, 0);
+      if (Res != reinterpret_cast<void *>(kLargeAllocSpace)) TRAP();
+      LargePageState::Init();
+    });
   }
+
+  uintptr_t AllocateFromReservedRange(size_t Size, size_t Alignment,
+                                      bool Huge) {
+    uintptr_t Map = 0;
+    {
+      ScopedLock Lock(Mu, __LINE__);
+      if (!ReservedRangeBumpPos) {
+        ReserveRange();
+        ReservedRangeBumpPos = kLargeAllocSpace;
+      }
+      while (!(Map = TakeFreeExtent(Size, Alignment)) && NumFenced)
+        RecycleOldestFencedRegion();
+    }
+    if (!Map) return 0;
+    void *Res = MAP_FAILED;
+    // W/o MAP_NORESERVE the huge pages are reserved right away, so this
+    // fails (rather than SIGBUS-es later) if there are not enough of them.
+    if (Huge && Config.LargeHugeTLB)
+      Res = mmap(reinterpret_cast<void *>(Map), Size, PROT_READ | PROT_WRITE,
+                 (kReservedMapFlags & ~MAP_NORESERVE) | MAP_HUGETLB, -1, 0);
+    if (Res == MAP_FAILED) {
+      Res = mmap(reinterpret_cast<void *>(Map), Size, PROT_READ | PROT_WRITE,
+                 kReservedMapFlags, -1, 0);
+      if (Huge) madvise(Res, Size, MADV_HUGEPAGE);
+    }
+    if (Res != reinterpret_cast<void *>(Map)) TRAP();
+    return Map;
+  }
+
+  pthread_mutex_t Mu = PTHREAD_MUTEX_INITIALIZER;
+  LargeChunkTable Chunks;  // Live chunks, modified under Mu.
+  CacheBucket Cache[kNumCacheBuckets] = {};
+  size_t CachedBytes = 0;  // Modified under Mu.
+  // The reserved range is mapped on first use; everything at and above
+  // ReservedRangeBumpPos has never been allocated.
+  uintptr_t ReservedRangeBumpPos = 0;
+  Extent FreeExtents[kMaxFreeExtents] = {};
+  size_t NumFreeExtents = 0;
+  Extent Fenced[kMaxFencedRegions] = {};  // FIFO.
+  size_t FencedHead = 0;
+  size_t NumFenced = 0;
+  size_t FencedBytes = 0;  // Modified under Mu.
+  Extent Quarantined[kMaxQuarantinedChunks] = {};
+  size_t NumQuarantined = 0;
+  size_t QuarantinedBytes = 0;  // Modified under Mu.
+  size_t NumQuarantineOverflows = 0;  // Modified under Mu.
+  size_t LiveBytes = 0;  // Modified under Mu.
+  // The scan state; see PrepareScan().
+  static constexpr size_t kMinScanChunks = 1 << 16;
+  ScanChunk *ScanChunks = nullptr;  // Mapped on first use, grows with Chunks.
+  size_t MaxScanChunks = 0;
+  size_t NumScanChunks = 0;
+  size_t NumScanTasks = 0;  // atomic
+  size_t ScanTaskPos = 0;  // atomic
+  size_t ScanRegionSize = 0;  // atomic
+  // Between PrepareScan and FinishScan, under Mu.
+  bool Scanning = false;
+  size_t NumScanQuarantined = 0;  // The first ones are scanned for.
+  DeferredRelease *Deferred = nullptr;
+  size_t NumDeferredReleases = 0, MaxDeferredReleases = 0;
+  size_t NumCacheHits = 0;  // atomic
 };
 
 }  // namespace MTMalloc
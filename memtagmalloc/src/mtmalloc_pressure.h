@@ -0,0 +1,170 @@
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+#ifndef __MTMALLOC_PRESSURE_H__
+#define __MTMALLOC_PRESSURE_H__
+
+#include "mtmalloc_util.h"
+
+#include <linux/magic.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+namespace MTMalloc {
+
+// Watches the memory pressure: the PSI (pressure stall information) of the
+// cgroup of the process, or of the whole system, and the cgroup usage
+// relative to memory.max.
+// For the kernel PSI files a trigger is registered and waited for with
+// poll(). Any other file (e.g. a fake one in a test) is re-read on every
+// Wait() instead, and its "some avg10" is compared with the same threshold.
+// Doesn't allocate, so that it may run while the heap is busy.
+struct PressureMonitor {
+  static constexpr size_t kMaxPath = 256;
+  // Unprivileged triggers need a multiple of 2s.
+  static constexpr size_t kWindowUs = 2000000;
+  // The cgroup usage above this percentage of memory.max is pressure too.
+  static constexpr size_t kLimitPercent = 90;
+
+  int Fd = -1;
+  bool Trigger = false;  // A kernel PSI trigger is registered on Fd.
+  bool OverLimit = false;
+  size_t StallUs = 0;
+  char Dir[kMaxPath] = {};  // The cgroup directory (with a '/'), or "".
+
+  // If Path is null, uses memory.pressure of the cgroup (v2) if there is
+  // one, otherwise /proc/pressure/memory. A Path ending in memory.pressure
+  // also enables the memory.max check in the same directory.
+  // Pressure means a stall of at least StallMs per kWindowUs.
+  // Returns false if there is nothing to watch.
+  bool Init(const char *Path, size_t StallMs) {
+    StallUs = StallMs * 1000;
+    char Buf[kMaxPath];
+    if (!Path) {
+      if (FindCgroupDir() && Concat(Buf, Dir, "memory.pressure") &&
+          !access(Buf, R_OK)) {
+        Path = Buf;
+      } else {
+        Dir[0] = 0;
+        Path = "/proc/pressure/memory";
+      }
+    } else if (const char *Slash = strrchr(Path, '/')) {
+      size_t Len = Slash + 1 - Path;
+      if (!strcmp(Slash + 1, "memory.pressure") && Len < kMaxPath) {
+        memcpy(Dir, Path, Len);
+        Dir[Len] = 0;
+      }
+    }
+    Fd = open(Path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (Fd < 0) Fd = open(Path, O_RDONLY | O_CLOEXEC);
+    if (Fd < 0) return false;
+    struct statfs FS;
+    if (!fstatfs(Fd, &FS) &&
+        (FS.f_type == PROC_SUPER_MAGIC || FS.f_type == CGROUP2_SUPER_MAGIC)) {
+      char T[64];
+      int Len = snprintf(T, sizeof(T), "some %zd %zd", StallUs, kWindowUs);
+      Trigger = write(Fd, T, Len + 1) > 0;
+    }
+    return true;
+  }
+
+  // Waits for at most TimeoutMs. Returns true if there is pressure: the
+  // trigger fired (or avg10 is above the threshold), or the cgroup usage
+  // has just crossed kLimitPercent of memory.max.
+  bool Wait(int TimeoutMs) {
+    bool Res = false;
+    if (Trigger) {
+      struct pollfd P = {Fd, POLLPRI, 0};
+      if (poll(&P, 1, TimeoutMs) > 0) {
+        if (P.revents & POLLERR)
+          Trigger = false;  // E.g. the cgroup is gone.
+        else
+          Res = P.revents & POLLPRI;
+      }
+    } else {
+      usleep(TimeoutMs * 1000);
+      char Buf[256];
+      ssize_t Len = pread(Fd, Buf, sizeof(Buf) - 1, 0);
+      if (Len > 0) {
+        Buf[Len] = 0;
+        Res = ParseAvg10(Buf) * kWindowUs >= StallUs * 100 * 100;
+      }
+    }
+    bool WasOverLimit = OverLimit;
+    OverLimit = IsOverLimit();
+    return Res || (OverLimit && !WasOverLimit);
+  }
+
+  // Returns "some avg10" in hundredths of a percent.
+  static size_t ParseAvg10(const char *Buf) {
+    const char *P = strstr(Buf, "some avg10=");
+    if (!P) return 0;
+    P += strlen("some avg10=");
+    size_t Res = 0;
+    for (; *P >= '0' && *P <= '9'; P++) Res = Res * 10 + *P - '0';
+    Res *= 100;
+    if (*P == '.') {
+      if (P[1] >= '0' && P[1] <= '9') Res += (P[1] - '0') * 10;
+      if (P[1] && P[2] >= '0' && P[2] <= '9') Res += P[2] - '0';
+    }
+    return Res;
+  }
+
+  bool IsOverLimit() {
+    if (!Dir[0]) return false;
+    size_t Max, Current;
+    if (!ReadNumber("memory.max", &Max) ||
+        !ReadNumber("memory.current", &Current))
+      return false;  // Also if memory.max is "max".
+    return Current * 100 > Max * kLimitPercent;
+  }
+
+  bool ReadNumber(const char *Name, size_t *Res) {
+    char Buf[kMaxPath];
+    if (!Concat(Buf, Dir, Name)) return false;
+    int F = open(Buf, O_RDONLY | O_CLOEXEC);
+    if (F < 0) return false;
+    ssize_t Len = read(F, Buf, 32);
+    close(F);
+    if (Len <= 0 || Buf[0] < '0' || Buf[0] > '9') return false;
+    *Res = 0;
+    for (ssize_t I = 0; I < Len && Buf[I] >= '0' && Buf[I] <= '9'; I++)
+      *Res = *Res * 10 + Buf[I] - '0';
+    return true;
+  }
+
+  // Finds the cgroup v2 directory of the process ("0::/path" in
+  // /proc/self/cgroup).
+  bool FindCgroupDir() {
+    char Buf[1024];
+    int F = open("/proc/self/cgroup", O_RDONLY | O_CLOEXEC);
+    if (F < 0) return false;
+    ssize_t Len = read(F, Buf, sizeof(Buf) - 1);
+    close(F);
+    if (Len <= 0) return false;
+    Buf[Len] = 0;
+    char *Line = Buf[0] == '0' && Buf[1] == ':' ? Buf : strstr(Buf, "\n0::");
+    if (!Line) return false;
+    Line = strchr(Line, '/');
+    if (!Line) return false;
+    Line[strcspn(Line, "\n")] = 0;
+    return Concat(Dir, "/sys/fs/cgroup", Line) &&
+           Concat(Dir, Dir, Line[1] ? "/" : "");
+  }
+
+  static bool Concat(char *Res, const char *A, const char *B) {
+    size_t LenA = strlen(A), LenB = strlen(B);
+    if (LenA + LenB >= kMaxPath) return false;
+    memmove(Res, A, LenA);
+    memcpy(Res + LenA, B, LenB + 1);
+    return true;
+  }
+};
+
+}  // namespace MTMalloc
+
+#endif  // __MTMALLOC_PRESSURE_H__
@@ -13,6 +13,7 @@ namespace MTMalloc {
 template <uintptr_t kShadowBeg, uintptr_t kBeg, uintptr_t kSize,
           uintptr_t kGranularity, uintptr_t kUnitSize = 1>
 struct FixedShadow {
+  static const uintptr_t kShadowStart = kShadowBeg;
   static const uintptr_t kShadowSize = kUnitSize * kSize / kGranularity;
   static void Init() {
     void *Res =
@@ -0,0 +1,159 @@
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+// The size class search of mtm_size_class_gen: chooses a size class table
+// for an allocation size histogram. Not used by the allocator itself.
+
+#ifndef __MTMALLOC_SIZE_CLASS_GEN_H__
+#define __MTMALLOC_SIZE_CLASS_GEN_H__
+
+#include "mtmalloc_size_classes.h"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+namespace MTMalloc {
+
+// The number of the requested sizes (the most frequent ones) tried as size
+// classes; the search is quadratic in it.
+static constexpr size_t kMaxCandidates = 2000;
+static constexpr size_t kNumFixedClasses = 16;  // 16, 32, ..., 256.
+static constexpr size_t kMinTunedSize = 257;
+
+using SizeHistogram = std::map<size_t, uint64_t>;  // Requested size => count.
+
+inline void AddSize(SizeHistogram &H, size_t Size, uint64_t Count) {
+  H[Size < 8 ? 1 : Size] += Count;  // Like Malloc().
+}
+
+inline bool IsValidChunkSize(size_t ChunkSize) {
+  static std::map<size_t, bool> Cache;
+  auto It = Cache.find(ChunkSize);
+  if (It != Cache.end()) return It->second;
+  return Cache[ChunkSize] = IsCorrectDivToMul(
+             ChunkSize, ComputeMulForDiv(ChunkSize, kDivMulShift),
+             kDivMulShift, kSuperPageSize);
+}
+
+// The smallest valid chunk size for Size.
+inline size_t ValidChunkSize(size_t Size) {
+  size_t ChunkSize = RoundUpTo(Size, 16);
+  while (ChunkSize < kMaxSizeClass && !IsValidChunkSize(ChunkSize))
+    ChunkSize += 16;
+  return std::min(ChunkSize, kMaxSizeClass);
+}
+
+// The share of one chunk in the SuperPage tail that can't hold a chunk.
+inline double TailPerChunk(size_t ChunkSize) {
+  size_t RangeNum = ChunkSize % kSizeAlignmentForSecondRange == 0;
+  size_t NumChunks = ComputeNumChunks(ChunkSize, RangeNum);
+  size_t Used = NumChunks * ChunkSize + SizeOfInlineMeta(NumChunks, RangeNum);
+  return static_cast<double>(kSuperPageSize - Used) / NumChunks;
+}
+
+struct Waste {
+  double Requested = 0, Slack = 0, Tail = 0;
+  double Percent() const {
+    return Requested ? 100 * (Slack + Tail) / Requested : 0;
+  }
+};
+
+// The waste of the allocations in the tuned range with the size class table
+// Sizes (kNumSizeClasses entries).
+inline Waste ComputeWaste(const SizeHistogram &H, const size_t *Sizes) {
+  Waste W;
+  const size_t *End = Sizes + kNumSizeClasses;
+  for (auto It = H.lower_bound(kMinTunedSize);
+       It != H.end() && It->first <= kMaxSizeClass; ++It) {
+    size_t ChunkSize = *std::lower_bound(Sizes, End, It->first);
+    W.Requested += static_cast<double>(It->first) * It->second;
+    W.Slack += static_cast<double>(ChunkSize - It->first) * It->second;
+    W.Tail += TailPerChunk(ChunkSize) * It->second;
+  }
+  return W;
+}
+
+// Chooses the size classes above 256 among the valid chunk sizes of the most
+// frequent requested sizes and the powers of two, which must be kept (see
+// CheckSizeClasses()). Best[K][J] is the least waste of the sizes up to
+// Candidates[J] with K classes, the last one being Candidates[J].
+inline std::vector<size_t> ChooseSizeClasses(const SizeHistogram &H,
+                                             size_t NumClasses) {
+  std::vector<std::pair<uint64_t, size_t>> ByCount;
+  for (auto It = H.lower_bound(kMinTunedSize);
+       It != H.end() && It->first <= kMaxSizeClass; ++It)
+    ByCount.push_back({It->second, It->first});
+  std::sort(ByCount.rbegin(), ByCount.rend());
+  if (ByCount.size() > kMaxCandidates) ByCount.resize(kMaxCandidates);
+  std::vector<size_t> Candidates;
+  for (size_t Size = 512; Size <= kMaxSizeClass; Size *= 2)
+    Candidates.push_back(Size);
+  for (auto &P : ByCount) Candidates.push_back(ValidChunkSize(P.second));
+  std::sort(Candidates.begin(), Candidates.end());
+  Candidates.erase(std::unique(Candidates.begin(), Candidates.end()),
+                   Candidates.end());
+  size_t M = Candidates.size();
+
+  // Prefix sums of the counts and of the requested bytes, over the sizes up
+  // to each candidate. NextPowerOfTwo[J] is the first power of two at or
+  // after J: a class can't be followed by one past it.
+  std::vector<double> Count(M + 1), Bytes(M + 1), Tail(M);
+  std::vector<size_t> NextPowerOfTwo(M + 1, M);
+  auto It = H.lower_bound(kMinTunedSize);
+  for (size_t J = 0; J < M; J++) {
+    Count[J + 1] = Count[J];
+    Bytes[J + 1] = Bytes[J];
+    for (; It != H.end() && It->first <= Candidates[J]; ++It) {
+      Count[J + 1] += It->second;
+      Bytes[J + 1] += static_cast<double>(It->first) * It->second;
+    }
+    Tail[J] = TailPerChunk(Candidates[J]);
+  }
+  for (size_t J = M; J--;)
+    NextPowerOfTwo[J] = IsPowerOfTwo(Candidates[J]) ? J : NextPowerOfTwo[J + 1];
+  // The waste of the sizes in (Candidates[I - 1], Candidates[J]] in the size
+  // class Candidates[J].
+  auto Cost = [&](size_t I, size_t J) {
+    double N = Count[J + 1] - Count[I];
+    return N * (Candidates[J] + Tail[J]) - (Bytes[J + 1] - Bytes[I]);
+  };
+
+  size_t K = std::min(NumClasses, M);
+  std::vector<std::vector<double>> Best(K + 1, std::vector<double>(M, 1e300));
+  std::vector<std::vector<uint32_t>> Prev(K + 1, std::vector<uint32_t>(M));
+  for (size_t J = 0; J <= NextPowerOfTwo[0]; J++) Best[1][J] = Cost(0, J);
+  for (size_t C = 2; C <= K; C++)
+    for (size_t J = C - 1; J < M; J++)
+      for (size_t I = C - 2; I < J; I++) {
+        if (NextPowerOfTwo[I + 1] < J) continue;
+        double V = Best[C - 1][I] + Cost(I + 1, J);
+        if (V < Best[C][J]) {
+          Best[C][J] = V;
+          Prev[C][J] = I;
+        }
+      }
+  std::vector<size_t> Res;
+  for (size_t C = K, J = M - 1; C; J = Prev[C--][J])
+    Res.push_back(Candidates[J]);
+  std::reverse(Res.begin(), Res.end());
+  return Res;
+}
+
+// The full table: the fixed sizes, Tuned, and as many of the default sizes
+// as needed to fill it (more size classes never add waste).
+inline void MakeTable(const std::vector<size_t> &Tuned, size_t *Sizes) {
+  std::vector<size_t> All(SCArray, SCArray + kNumFixedClasses);
+  All.insert(All.end(), Tuned.begin(), Tuned.end());
+  for (size_t I = kNumFixedClasses;
+       All.size() < kNumSizeClasses && I < kNumSizeClasses; I++)
+    if (std::find(Tuned.begin(), Tuned.end(), SCArray[I]) == Tuned.end())
+      All.push_back(SCArray[I]);
+  std::sort(All.begin(), All.end());
+  std::copy(All.begin(), All.end(), Sizes);
+}
+
+}  // namespace MTMalloc
+
+#endif  // __MTMALLOC_SIZE_CLASS_GEN_H__
@@ -5,14 +5,25 @@
 #ifndef __MTMALLOC_SIZE_CLASSES_H__
 #define __MTMALLOC_SIZE_CLASSES_H__
 
+#include "mtmalloc_util.h"
+
 #include <stdint.h>
 #include <stddef.h>
 
 namespace MTMalloc {
 
+static const size_t kSuperPageSize = 1 << 19; // 2Mb
+// Even better is to have super pages of different sizes.
+
+// The size classes that are a multiple of this are in the second range, see
+// kNumSizeClassRanges.
+static constexpr size_t kSizeAlignmentForSecondRange = 1024;
+
 // All size classes are 0 mod 16.
 // Contains all multiples of 16 from 16 to 256.
 // All size classes satisfy IsCorrectDivToMul.
+// MTM_SIZE_CLASSES=<file> replaces this table at startup, see
+// mtm_size_class_gen.
 constexpr size_t SCArray[] = {
     1 * 16, 2 * 16,  3 * 16,  4 * 16,  5 * 16,  6 * 16,  7 * 16,  8 * 16,
     9 * 16, 10 * 16, 11 * 16, 12 * 16, 13 * 16, 14 * 16, 15 * 16, 16 * 16,
@@ -28,6 +39,108 @@ constexpr size_t SCArray[] = {
 static constexpr size_t kNumSizeClasses = sizeof(SCArray) / sizeof(SCArray[0]);
 static constexpr size_t kMaxSizeClass = SCArray[kNumSizeClasses - 1];
 
+// Factoid: a division by a constant can be replaced with
+// a multiplication by a constant followed by a shift.
+// Compilers do it all the time.
+// Factoid: when computing Left / Div, where Left is in [0,kSuperPageSize)
+// and Div is in [16, MaxSizeClass] the division can be replaced by
+// a multiplication followed by a right shift by 35 for *most* values of Div.
+// We choose the size classes such that this works for every size class.
+// So, instead of dividing by the size in the hot spot, we multiply by a
+// specially prepared constant, see ComputeMulForDiv().
+// Related reading: https://arxiv.org/pdf/1902.01961.pdf
+
+static constexpr uint32_t kDivMulShift = 35;
+
+inline uint32_t ComputeMulForDiv(uint32_t Div, uint32_t Shift) {
+  uint32_t Mul = (1ULL << Shift) / Div;
+  if (Div & (Div - 1)) Mul++;
+  return Mul;
+}
+
+inline bool IsCorrectDivToMul(uint32_t Div, uint32_t Mul, uint32_t Shift,
+                              uint32_t MaxLeft) {
+  for (uint64_t Left = 1; Left <= MaxLeft; Left++) {
+    uint32_t D1 = Left / Div;
+    uint32_t D2 = (Left * Mul) >> Shift;
+    if (D1 != D2) return false;
+  }
+  return true;
+}
+
+static inline uint32_t DivBySizeViaMul(uint32_t Left, uint32_t DivMul) {
+  uint64_t T = Left;
+  return (T * DivMul) >> kDivMulShift;
+}
+
+
+static constexpr size_t kStateArrayAlignment = 32;
+
+constexpr size_t SizeOfInlineMeta(size_t NumChunks, size_t RangeNum) {
+  if (RangeNum == 1) return 0;
+  return //kStateArrayAlignment +
+      RoundUpTo(NumChunks, kStateArrayAlignment);
+}
+
+constexpr size_t ComputeNumChunks(size_t ChunkSize, size_t RangeNum) {
+  size_t Approx = kSuperPageSize / ChunkSize;
+  for (size_t NumChunks = Approx; NumChunks > 0; NumChunks--)
+    if (SizeOfInlineMeta(NumChunks, RangeNum) + NumChunks * ChunkSize <=
+        kSuperPageSize)
+      return NumChunks;
+  __builtin_trap();
+}
+
+// Checks a size class table that replaces SCArray. The sizes up to 256 are
+// fixed (see SizeToSizeClass()) and so is the largest one. The powers of two
+// must be there too: posix_memalign() relies on them. Returns null if the
+// table is fine, otherwise what is wrong with it.
+inline const char *CheckSizeClasses(const size_t *Sizes) {
+  size_t NextPowerOfTwo = 512;
+  for (size_t I = 0; I < kNumSizeClasses; I++) {
+    if (I < 16 && Sizes[I] != SCArray[I])
+      return "the first 16 sizes must be 16, 32, ..., 256";
+    if (Sizes[I] % 16) return "the sizes must be multiples of 16";
+    if (I && Sizes[I] <= Sizes[I - 1]) return "the sizes must be increasing";
+    if (Sizes[I] > NextPowerOfTwo)
+      return "the powers of two must be size classes";
+    if (Sizes[I] == NextPowerOfTwo) NextPowerOfTwo *= 2;
+    if (!IsCorrectDivToMul(Sizes[I], ComputeMulForDiv(Sizes[I], kDivMulShift),
+                           kDivMulShift, kSuperPageSize))
+      return "a size does not satisfy IsCorrectDivToMul";
+  }
+  if (Sizes[kNumSizeClasses - 1] != kMaxSizeClass)
+    return "the last size must be 262144";
+  return nullptr;
+}
+
+// Parses a size class table, as written by mtm_size_class_gen:
+// kNumSizeClasses sizes separated by white space or commas, '#' starts a
+// comment. Returns null on success, otherwise what is wrong with it.
+inline const char *ParseSizeClasses(const char *Text, size_t Len,
+                                    size_t *Sizes) {
+  size_t N = 0;
+  for (size_t I = 0; I < Len;) {
+    char C = Text[I];
+    if (C == '#') {
+      while (I < Len && Text[I] != '\n') I++;
+    } else if (C >= '0' && C <= '9') {
+      size_t Size = 0;
+      for (; I < Len && Text[I] >= '0' && Text[I] <= '9'; I++)
+        if ((Size = Size * 10 + Text[I] - '0') > kMaxSizeClass)
+          return "a size is larger than 262144";
+      if (N == kNumSizeClasses) return "too many sizes";
+      Sizes[N++] = Size;
+    } else if (C == ' ' || C == '\t' || C == '\n' || C == '\r' || C == ',') {
+      I++;
+    } else {
+      return "unexpected character";
+    }
+  }
+  if (N != kNumSizeClasses) return "too few sizes";
+  return CheckSizeClasses(Sizes);
+}
+
 }  // namespace MTMalloc
 
 #endif  // __MTMALLOC_SIZE_CLASSES_H__
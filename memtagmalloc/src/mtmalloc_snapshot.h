@@ -0,0 +1,68 @@
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+// The binary heap snapshot format, written by mtm_heap_snapshot() and read
+// by mtm_snapshot_reader. Integers are in the native byte order.
+//
+//   SnapshotHeader
+//   SnapshotSizeClass[NumSizeClasses]
+//   NumSuperPages times:
+//     SnapshotSuperPage
+//     uint8_t State[NumChunks]            (SnapshotState)
+//     uint8_t Tag[NumChunks]              if kSnapshotHasTags: memory tags
+//     uint8_t Resident[ResidentBytes]     bit I: the I-th page is resident
+//
+// ResidentBytes is SuperPageSize / PageSize / 8.
+
+#ifndef __MTMALLOC_SNAPSHOT_H__
+#define __MTMALLOC_SNAPSHOT_H__
+
+#include <stdint.h>
+
+namespace MTMalloc {
+
+static const char kSnapshotMagic[8] = {'M', 'T', 'M', 'S', 'N', 'A', 'P', 0};
+static const uint32_t kSnapshotVersion = 1;
+static const uint32_t kSnapshotHasTags = 1;
+
+// Same values as SuperPage::state_t.
+enum SnapshotState : uint8_t {
+  kSnapshotAvailable = 0,
+  kSnapshotUsedMixed = 1,
+  kSnapshotUsedData = 3,
+  kSnapshotQuarantined = 5,
+  kSnapshotMarked = 7,
+  kSnapshotReleasing = 255,
+};
+
+struct SnapshotHeader {
+  char Magic[8];
+  uint32_t Version;
+  uint32_t Flags;
+  uint64_t SuperPageSize;
+  uint64_t PageSize;
+  uint32_t NumSizeClasses;
+  uint32_t NumSuperPages;
+  uint64_t Rss;
+  uint64_t LargeLiveBytes;
+  uint64_t LargeQuarantinedBytes;
+  uint64_t LargeCachedBytes;
+};
+
+struct SnapshotSizeClass {
+  uint32_t ChunkSize;
+  uint32_t NumChunks;  // Per SuperPage.
+};
+
+struct SnapshotSuperPage {
+  uint64_t Address;
+  uint8_t SizeClass;
+  uint8_t RangeNum;
+  uint16_t Reserved;
+  uint32_t NumChunks;
+};
+
+}  // namespace MTMalloc
+
+#endif  // __MTMALLOC_SNAPSHOT_H__
@@ -40,13 +40,15 @@ inline void EnableSyncMTE() { __builtin_trap(); }
 namespace MTMalloc {
 
 template <size_t kAllocatorSpace, size_t kAllocatorSize,
-          size_t kSizeAlignmentForSecondRange>
+          size_t kSizeAlignmentForSecondRange, size_t kLargeAllocSpace,
+          size_t kLargeAllocSize>
 class AddressAndMemoryTags {
  public:
   void Init() {
     if (Config.UseShadow) {
       LargeShadow.Init();
       SmallShadow.Init();
+      LargeAllocShadow.Init();
     } else if (Config.UseMTE) {
       EnableSyncMTE();
     }
@@ -69,6 +71,8 @@ class AddressAndMemoryTags {
       SmallShadow.SetRange(Ptr, Size, Tag);
     else if (LargeShadow.IsMine(Ptr))
       LargeShadow.SetRange(Ptr, Size, Tag);
+    else if (LargeAllocShadow.IsMine(Ptr))
+      LargeAllocShadow.SetRange(Ptr, Size, Tag);
     else
       __builtin_trap();
   }
@@ -82,6 +86,8 @@ class AddressAndMemoryTags {
       return SmallShadow.Get(Ptr);
     else if (LargeShadow.IsMine(Ptr))
       return LargeShadow.Get(Ptr);
+    else if (LargeAllocShadow.IsMine(Ptr))
+      return LargeAllocShadow.Get(Ptr);
     else
       __builtin_trap();
   }
@@ -119,15 +125,29 @@ class AddressAndMemoryTags {
       return 0x20;   // TODO: find a better definition for PROT_MTE.
     return 0;
   }
+
+  // Calls CB(Beg, Size) for every shadow mapping.
+  template <typename Callback>
+  void ForEachShadowMapping(Callback CB) {
+    if (!Config.UseShadow) return;
+    CB(SmallShadow.kShadowStart, SmallShadow.kShadowSize);
+    CB(LargeShadow.kShadowStart, LargeShadow.kShadowSize);
+    CB(LargeAllocShadow.kShadowStart, LargeAllocShadow.kShadowSize);
+  }
  private:
-  // HWASAN-like Shadow. One with 16-byte granularity, one with 1k granularity.
+  // HWASAN-like Shadow. One with 16-byte granularity, one with 1k granularity,
+  // and one with page granularity for the LargeAllocator range.
   static const size_t kSmallMemoryTagSpace = 0x300000000000ULL;
   static const size_t kLargeMemoryTagSpace = 0x400000000000ULL;
+  static const size_t kLargeAllocMemoryTagSpace = 0x500000000000ULL;
   FixedShadow<kSmallMemoryTagSpace, kAllocatorSpace, kAllocatorSize / 2, 16>
       SmallShadow;
   FixedShadow<kLargeMemoryTagSpace, kAllocatorSpace + kAllocatorSize / 2,
               kAllocatorSize / 2, kSizeAlignmentForSecondRange>
       LargeShadow;
+  FixedShadow<kLargeAllocMemoryTagSpace, kLargeAllocSpace, kLargeAllocSize,
+              4096>
+      LargeAllocShadow;
 };
 
 };  // namespace MTMalloc
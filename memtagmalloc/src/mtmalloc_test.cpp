@@ -5,6 +5,7 @@
 #include "gtest/gtest.h"
 #include "mtmalloc.h"
 #include "mtmalloc_large.h"
+#include "mtmalloc_size_class_gen.h"
 #include <set>
 #include <thread>
 
@@ -16,6 +17,7 @@ using MTMalloc::SizeClassDescr;
 namespace MTMalloc {
 MallocConfig Config;
 Allocator *Allocator::SingletonSelf;
+LargeAllocator *Allocator::Large;
 
 pthread_key_t Allocator::TSDKey;
 pthread_once_t Allocator::TSDOKeyOnce = PTHREAD_ONCE_INIT;
@@ -110,9 +112,15 @@ TEST(Allocate, Quarantine) {
     A.Quarantine(P);
   EXPECT_LE(TotalSize, TLS.LocalQuarantineSize);
   EXPECT_EQ(TotalRoundedSize, TLS.LocalQuarantineSize);
+  size_t UsedBytes, QuarantinedBytes;
+  A.CountBytes(&UsedBytes, &QuarantinedBytes);
+  EXPECT_EQ(UsedBytes, 0);
+  EXPECT_EQ(QuarantinedBytes, TotalRoundedSize);
 
   A.Scan();
   EXPECT_EQ(A.BytesInQuarantine, 0);
+  A.CountBytes(&UsedBytes, &QuarantinedBytes);
+  EXPECT_EQ(QuarantinedBytes, 0);
 
   std::set<void*> NewSet;
   std::set<size_t> Sizes;
@@ -151,6 +159,625 @@ TEST(Allocate, Quarantine) {
   EXPECT_EQ(A.BytesInQuarantine, 0);
 }
 
+TEST(Allocate, LargeQuarantine) {
+  Allocator A;
+  memset(&A, 0, sizeof(A));
+  memset(&TLS, 0, sizeof(TLS));
+  MTMalloc::LargeAllocator L;
+  Allocator::Large = &L;
+  const size_t kLargeSize = 1 << 20;
+  // A small chunk referenced only from a live large chunk.
+  uintptr_t *Big = reinterpret_cast<uintptr_t *>(L.Allocate(kLargeSize));
+  void *Small = A.Allocate(1000);
+  Big[kLargeSize / sizeof(uintptr_t) - 1] = reinterpret_cast<uintptr_t>(Small);
+  A.Quarantine(Small);
+  // A large chunk referenced (by an interior pointer) only from a live small
+  // chunk.
+  uintptr_t *P1 = reinterpret_cast<uintptr_t *>(A.Allocate(100));
+  uint8_t *BigQ = reinterpret_cast<uint8_t *>(L.Allocate(kLargeSize));
+  *P1 = reinterpret_cast<uintptr_t>(BigQ + 300000);
+  EXPECT_EQ(L.Quarantine(BigQ), kLargeSize);
+  EXPECT_DEATH(L.Quarantine(BigQ), "");  // double-free.
+  A.Scan();
+  EXPECT_EQ(A.BytesInQuarantine, 1024 + kLargeSize);
+  // Remove the references.
+  Big[kLargeSize / sizeof(uintptr_t) - 1] = 0;
+  *P1 = 0xDEADBEEF;
+  A.Scan();
+  EXPECT_EQ(A.BytesInQuarantine, 0);
+  L.Deallocate(Big, false);
+  Allocator::Large = nullptr;
+}
+
+TEST(Allocate, ReleaseFreePages) {
+  Allocator A;
+  memset(&A, 0, sizeof(A));
+  memset(&TLS, 0, sizeof(TLS));
+  const size_t kSize = 8192, kNumChunks = 32;
+  auto IsResident = [](void *P) {
+    unsigned char Vec = 0;
+    EXPECT_EQ(mincore(P, 4096, &Vec), 0);
+    return Vec & 1;
+  };
+  std::vector<char *> V;
+  for (size_t I = 0; I < kNumChunks; I++) {
+    V.push_back(reinterpret_cast<char *>(A.Allocate(kSize)));
+    memset(V.back(), 1, kSize);
+  }
+  uintptr_t SPAddr = MTMalloc::RoundDownTo(reinterpret_cast<uintptr_t>(V[0]),
+                                           MTMalloc::kSuperPageSize);
+  auto SP = MTMalloc::A2SP(SPAddr);
+  EXPECT_EQ(SP->GetSCD().ChunkSize(), kSize);
+  EXPECT_EQ(SP->NumUsed(), kNumChunks);
+  EXPECT_EQ(A.ReleaseQueueHead, 0);
+  // Deallocation puts the SuperPage into the release queue (just once).
+  for (size_t I = 0; I < kNumChunks; I += 2)
+    A.Deallocate(V[I]);
+  EXPECT_NE(A.ReleaseQueueHead, 0);
+  EXPECT_EQ(SP->Info()->Next, 0);
+  EXPECT_EQ(SP->NumUsed(), kNumChunks / 2);
+  // The config is read once per process: override the decay directly.
+  auto OldDecay = MTMalloc::Config.ReleaseDecay;
+  MTMalloc::Config.ReleaseDecay = 1000;
+  uint16_t Now = MTMalloc::SuperPage::PageAgeNow();
+  bool Pending = false;
+  EXPECT_EQ(SP->MaybeReleaseToOs(Now, &Pending), 0);  // Not old enough.
+  EXPECT_TRUE(Pending);
+  Pending = false;
+  EXPECT_EQ(SP->MaybeReleaseToOs(Now + 1000 / 16 + 1, &Pending),
+            kNumChunks / 2 * kSize);
+  EXPECT_FALSE(Pending);
+  for (size_t I = 0; I < kNumChunks; I++) {
+    EXPECT_EQ(IsResident(V[I]), I % 2);
+    EXPECT_EQ(IsResident(V[I] + kSize - 4096), I % 2);
+    if (I % 2) {
+      EXPECT_EQ(V[I][kSize - 1], 1);
+    }
+  }
+  // Chunks in use are never released.
+  EXPECT_EQ(SP->CountAvailable(), SP->GetSCD().NumChunks - kNumChunks / 2);
+
+  // Nothing else to release, and the queue is empty afterwards.
+  EXPECT_EQ(A.ReleaseQueuedSuperPages(), 0);
+  EXPECT_EQ(A.ReleaseQueueHead, 0);
+  MTMalloc::Config.ReleaseDecay = 0;
+  A.Deallocate(V[1]);
+  EXPECT_EQ(A.ReleaseQueuedSuperPages(), kSize);
+  EXPECT_FALSE(IsResident(V[1]));
+  EXPECT_EQ(A.ReleasedBytes, kSize);
+  // With a decay, the SuperPage stays in the queue until it is released.
+  MTMalloc::Config.ReleaseDecay = 1000;
+  A.Deallocate(V[3]);
+  EXPECT_EQ(A.ReleaseQueuedSuperPages(), 0);
+  EXPECT_NE(A.ReleaseQueueHead, 0);
+  // Unless the release thread is turned off, which would make it spin.
+  auto OldFreq = MTMalloc::Config.ReleaseFreq;
+  MTMalloc::Config.ReleaseFreq = 0;
+  EXPECT_EQ(A.ReleaseQueuedSuperPages(), 0);
+  EXPECT_EQ(A.ReleaseQueueHead, 0);
+  MTMalloc::Config.ReleaseFreq = OldFreq;
+  A.QueueForRelease(SP);
+
+  // SuperPages with small chunks are queued and released once all of
+  // their chunks are free.
+  MTMalloc::Config.ReleaseDecay = 0;
+  EXPECT_EQ(A.ReleaseQueuedSuperPages(), kSize);  // V[3].
+  std::vector<void *> Small;
+  for (size_t I = 0; I < 100; I++) {
+    Small.push_back(A.Allocate(64));
+    memset(Small.back(), 1, 64);
+  }
+  auto SmallSP = MTMalloc::A2SP(MTMalloc::RoundDownTo(
+      reinterpret_cast<uintptr_t>(Small[0]), MTMalloc::kSuperPageSize));
+  for (size_t I = 1; I < Small.size(); I++)
+    A.Deallocate(Small[I]);
+  EXPECT_EQ(A.ReleaseQueueHead, 0);
+  A.Deallocate(Small[0]);
+  EXPECT_NE(A.ReleaseQueueHead, 0);
+  EXPECT_EQ(A.ReleaseQueuedSuperPages(), MTMalloc::kSuperPageSize);
+  EXPECT_FALSE(IsResident(Small[0]));
+  EXPECT_TRUE(SmallSP->AllAvailable());
+  MTMalloc::Config.ReleaseDecay = OldDecay;
+}
+
+TEST(Allocate, ReleaseSharedPages) {
+  Allocator A;
+  memset(&A, 0, sizeof(A));
+  memset(&TLS, 0, sizeof(TLS));
+  // Not a multiple of the page size: neighbor chunks share a page.
+  const size_t kSize = 4736, kNumChunks = 64;
+  std::vector<char *> V;
+  for (size_t I = 0; I < kNumChunks; I++) {
+    V.push_back(reinterpret_cast<char *>(A.Allocate(kSize)));
+    memset(V.back(), 1, kSize);
+  }
+  auto SP = MTMalloc::A2SP(MTMalloc::RoundDownTo(
+      reinterpret_cast<uintptr_t>(V[0]), MTMalloc::kSuperPageSize));
+  EXPECT_EQ(SP->GetSCD().ChunkSize(), kSize);
+  auto OldDecay = MTMalloc::Config.ReleaseDecay;
+  MTMalloc::Config.ReleaseDecay = 1000;
+  for (size_t I = 0; I < kNumChunks; I += 2) A.Deallocate(V[I]);
+  uint16_t Now = MTMalloc::SuperPage::PageAgeNow();
+  bool Pending = false;
+  EXPECT_EQ(SP->MaybeReleaseToOs(Now, &Pending), 0);
+  EXPECT_TRUE(Pending);
+  // The pages shared with the used chunks stay resident, but the free
+  // chunks are released (and counted) only once: no more pending work, and
+  // nothing released in the following decay periods.
+  const uint16_t kPeriod = 1000 / 16 + 1;
+  Pending = false;
+  EXPECT_GT(SP->MaybeReleaseToOs(Now + kPeriod, &Pending), 0);
+  EXPECT_FALSE(Pending);
+  for (uint16_t Period = 2; Period <= 3; Period++) {
+    EXPECT_EQ(SP->MaybeReleaseToOs(Now + Period * kPeriod, &Pending), 0);
+    EXPECT_FALSE(Pending);
+  }
+  for (size_t I = 1; I < kNumChunks; I += 2)
+    EXPECT_EQ(V[I][0] + V[I][kSize - 1], 2);
+  // Once their neighbors are freed, the shared pages are released too.
+  for (size_t I = 1; I < kNumChunks; I += 2) A.Deallocate(V[I]);
+  EXPECT_EQ(SP->MaybeReleaseToOs(Now + 4 * kPeriod, &Pending), 0);
+  EXPECT_TRUE(Pending);
+  Pending = false;
+  EXPECT_GT(SP->MaybeReleaseToOs(Now + 5 * kPeriod, &Pending), 0);
+  EXPECT_FALSE(Pending);
+  unsigned char Vec[MTMalloc::SuperPage::kPagesPerSuperPage];
+  SP->GetResidentPages(Vec);
+  for (size_t I = 0; I < kNumChunks * kSize / 4096; I++)
+    EXPECT_FALSE(Vec[I] & 1) << I;
+  EXPECT_EQ(SP->MaybeReleaseToOs(Now + 6 * kPeriod, &Pending), 0);
+  EXPECT_FALSE(Pending);
+  // A chunk that is used and freed again is released again.
+  char *P = reinterpret_cast<char *>(A.Allocate(kSize));
+  memset(P, 1, kSize);
+  A.Deallocate(P);
+  EXPECT_EQ(SP->MaybeReleaseToOs(Now + 7 * kPeriod, &Pending), 0);
+  EXPECT_TRUE(Pending);
+  Pending = false;
+  EXPECT_GT(SP->MaybeReleaseToOs(Now + 8 * kPeriod, &Pending), 0);
+  EXPECT_FALSE(Pending);
+  MTMalloc::Config.ReleaseDecay = OldDecay;
+}
+
+TEST(Allocate, ReleaseMemory) {
+  Allocator A;
+  memset(&A, 0, sizeof(A));
+  memset(&TLS, 0, sizeof(TLS));
+  std::vector<void *> V;
+  for (size_t I = 0; I < 1000; I++) {
+    V.push_back(A.Allocate(1000));
+    memset(V.back(), 1, 1000);
+  }
+  for (void *P : V)
+    A.Quarantine(P);
+  // The free memory is not enough, so the quarantine is scanned first.
+  EXPECT_GE(A.ReleaseMemory(1 << 20), 1 << 20);
+  EXPECT_EQ(A.NumScans, 1);
+  EXPECT_EQ(A.BytesInQuarantine, 0);
+  EXPECT_EQ(A.Trim(), 0);  // Nothing left.
+  // Enough free memory, no need to scan.
+  for (size_t I = 0; I < 100; I++)
+    memset(A.Allocate(1000), 1, 1000);
+  // The only SuperPage is in use, and the quarantine is empty.
+  EXPECT_EQ(A.ReleaseMemory(1 << 10), 0);
+  EXPECT_EQ(A.NumScans, 1);
+  auto &Pause = A.ScanPhaseUs[MTMalloc::kScanPause];
+  EXPECT_EQ(Pause.Count, 1);
+  EXPECT_EQ(Pause.Max, A.LastScanTimeUs);
+  EXPECT_GE(Pause.Max, A.ScanPhaseUs[MTMalloc::kScanMark].Max);
+}
+
+TEST(Allocate, HeapSnapshot) {
+  Allocator A;
+  memset(&A, 0, sizeof(A));
+  memset(&TLS, 0, sizeof(TLS));
+  std::vector<void *> V;
+  for (size_t I = 0; I < 100; I++) {
+    V.push_back(A.Allocate(1000));
+    memset(V.back(), 1, 1000);
+  }
+  for (size_t I = 0; I < 40; I++) A.Quarantine(V[I]);
+  char Path[] = "/tmp/mtm_snapshot_XXXXXX";
+  int Fd = mkstemp(Path);
+  ASSERT_GE(Fd, 0);
+  unlink(Path);
+  ASSERT_TRUE(A.WriteSnapshot(Fd, MTMalloc::kSnapshotHasTags));
+  std::vector<uint8_t> Buf(lseek(Fd, 0, SEEK_END));
+  ASSERT_EQ(pread(Fd, Buf.data(), Buf.size(), 0), Buf.size());
+  close(Fd);
+
+  const uint8_t *P = Buf.data();
+  auto *H = reinterpret_cast<const MTMalloc::SnapshotHeader *>(P);
+  EXPECT_EQ(memcmp(H->Magic, MTMalloc::kSnapshotMagic, 8), 0);
+  EXPECT_EQ(H->Version, MTMalloc::kSnapshotVersion);
+  EXPECT_EQ(H->NumSizeClasses, MTMalloc::kNumSizeClasses);
+  ASSERT_EQ(H->NumSuperPages, 1);
+  P += sizeof(*H) + MTMalloc::kNumSizeClasses * sizeof(MTMalloc::SnapshotSizeClass);
+  auto *S = reinterpret_cast<const MTMalloc::SnapshotSuperPage *>(P);
+  EXPECT_EQ(S->Address, reinterpret_cast<uintptr_t>(V[0]) &
+                            ~(MTMalloc::kSuperPageSize - 1));
+  P += sizeof(*S);
+  size_t Used = 0, Quarantined = 0;
+  for (size_t I = 0; I < S->NumChunks; I++) {
+    Used += P[I] == MTMalloc::kSnapshotUsedMixed ||
+            P[I] == MTMalloc::kSnapshotUsedData;
+    Quarantined += P[I] == MTMalloc::kSnapshotQuarantined;
+  }
+  EXPECT_EQ(Used, 60);
+  EXPECT_EQ(Quarantined, 40);
+  size_t ResidentBytes = MTMalloc::SuperPage::kPagesPerSuperPage / 8;
+  EXPECT_EQ(P + 2 * S->NumChunks + ResidentBytes, Buf.data() + Buf.size());
+  // The first page holds live chunks, so it is resident.
+  EXPECT_EQ(P[2 * S->NumChunks] & 1, 1);
+}
+
+TEST(Allocate, FindUsed) {
+  using MTMalloc::SuperPage;
+  uint8_t States[24] = {};
+  std::vector<size_t> Expected;
+  for (size_t I = 0; I < 21; I++) {
+    static const uint8_t kAll[] = {SuperPage::AVAILABLE, SuperPage::USED_MIXED,
+                                   SuperPage::USED_DATA,
+                                   SuperPage::QUARANTINED, SuperPage::MARKED,
+                                   SuperPage::RELEASING};
+    States[I] = kAll[(I * 7) % 6];
+    if (States[I] == SuperPage::USED_MIXED || States[I] == SuperPage::USED_DATA)
+      Expected.push_back(I);
+  }
+  States[21] = SuperPage::USED_MIXED;  // Past N.
+  std::vector<size_t> Found;
+  MTMalloc::FindUsed(States, 21, [&](size_t Idx) { Found.push_back(Idx); });
+  EXPECT_EQ(Found, Expected);
+}
+
+TEST(Allocate, Iterate) {
+  Allocator A;
+  memset(&A, 0, sizeof(A));
+  memset(&TLS, 0, sizeof(TLS));
+  std::set<uintptr_t> Live;
+  for (size_t Size : {16, 100, 1000, 5000}) {
+    for (size_t I = 0; I < 100; I++) {
+      void *P = A.Allocate(Size);
+      memset(P, 1, Size);
+      if (I % 3)
+        Live.insert(reinterpret_cast<uintptr_t>(P));
+      else
+        A.Quarantine(P);
+    }
+  }
+  std::set<uintptr_t> Seen;
+  auto CB = [](uintptr_t Beg, size_t Size, void *Arg) {
+    reinterpret_cast<std::set<uintptr_t> *>(Arg)->insert(Beg);
+  };
+  EXPECT_EQ(A.Iterate(0, ~0UL, CB, &Seen, false), 0);
+  EXPECT_EQ(Seen, Live);
+  // Only the chunks in the range.
+  uintptr_t Mid = *std::next(Live.begin(), Live.size() / 2);
+  Seen.clear();
+  EXPECT_EQ(A.Iterate(Mid, ~0UL, CB, &Seen, false), 0);
+  EXPECT_EQ(Seen, std::set<uintptr_t>(Live.find(Mid), Live.end()));
+}
+
+// Stores the pointers only in a form that the leak check doesn't see.
+__attribute__((noinline)) static void AllocateLeaks(Allocator &A,
+                                                    uintptr_t *Hidden) {
+  for (size_t I = 0; I < 100; I++)
+    Hidden[I] = ~reinterpret_cast<uintptr_t>(A.Allocate(48));
+}
+
+// Overwrites the dead stack frames, which the leak check skips anyway.
+__attribute__((noinline)) static void ClearStack() {
+  volatile char Buf[1 << 14];
+  for (size_t I = 0; I < sizeof(Buf); I++) Buf[I] = 0;
+}
+
+TEST(Allocate, LeakCheck) {
+  Allocator A;
+  memset(&A, 0, sizeof(A));
+  memset(&TLS, 0, sizeof(TLS));
+  // Reachable from the (glibc) heap: a chunk and another one it points to.
+  std::vector<void *> Roots;
+  Roots.push_back(A.Allocate(1000));
+  memset(Roots[0], 0, 1000);
+  void *Child = A.Allocate(2000);
+  memcpy(Roots[0], &Child, sizeof(Child));
+  std::vector<uintptr_t> Hidden(100);
+  AllocateLeaks(A, Hidden.data());
+  ClearStack();
+  MTMalloc::LeakReport R;
+  ASSERT_EQ(A.LeakCheck(&R), 0);
+  SizeClassDescr SCD;
+  size_t SC48 = SizeToSizeClass(48, SCD).v;
+  // The scan is conservative: the freed memory of the earlier tests may
+  // still point to some of the chunks.
+  EXPECT_GE(R.NumLeaks[SC48], 50);
+  EXPECT_LE(R.NumLeaks[SC48], 100);
+  EXPECT_EQ(R.TotalLeaks(), R.NumLeaks[SC48]);
+  EXPECT_EQ(R.LeakedBytes[SC48], R.NumLeaks[SC48] * SCD.ChunkSize());
+  EXPECT_EQ(R.NumExamples, MTMalloc::LeakReport::kMaxExamples);
+  // Once the pointers are visible again, nothing is leaked.
+  for (uintptr_t H : Hidden) Roots.push_back(reinterpret_cast<void *>(~H));
+  ASSERT_EQ(A.LeakCheck(&R), 0);
+  EXPECT_EQ(R.TotalLeaks(), 0);
+}
+
+TEST(CycleCounter, NsPerTick) {
+  MTMalloc::StartCycleCounterCalibration();
+  uint64_t Ticks = MTMalloc::ReadCycleCounter(), Ns = MTMalloc::nsec();
+  usleep(20000);
+  Ticks = MTMalloc::ReadCycleCounter() - Ticks;
+  Ns = MTMalloc::nsec() - Ns;
+  // Calibrated over about the same interval, so within a few percent.
+  double Estimate = Ticks * MTMalloc::CycleCounterNsPerTick();
+  EXPECT_GT(Estimate, Ns * 0.95);
+  EXPECT_LT(Estimate, Ns * 1.05);
+}
+
+// A mapping of a file with a path longer than the line buffer does not end
+// the parse.
+TEST(IterateMappings, LongPath) {
+  std::string Name(200, 'd');
+  char Tmp[] = "/tmp/mtm_maps_XXXXXX";
+  ASSERT_TRUE(mkdtemp(Tmp));
+  int Dirs[24];
+  Dirs[0] = open(Tmp, O_RDONLY | O_DIRECTORY);
+  for (size_t I = 1; I < 24; I++) {
+    ASSERT_EQ(mkdirat(Dirs[I - 1], Name.c_str(), 0700), 0);
+    Dirs[I] = openat(Dirs[I - 1], Name.c_str(), O_RDONLY | O_DIRECTORY);
+    ASSERT_GE(Dirs[I], 0);
+  }
+  int Fd = openat(Dirs[23], "f", O_RDWR | O_CREAT, 0600);
+  ASSERT_GE(Fd, 0);
+  ASSERT_EQ(ftruncate(Fd, 4096), 0);
+  void *Map = mmap(nullptr, 4096, PROT_READ, MAP_SHARED, Fd, 0);
+  ASSERT_NE(Map, MAP_FAILED);
+  auto File = reinterpret_cast<uintptr_t>(Map);
+  auto Stack = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+  bool FoundFile = false, FoundStack = false;
+  int Res = MTMalloc::IterateMappings(
+      [&](uintptr_t Beg, uintptr_t End, const char *) {
+        FoundFile |= File >= Beg && File < End;
+        FoundStack |= Stack >= Beg && Stack < End;
+      });
+  EXPECT_EQ(Res, 0);
+  EXPECT_TRUE(FoundFile);
+  EXPECT_TRUE(FoundStack);
+  munmap(Map, 4096);
+  close(Fd);
+  unlinkat(Dirs[23], "f", 0);
+  for (size_t I = 23; I > 0; I--) {
+    close(Dirs[I]);
+    unlinkat(Dirs[I - 1], Name.c_str(), AT_REMOVEDIR);
+  }
+  close(Dirs[0]);
+  rmdir(Tmp);
+}
+
+TEST(Histogram, Percentiles) {
+  MTMalloc::Histogram H;
+  memset(&H, 0, sizeof(H));
+  EXPECT_EQ(H.Percentile(50), 0);
+  std::vector<std::pair<uint64_t, uint64_t>> Begins = {
+      {0, 0},     {3, 3},         {4, 4},           {7, 7},
+      {9, 8},     {1000, 896},    {1 << 20, 1 << 20}, {~0ULL, 7ULL << 61}};
+  for (auto [V, Begin] : Begins)
+    EXPECT_EQ(H.BucketBegin(H.BucketIdx(V)), Begin);
+  EXPECT_LT(H.BucketIdx(~0ULL), H.kNumBuckets);
+  for (uint64_t V = 1; V <= 1000; V++)
+    H.Add(V);
+  EXPECT_EQ(H.Count, 1000);
+  EXPECT_EQ(H.Mean(), 500);
+  EXPECT_EQ(H.Max, 1000);
+  // Within 25% above the exact value.
+  for (double P : {10., 50., 90., 99.}) {
+    EXPECT_GE(H.Percentile(P), P * 10);
+    EXPECT_LE(H.Percentile(P), P * 10 * 1.25);
+  }
+  EXPECT_EQ(H.Percentile(100), 1000);
+  MTMalloc::Histogram H2 = H;
+  H2.Add(5000);
+  H.MergeFrom(H2);
+  EXPECT_EQ(H.Count, 2001);
+  EXPECT_EQ(H.Max, 5000);
+  EXPECT_EQ(H.Percentile(50), H2.Percentile(50));
+}
+
+TEST(SizeClasses, Parse) {
+  using namespace MTMalloc;
+  std::string Text = "# A comment.\n";
+  for (size_t Size : SCArray) Text += std::to_string(Size) + ",\n";
+  size_t Sizes[kNumSizeClasses];
+  EXPECT_EQ(ParseSizeClasses(Text.data(), Text.size(), Sizes), nullptr);
+  EXPECT_EQ(memcmp(Sizes, SCArray, sizeof(Sizes)), 0);
+  EXPECT_NE(ParseSizeClasses(Text.data(), Text.size() - 8, Sizes), nullptr);
+  EXPECT_NE(ParseSizeClasses("16 x", 4, Sizes), nullptr);
+  std::string Bad = Text;
+  Bad.replace(Bad.find("\n48,"), 4, "\n40,");
+  EXPECT_NE(ParseSizeClasses(Bad.data(), Bad.size(), Sizes), nullptr);
+  // Without 65536, a power of two.
+  Bad = Text;
+  Bad.replace(Bad.find("65536"), 5, "65520");
+  EXPECT_NE(ParseSizeClasses(Bad.data(), Bad.size(), Sizes), nullptr);
+}
+
+TEST(SizeClasses, Choose) {
+  using namespace MTMalloc;
+  const std::vector<size_t> Powers = {512,   1024,  2048,   4096,   8192,
+                                      16384, 32768, 65536, 131072, 262144};
+  // The powers of two are always kept.
+  SizeHistogram H = {{288, 1000}, {336, 10}};
+  EXPECT_EQ(ChooseSizeClasses(H, Powers.size()), Powers);
+  // One more class: 288, since 1000 * (336 - 288) bytes of slack are more
+  // than 10 * (512 - 336).
+  std::vector<size_t> Expected = Powers;
+  Expected.insert(Expected.begin(), 288);
+  EXPECT_EQ(ChooseSizeClasses(H, Powers.size() + 1), Expected);
+  H = {{288, 10}, {336, 1000}};
+  Expected[0] = 336;
+  EXPECT_EQ(ChooseSizeClasses(H, Powers.size() + 1), Expected);
+  // Enough classes for both: no slack.
+  Expected.insert(Expected.begin(), 288);
+  EXPECT_EQ(ChooseSizeClasses(H, Powers.size() + 2), Expected);
+  size_t Sizes[kNumSizeClasses];
+  MakeTable(Expected, Sizes);
+  EXPECT_EQ(CheckSizeClasses(Sizes), nullptr);
+  EXPECT_EQ(ComputeWaste(H, Sizes).Slack, 0);
+}
+
+TEST(Allocate, SoftLimit) {
+  Allocator A;
+  memset(&A, 0, sizeof(A));
+  memset(&TLS, 0, sizeof(TLS));
+  const size_t kSize = 4000;
+  std::vector<void *> V;
+  for (size_t I = 0; I < (32 << 20) / kSize; I++) {
+    V.push_back(A.Allocate(kSize));
+    memset(V.back(), 1, kSize);
+  }
+  for (void *P : V)
+    A.Quarantine(P);
+  auto OldSoftLimit = MTMalloc::Config.SoftLimit;
+  size_t Limit = GetRss() + (8 << 20);
+  MTMalloc::Config.SoftLimit = Limit >> 20;
+  // Crossing the limit scans and releases the quarantine, which is then
+  // reused instead of growing the heap.
+  for (size_t I = 0; I < (16 << 20) / kSize; I++)
+    memset(A.Allocate(kSize), 2, kSize);
+  EXPECT_GE(A.SoftLimitHits, 1);
+  EXPECT_EQ(A.NumScans, 1);
+  EXPECT_LT(GetRss(), Limit + (8 << 20));
+  // Limits of 2G and more don't overflow. The RSS is looked at after the
+  // heap grows by 1/64 of the limit; the chunks are not touched.
+  size_t Hits = A.SoftLimitHits;
+  MTMalloc::Config.SoftLimit = 4096;
+  for (size_t I = 0; I < (80 << 20) / (256 << 10); I++)
+    A.Allocate(256 << 10);
+  EXPECT_GE(A.SoftLimitCheckedAt, 64 << 20);
+  EXPECT_EQ(A.SoftLimitHits, Hits);
+  EXPECT_EQ(A.NumScans, 1);
+  MTMalloc::Config.SoftLimit = OldSoftLimit;
+}
+
+static void WriteFile(const std::string &Path, const char *Contents) {
+  FILE *F = fopen(Path.c_str(), "w");
+  ASSERT_NE(F, nullptr);
+  fputs(Contents, F);
+  fclose(F);
+}
+
+TEST(Allocate, MemoryPressure) {
+  char Dir[] = "/tmp/mtm_pressure.XXXXXX";
+  ASSERT_NE(mkdtemp(Dir), nullptr);
+  std::string Pressure = std::string(Dir) + "/memory.pressure";
+  std::string Max = std::string(Dir) + "/memory.max";
+  std::string Current = std::string(Dir) + "/memory.current";
+  WriteFile(Pressure, "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n"
+                      "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+  WriteFile(Max, "max\n");
+  WriteFile(Current, "1000\n");
+  MTMalloc::PressureMonitor M;
+  ASSERT_TRUE(M.Init(Pressure.c_str(), 200));  // 10% of the time.
+  EXPECT_FALSE(M.Trigger);  // Not a kernel file, so it is polled.
+  EXPECT_FALSE(M.Wait(1));
+  WriteFile(Pressure, "some avg10=10.00 avg60=1.00 avg300=0.10 total=7\n");
+  EXPECT_TRUE(M.Wait(1));
+  WriteFile(Pressure, "some avg10=9.99 avg60=1.00 avg300=0.10 total=7\n");
+  EXPECT_FALSE(M.Wait(1));
+  // Crossing 90% of memory.max is reported once.
+  WriteFile(Max, "1000000\n");
+  EXPECT_FALSE(M.Wait(1));
+  WriteFile(Current, "950000\n");
+  EXPECT_TRUE(M.Wait(1));
+  EXPECT_FALSE(M.Wait(1));
+  WriteFile(Current, "800000\n");
+  EXPECT_FALSE(M.Wait(1));
+  WriteFile(Current, "900001\n");
+  EXPECT_TRUE(M.Wait(1));
+  for (auto &Path : {Pressure, Max, Current})
+    unlink(Path.c_str());
+  rmdir(Dir);
+
+  Allocator A;
+  memset(&A, 0, sizeof(A));
+  memset(&TLS, 0, sizeof(TLS));
+  std::vector<void *> V;
+  for (size_t I = 0; I < 1000; I++) {
+    V.push_back(A.Allocate(1000));
+    memset(V.back(), 1, 1000);
+  }
+  for (void *P : V)
+    A.Quarantine(P);
+  EXPECT_FALSE(A.UnderPressure());
+  EXPECT_GE(A.OnMemoryPressure(), 1 << 20);
+  EXPECT_EQ(A.NumScans, 1);
+  EXPECT_EQ(A.BytesInQuarantine, 0);
+  EXPECT_TRUE(A.UnderPressure());
+}
+
+TEST(Allocate, LiveBytes) {
+  Allocator A;
+  memset(&A, 0, sizeof(A));
+  memset(&TLS, 0, sizeof(TLS));
+  SizeClassDescr SCD;
+  auto SC = SizeToSizeClass(1000, SCD).v;
+  std::vector<void *> V;
+  for (size_t I = 0; I < 4000; I++)
+    V.push_back(A.Allocate(1000));
+  size_t ChunkSize = SCD.ChunkSize();
+  MTMalloc::Statistics S;
+  A.CollectStats(&S);
+  EXPECT_EQ(S.AllocsPerSizeClass[SC], 4000);
+  EXPECT_EQ(S.LiveBytes(), 4000 * ChunkSize);
+  for (size_t I = 0; I < 1000; I++) A.Deallocate(V[I]);
+  for (size_t I = 1000; I < 3000; I++) A.Quarantine(V[I]);
+  A.CollectStats(&S);
+  EXPECT_EQ(S.FreesPerSizeClass[SC], 3000);
+  EXPECT_EQ(S.LiveBytes(SC), 1000 * ChunkSize);
+  // The peak is tracked with the granularity of kLiveBytesFlush.
+  EXPECT_GE(A.PeakLiveBytes + Allocator::kLiveBytesFlush, 4000 * ChunkSize);
+  EXPECT_LE(A.PeakLiveBytes, 4000 * ChunkSize);
+  // The stats of a thread are kept after it exits.
+  std::thread T([&]() {
+    for (size_t I = 0; I < 100; I++)
+      A.Allocate(1000);
+  });
+  T.join();
+  EXPECT_EQ(A.Threads, &TLS);  // The other thread is gone.
+  A.CollectStats(&S);
+  EXPECT_EQ(S.AllocsPerSizeClass[SC], 4100);
+  EXPECT_EQ(S.LiveBytes(SC), 1100 * ChunkSize);
+  // So are the stats of a thread that only frees.
+  std::thread F([&]() {
+    for (size_t I = 3000; I < 4000; I++) A.Deallocate(V[I]);
+  });
+  F.join();
+  EXPECT_EQ(A.Threads, &TLS);
+  A.CollectStats(&S);
+  EXPECT_EQ(S.FreesPerSizeClass[SC], 4000);
+  EXPECT_EQ(S.LiveBytes(SC), 100 * ChunkSize);
+}
+
+TEST(Allocate, LatencyAfterExit) {
+  Allocator A;
+  memset(&A, 0, sizeof(A));
+  memset(&TLS, 0, sizeof(TLS));
+  std::thread T([&]() {
+    A.Deallocate(A.Allocate(1000));
+    A.RecordLatency(100);
+    EXPECT_NE(TLS.Latency, nullptr);
+    A.UnregisterThread();
+    // E.g. a malloc() in a later TSD destructor.
+    A.RecordLatency(100);
+    EXPECT_EQ(TLS.Latency, nullptr);
+  });
+  T.join();
+  EXPECT_EQ(A.Threads, nullptr);
+  MTMalloc::LatencyHistograms L;
+  A.CollectLatency(&L);
+  size_t Count = 0;
+  for (auto &H : L.Paths) Count += H.Count;
+  EXPECT_EQ(Count, 1);
+}
 
 void Worker(Allocator &A) {
   uintptr_t PrevPtr = 0;
@@ -241,6 +868,7 @@ TEST(LargeAllocator, SimpleTest) {
   fprintf(stderr, "P1 %p\n", P1);
   fprintf(stderr, "P2 %p\n", P2);
   EXPECT_DEATH(A.Deallocate(reinterpret_cast<char*>(P1) + 4096, false), "");
+  EXPECT_DEATH(A.GetPtrChunkSize(reinterpret_cast<char*>(P1) + 4096), "");
   A.Deallocate(P2, false);
   EXPECT_DEATH(A.Deallocate(P2, false), "");
   A.Deallocate(P1, false);
@@ -255,6 +883,185 @@ TEST(LargeAllocator, SimpleTest) {
   EXPECT_DEATH(memset(P4, 1, 1), "");  // must be protected.
 }
 
+TEST(LargeAllocator, Cache) {
+  MTMalloc::LargeAllocator A;
+  size_t Size = 3 << 20;
+  void *P1 = A.Allocate(Size);
+  memset(P1, 1, Size);
+  A.Deallocate(P1, false);
+  EXPECT_EQ(A.GetCachedBytes(), Size);
+  EXPECT_DEATH(A.Deallocate(P1, false), "");  // double-free of a cached one.
+  void *P2 = A.Allocate(Size);
+  EXPECT_EQ(P1, P2);
+  EXPECT_EQ(A.GetNumCacheHits(), 1);
+  EXPECT_EQ(A.GetCachedBytes(), 0);
+  memset(P2, 2, Size);
+  A.Deallocate(P2, false);
+  // A smaller size from the same bucket reuses the cached mapping.
+  void *P3 = A.Allocate(Size - 8192);
+  EXPECT_EQ(P2, P3);
+  EXPECT_EQ(A.GetPtrChunkSize(P3), Size);
+  A.Deallocate(P3, false);
+  // Cached mappings are reused only if they satisfy the alignment.
+  void *P4 = A.Allocate(Size, 1 << 22);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(P4) % (1 << 22), 0);
+  A.Deallocate(P4, false);
+  size_t CachedBytes = A.GetCachedBytes();
+  EXPECT_GE(CachedBytes, Size);
+  EXPECT_EQ(A.PurgeCache(true), CachedBytes);
+  EXPECT_EQ(A.GetCachedBytes(), 0);
+
+  // With zero decay time, the cache never holds anything for long.
+  auto OldDecay = MTMalloc::Config.LargeCacheDecay;
+  MTMalloc::Config.LargeCacheDecay = 0;
+  A.Deallocate(A.Allocate(Size), false);
+  EXPECT_EQ(A.GetCachedBytes(), 0);
+  MTMalloc::Config.LargeCacheDecay = OldDecay;
+}
+
+TEST(LargeAllocator, HugePages) {
+  MTMalloc::LargeAllocator A;
+  const size_t kHugePage = 1 << 21;
+  size_t Size = (32 << 20) + 100;
+  auto IsHugeAligned = [&](void *P) {
+    return reinterpret_cast<uintptr_t>(P) % kHugePage == 0;
+  };
+  // Shift the bump position by a few pages.
+  void *Small = A.Allocate(3 << 12);
+  void *P1 = A.Allocate(Size);
+  EXPECT_TRUE(IsHugeAligned(P1));
+  EXPECT_EQ(A.GetPtrChunkSize(P1), MTMalloc::RoundUpTo(Size, kHugePage));
+  memset(P1, 1, Size);
+  A.Deallocate(P1, false);
+  // Falls back to regular pages if there are no hugetlbfs pages.
+  auto OldHugeTLB = MTMalloc::Config.LargeHugeTLB;
+  MTMalloc::Config.LargeHugeTLB = 1;
+  void *P2 = A.Allocate(Size, 1 << 22);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(P2) % (1 << 22), 0);
+  memset(P2, 2, Size);
+  A.Deallocate(P2, false);
+  MTMalloc::Config.LargeHugeTLB = OldHugeTLB;
+  A.Deallocate(Small, false);
+}
+
+TEST(LargeAllocator, ManyChunks) {
+  MTMalloc::LargeAllocator A;
+  std::vector<std::pair<void *, size_t>> V;
+  for (size_t I = 0; I < 3000; I++) {
+    size_t Size = (300 << 10) + 4096 * (I % 7);
+    V.push_back({A.Allocate(Size), Size});
+  }
+  for (size_t I = 0; I < V.size(); I += 2)
+    A.Deallocate(V[I].first, I % 4);
+  for (size_t I = 1; I < V.size(); I += 2)
+    EXPECT_EQ(A.GetPtrChunkSize(V[I].first), V[I].second);
+  for (size_t I = 1; I < V.size(); I += 2)
+    A.Deallocate(V[I].first, false);
+  EXPECT_DEATH(A.GetPtrChunkSize(V[1].first), "");
+}
+
+TEST(LargeAllocator, ScanAndQuarantine) {
+  MTMalloc::LargeAllocator A;
+  const size_t kSize = 1 << 16;
+  // The chunks freed during a scan are released after it.
+  char *P1 = reinterpret_cast<char *>(A.Allocate(kSize));
+  char *P2 = reinterpret_cast<char *>(A.Allocate(kSize));
+  memset(P1, 1, kSize);
+  A.PrepareScan();
+  A.Deallocate(P1, true);
+  EXPECT_EQ(A.GetNumLiveChunks(), 1);  // Mu is not held.
+  EXPECT_EQ(P1[kSize - 1], 1);
+  EXPECT_EQ(A.Quarantine(P2), kSize);
+  EXPECT_EQ(A.FinishScan(), kSize);  // P2 was not scanned for.
+  EXPECT_DEATH(memset(P1, 1, 1), "");  // must be protected.
+  A.PrepareScan();
+  EXPECT_EQ(A.FinishScan(), 0);
+  // Beyond kMaxQuarantinedChunks, the chunks are released right away.
+  std::vector<void *> V;
+  for (size_t I = 0; I < 1025; I++) V.push_back(A.Allocate(4096));
+  for (void *P : V) A.Quarantine(P);
+  EXPECT_EQ(A.GetNumQuarantineOverflows(), 1);
+  A.PrepareScan();
+  EXPECT_EQ(A.FinishScan(), 0);
+}
+
+TEST(LargeChunkTable, Grow) {
+  MTMalloc::LargeChunkTable T;
+  // More chunks than the initial table can hold.
+  const size_t kNumChunks = 3 << 19, kPage = 4096;
+  for (size_t I = 1; I <= kNumChunks; I++)
+    T.Insert(I * kPage, (I % 5 + 1) * kPage);
+  EXPECT_EQ(T.Size(), kNumChunks);
+  for (size_t I = 1; I <= kNumChunks; I += 2)
+    EXPECT_EQ(T.Erase(I * kPage), (I % 5 + 1) * kPage);
+  for (size_t I = 1; I <= kNumChunks; I++)
+    EXPECT_EQ(T.Find(I * kPage), I % 2 ? 0 : (I % 5 + 1) * kPage);
+  size_t Sum = 0;
+  T.ForEach([&](uintptr_t Beg, size_t Size) {
+    EXPECT_EQ(Size, (Beg / kPage % 5 + 1) * kPage);
+    Sum += Beg / kPage;
+  });
+  EXPECT_EQ(Sum, kNumChunks / 2 * (kNumChunks / 2 + 1));
+}
+
+TEST(LargeAllocator, ResidentPages) {
+  MTMalloc::LargeAllocator A;
+  const size_t kPage = 4096;
+  char *P = reinterpret_cast<char *>(A.Allocate(64 * kPage));
+  EXPECT_TRUE(A.IsMine(P));
+  EXPECT_TRUE(A.IsMine(P + 64 * kPage - 1));
+  EXPECT_FALSE(A.IsMine(&P));
+  memset(P + 3 * kPage, 1, 3 * kPage);
+  P[10 * kPage] = 1;
+  P[63 * kPage] = 1;
+  std::vector<std::pair<size_t, size_t>> Runs;
+  A.IterateResidentPages(
+      reinterpret_cast<uintptr_t>(P), 64 * kPage,
+      [&](uintptr_t Beg, uintptr_t End) {
+        Runs.push_back({(Beg - reinterpret_cast<uintptr_t>(P)) / kPage,
+                        (End - reinterpret_cast<uintptr_t>(P)) / kPage});
+      });
+  std::vector<std::pair<size_t, size_t>> Expected = {{3, 6}, {10, 11}, {63, 64}};
+  EXPECT_EQ(Runs, Expected);
+  A.Deallocate(P, false);
+}
+
+static size_t CountMappings() {
+  size_t Res = 0;
+  if (FILE *F = fopen("/proc/self/maps", "r")) {
+    for (int C; (C = fgetc(F)) != EOF;)
+      Res += C == '\n';
+    fclose(F);
+  }
+  return Res;
+}
+
+TEST(LargeAllocator, FenceRecycling) {
+  auto OldBudget = MTMalloc::Config.LargeFenceBudget;
+  MTMalloc::Config.LargeFenceBudget = 16;  // Mb.
+  MTMalloc::LargeAllocator A;
+  size_t Size = 1 << 20;
+  std::set<void *> Seen;
+  size_t OldNumMappings = CountMappings();
+  void *Prev = nullptr;
+  bool Reused = false;
+  for (size_t I = 0; I < 1000; I++) {
+    void *P = A.Allocate(Size + 4096 * (I % 3));
+    EXPECT_TRUE(A.IsMine(P));
+    memset(P, 1, Size);
+    EXPECT_NE(P, Prev);  // The most recently fenced region is not reused.
+    Reused |= !Seen.insert(P).second;
+    A.Deallocate(P, true);
+    EXPECT_LE(A.GetFencedBytes(), 16 << 20);
+    Prev = P;
+  }
+  EXPECT_TRUE(Reused);
+  // Fenced regions are coalesced and recycled, so the VMAs don't pile up.
+  EXPECT_LT(CountMappings(), OldNumMappings + 20);
+  EXPECT_DEATH(memset(Prev, 1, 1), "");  // must be protected.
+  MTMalloc::Config.LargeFenceBudget = OldBudget;
+}
+
 TEST(Signals, NullDeref) {
   Allocator A;
   memset(&A, 0, sizeof(A));
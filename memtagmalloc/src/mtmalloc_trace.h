@@ -0,0 +1,176 @@
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+// The allocation trace format, written by mtm_trace_start() (one file per
+// thread) and read by mtm_trace_replay.
+//
+//   TraceHeader
+//   Events, until the end of the file. Each event is its TraceOp byte,
+//   followed by varints (LEB128):
+//     TimeDelta       ticks since the previous event (or since BaseTicks)
+//     kTraceMalloc:   Size, Addr
+//     kTraceCalloc:   Size (the product of the two arguments), Addr
+//     kTraceFree:     Addr
+//     kTraceRealloc:  OldAddr, Size, Addr, EndDelta
+//     kTraceMemalign: Alignment, Size, Addr
+//
+// Addresses identify the objects. Each one is stored as the zigzag encoded
+// difference from the previous address in the same file. TimeDelta is taken
+// after malloc-like calls returned and before free() started, so that the
+// per-thread logs can be merged into one causally ordered stream. A realloc
+// frees OldAddr at its start time and returns Addr EndDelta ticks later.
+// Failed allocations and free(nullptr) are not recorded.
+
+#ifndef __MTMALLOC_TRACE_H__
+#define __MTMALLOC_TRACE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace MTMalloc {
+
+static const char kTraceMagic[8] = {'M', 'T', 'M', 'T', 'R', 'A', 'C', 'E'};
+static const uint32_t kTraceVersion = 1;
+// An event is at most this large.
+static const size_t kMaxTraceEventSize = 1 + 5 * 10;
+
+enum TraceOp : uint8_t {
+  kTraceMalloc = 1,
+  kTraceCalloc,
+  kTraceFree,
+  kTraceRealloc,
+  kTraceMemalign,
+};
+
+struct TraceHeader {
+  char Magic[8];
+  uint32_t Version;
+  uint32_t Tid;
+  uint64_t Pid;
+  uint64_t BaseTicks;  // ReadCycleCounter() units, the same in all files.
+  double NsPerTick;
+};
+
+inline uint8_t *PutVarint(uint8_t *P, uint64_t V) {
+  for (; V >= 0x80; V >>= 7) *P++ = V | 0x80;
+  *P++ = V;
+  return P;
+}
+
+// Returns null if the varint runs past End.
+inline const uint8_t *GetVarint(const uint8_t *P, const uint8_t *End,
+                                uint64_t *V) {
+  *V = 0;
+  for (size_t Shift = 0; P < End && Shift < 64; Shift += 7) {
+    uint8_t B = *P++;
+    *V |= static_cast<uint64_t>(B & 0x7f) << Shift;
+    if (!(B & 0x80)) return P;
+  }
+  return nullptr;
+}
+
+inline uint64_t ZigZag(int64_t V) { return (V << 1) ^ (V >> 63); }
+inline int64_t UnZigZag(uint64_t V) { return (V >> 1) ^ -(V & 1); }
+
+struct TraceEvent {
+  TraceOp Op;
+  uint64_t Ticks;  // Absolute.
+  uint64_t EndTicks;  // Same as Ticks, except for kTraceRealloc.
+  uint64_t Size;  // Or 0 for kTraceFree.
+  uint64_t Alignment;  // Only for kTraceMemalign.
+  uintptr_t OldAddr;  // For kTraceFree and kTraceRealloc.
+  uintptr_t Addr;  // The new object, except for kTraceFree.
+};
+
+// Writes E at P (at most kMaxTraceEventSize bytes), given the time and the
+// address of the previous event, which are updated. Returns the end.
+inline uint8_t *EncodeTraceEvent(uint8_t *P, const TraceEvent &E,
+                                 uint64_t *Ticks, uintptr_t *LastAddr) {
+  auto PutTicks = [&](uint64_t T) {
+    uint64_t Delta = T > *Ticks ? T - *Ticks : 0;  // E.g. a CPU migration.
+    *Ticks += Delta;
+    P = PutVarint(P, Delta);
+  };
+  auto PutAddr = [&](uintptr_t Addr) {
+    P = PutVarint(P, ZigZag(static_cast<int64_t>(Addr - *LastAddr)));
+    *LastAddr = Addr;
+  };
+  *P++ = E.Op;
+  PutTicks(E.Ticks);
+  switch (E.Op) {
+  case kTraceMalloc:
+  case kTraceCalloc:
+    P = PutVarint(P, E.Size);
+    PutAddr(E.Addr);
+    break;
+  case kTraceFree:
+    PutAddr(E.OldAddr);
+    break;
+  case kTraceRealloc:
+    PutAddr(E.OldAddr);
+    P = PutVarint(P, E.Size);
+    PutAddr(E.Addr);
+    PutTicks(E.EndTicks);
+    break;
+  case kTraceMemalign:
+    P = PutVarint(P, E.Alignment);
+    P = PutVarint(P, E.Size);
+    PutAddr(E.Addr);
+    break;
+  }
+  return P;
+}
+
+// Decodes the events of one file (e.g. mapped into memory).
+struct TraceReader {
+  const uint8_t *P, *End;
+  uint64_t Ticks;
+  uintptr_t LastAddr = 0;
+
+  TraceReader(const TraceHeader *H, const uint8_t *End)
+      : P(reinterpret_cast<const uint8_t *>(H + 1)), End(End),
+        Ticks(H->BaseTicks) {}
+
+  bool Done() const { return P >= End; }
+
+  // Returns false at the end, or on a truncated or corrupt event.
+  bool Next(TraceEvent *E) {
+    if (P >= End) return false;
+    *E = {};
+    E->Op = static_cast<TraceOp>(*P++);
+    uint64_t Delta;
+    if (!(P = GetVarint(P, End, &Delta))) return false;
+    E->Ticks = E->EndTicks = Ticks += Delta;
+    switch (E->Op) {
+    case kTraceMalloc:
+    case kTraceCalloc:
+      return Get(&E->Size) && GetAddr(&E->Addr);
+    case kTraceFree:
+      return GetAddr(&E->OldAddr);
+    case kTraceRealloc:
+      if (!GetAddr(&E->OldAddr) || !Get(&E->Size) || !GetAddr(&E->Addr) ||
+          !Get(&Delta))
+        return false;
+      E->EndTicks = Ticks += Delta;
+      return true;
+    case kTraceMemalign:
+      return Get(&E->Alignment) && Get(&E->Size) && GetAddr(&E->Addr);
+    }
+    P = End;
+    return false;
+  }
+
+  bool Get(uint64_t *V) { return (P = GetVarint(P, End, V)) != nullptr; }
+
+  bool GetAddr(uintptr_t *Addr) {
+    uint64_t V;
+    if (!Get(&V)) return false;
+    *Addr = LastAddr += UnZigZag(V);
+    return true;
+  }
+};
+
+}  // namespace MTMalloc
+
+#endif  // __MTMALLOC_TRACE_H__
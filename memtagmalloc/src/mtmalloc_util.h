@@ -6,14 +6,25 @@
 #define __MTMALLOC_UTIL_H__
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
 namespace MTMalloc {
 #define TRAP()                              \
   do {                                      \
@@ -21,19 +32,23 @@ namespace MTMalloc {
     __builtin_trap();                       \
   } while (0)
 
-int GetTID() { return syscall(SYS_gettid); }
-int TGKill(int a, int b, int c) { return syscall(SYS_tgkill, a, b, c); }
-int GetDEnts64(unsigned int fd, char *dirp, unsigned int count) {
+inline int GetTID() { return syscall(SYS_gettid); }
+inline int TGKill(int a, int b, int c) { return syscall(SYS_tgkill, a, b, c); }
+inline int GetDEnts64(unsigned int fd, char *dirp, unsigned int count) {
   return syscall(SYS_getdents64, fd, dirp, count);
 }
+// Doesn't use fopen(), which calls malloc.
 static inline size_t GetRss() {
-  if (FILE *f = fopen("/proc/self/statm", "r")) {
-    size_t size = 0, rss = 0;
-    fscanf(f, "%zd %zd", &size, &rss);
-    fclose(f);
-    return rss << 12;  // rss is in pages.
-  }
-  return 0;
+  int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 0;
+  char buf[64];
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) return 0;
+  buf[len] = 0;
+  size_t size = 0, rss = 0;
+  sscanf(buf, "%zd %zd", &size, &rss);
+  return rss * sysconf(_SC_PAGESIZE);  // rss is in pages.
 }
 
 template <typename Callback>
@@ -68,12 +83,134 @@ void IterateTIDs(Callback CB) {
   close(fd);
 }
 
-size_t usec() {
+// Calls CB(Beg, End, Perms) for every mapping in /proc/self/maps, Perms
+// being the 4 permission characters, e.g. "rw-p". Doesn't allocate.
+// Returns 0, or an errno value if the file could not be read (then CB may
+// have been called for some of the mappings).
+template <typename Callback>
+int IterateMappings(Callback CB) {
+  int Fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (Fd < 0) return errno;
+  auto Parse = [&](char *Line) {
+    char *P;
+    uintptr_t Beg = strtoull(Line, &P, 16);
+    uintptr_t End = *P == '-' ? strtoull(P + 1, &P, 16) : 0;
+    if (*P == ' ' && strlen(P) > 4) CB(Beg, End, P + 1);
+  };
+  char Buf[4096];
+  size_t Len = 0;
+  bool SkipLine = false;  // The rest of a line that didn't fit into Buf.
+  int Err = 0;
+  while (true) {
+    ssize_t Res = read(Fd, Buf + Len, sizeof(Buf) - 1 - Len);
+    if (Res < 0 && errno == EINTR) continue;
+    if (Res <= 0) {
+      if (Res < 0) Err = errno;
+      break;
+    }
+    Len += Res;
+    Buf[Len] = 0;
+    char *Line = Buf;
+    while (char *EndOfLine = strchr(Line, '\n')) {
+      *EndOfLine = 0;
+      if (!SkipLine) Parse(Line);
+      SkipLine = false;
+      Line = EndOfLine + 1;
+    }
+    if (Line == Buf && Len == sizeof(Buf) - 1) {
+      // A very long path: the addresses and permissions are all there.
+      if (!SkipLine) Parse(Buf);
+      SkipLine = true;
+      Line = Buf + Len;
+    }
+    Len = Buf + Len - Line;
+    memmove(Buf, Line, Len);
+  }
+  close(Fd);
+  return Err;
+}
+
+struct ScopedLock {
+  ScopedLock(pthread_mutex_t &Mu, int line) : Mu(Mu) {
+    //fprintf(stderr, "Trying    %p line %d\n", &Mu, line);
+    pthread_mutex_lock(&Mu);
+    //fprintf(stderr, "Acquired  %p line %d\n", &Mu, line);
+  }
+  ~ScopedLock() {
+    //fprintf(stderr, "Releasing %p\n", &Mu);
+    pthread_mutex_unlock(&Mu);
+  }
+  pthread_mutex_t &Mu;
+};
+
+// Waits until *Addr != Val (or a spurious wakeup).
+inline void FutexWait(uint32_t *Addr, uint32_t Val) {
+  syscall(SYS_futex, Addr, FUTEX_WAIT_PRIVATE, Val, nullptr, nullptr, 0);
+}
+
+inline void FutexWake(uint32_t *Addr) {
+  syscall(SYS_futex, Addr, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+
+inline size_t usec() {
   struct timeval tv;
   gettimeofday(&tv, nullptr);
   return tv.tv_sec * 1000000UL + tv.tv_usec;
 }
 
+// Monotonic, for measuring durations.
+inline uint64_t nsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// A cheap timestamp, in ticks of CycleCounterNsPerTick() nanoseconds.
+inline uint64_t ReadCycleCounter() {
+#if defined(__x86_64__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t Res;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(Res));
+  return Res;
+#else
+  return nsec();
+#endif
+}
+
+// The point StartCycleCounterCalibration() was called at. Written once,
+// Ticks before Ns, which is 0 until then.
+struct CycleCounterCalibration {
+  uint64_t Ticks, Ns;
+};
+inline CycleCounterCalibration CycleCounterBase;
+
+// Called once, on the allocator init.
+inline void StartCycleCounterCalibration() {
+  __atomic_store_n(&CycleCounterBase.Ticks, ReadCycleCounter(),
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&CycleCounterBase.Ns, nsec(), __ATOMIC_RELEASE);
+}
+
+// On x86_64 the TSC is calibrated against CLOCK_MONOTONIC over the time
+// since StartCycleCounterCalibration(): nothing waits, and the longer the
+// process has run, the more precise. 1 before the calibration is started.
+inline double CycleCounterNsPerTick() {
+#if defined(__x86_64__)
+  uint64_t Ns0 = __atomic_load_n(&CycleCounterBase.Ns, __ATOMIC_ACQUIRE);
+  uint64_t Ticks0 = __atomic_load_n(&CycleCounterBase.Ticks, __ATOMIC_RELAXED);
+  uint64_t Ticks = ReadCycleCounter(), Ns = nsec();
+  if (!Ns0 || Ticks <= Ticks0) return 1;
+  return static_cast<double>(Ns - Ns0) / (Ticks - Ticks0);
+#elif defined(__aarch64__)
+  uint64_t Freq;
+  asm volatile("mrs %0, cntfrq_el0" : "=r"(Freq));
+  return 1e9 / Freq;
+#else
+  return 1;
+#endif
+}
+
 inline constexpr size_t MostSignificantSetBitIndex(size_t x) {
   // assert(x);
   unsigned long up = sizeof(void *) * 8 - 1 - __builtin_clzl(x);
@@ -118,6 +255,64 @@ inline size_t Log2(size_t x) {
   return LeastSignificantSetBitIndex(x);
 }
 
+// A histogram with 4 buckets per power of two, i.e. the values are known up
+// to 25%. Add() is not atomic, the callers serialize it; readers may see a
+// slightly inconsistent state.
+struct Histogram {
+  static constexpr size_t kSubBucketsLog = 2;
+  static constexpr size_t kNumBuckets = (64 - kSubBucketsLog + 1)
+                                        << kSubBucketsLog;
+  uint64_t Buckets[kNumBuckets];
+  uint64_t Count, Sum, Max;
+
+  static size_t BucketIdx(uint64_t V) {
+    if (V < (1 << kSubBucketsLog)) return V;
+    size_t Log = MostSignificantSetBitIndex(V);
+    size_t Sub = (V >> (Log - kSubBucketsLog)) & ((1 << kSubBucketsLog) - 1);
+    return ((Log - kSubBucketsLog + 1) << kSubBucketsLog) + Sub;
+  }
+
+  // The smallest value in the bucket.
+  static uint64_t BucketBegin(size_t Idx) {
+    if (Idx < (1 << kSubBucketsLog)) return Idx;
+    size_t Log = (Idx >> kSubBucketsLog) + kSubBucketsLog - 1;
+    uint64_t Sub = Idx & ((1 << kSubBucketsLog) - 1);
+    return ((1ULL << kSubBucketsLog) | Sub) << (Log - kSubBucketsLog);
+  }
+
+  void Add(uint64_t V) {
+    Buckets[BucketIdx(V)]++;
+    Count++;
+    Sum += V;
+    if (V > Max) Max = V;
+  }
+
+  // The upper bound of the bucket with the P-th percentile (0 < P <= 100).
+  uint64_t Percentile(double P) const {
+    uint64_t Rank = Count * P / 100;
+    if (Rank < 1) Rank = 1;
+    uint64_t Seen = 0;
+    for (size_t Idx = 0; Idx < kNumBuckets; Idx++) {
+      Seen += Buckets[Idx];
+      if (Seen >= Rank)
+        return Idx + 1 < kNumBuckets && BucketBegin(Idx + 1) <= Max
+                   ? BucketBegin(Idx + 1) - 1
+                   : Max;
+    }
+    return Max;
+  }
+
+  uint64_t Mean() const { return Count ? Sum / Count : 0; }
+
+  void MergeFrom(const Histogram &From) {
+    for (size_t Idx = 0; Idx < kNumBuckets; Idx++)
+      Buckets[Idx] += From.Buckets[Idx];
+    Count += From.Count;
+    Sum += From.Sum;
+    if (From.Max > Max) Max = From.Max;
+  }
+};
+
 }  // namespace MTMalloc
 
 #endif  // __MTMALLOC_UTIL_H__
@@ -0,0 +1,248 @@
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+// Runs a fixed workload with a range of MTM_QUARANTINE_SIZE and MTM_USE_TAG
+// settings and reports, for every setting, the CPU time and the peak RSS
+// (and their overhead over the run without a quarantine) and the
+// distribution of the scan pauses (from MTM_SCAN_LOG). The output is a
+// table, or CSV with -c, one line per setting: the curves to pick the
+// operating points from.
+//
+// Usage: quarantine_sweep [-q MB,...] [-t TAG,...] [-r REPEATS] [-c]
+//                         [-- COMMAND ARGS...]
+//   -q: the MTM_QUARANTINE_SIZE values (0..255, default 0,4,16,64,255);
+//       0 (no quarantine, so MTM_USE_TAG doesn't matter) is run once, as
+//       the baseline.
+//   -t: the MTM_USE_TAG values (0..2, default 0,1,2).
+//   -r: runs per setting (1..1000, default 3); the medians are reported
+//       and the pauses of all the runs are merged.
+//   COMMAND: the workload, a program linked with mtmalloc.a (e.g.
+//       mtm_trace_replay TRACE...). By default, a built-in workload: a few
+//       threads replacing random chunks of a working set, each new chunk
+//       pointing to another one.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr size_t kWorkloadThreads = 4;
+constexpr size_t kWorkloadSlots = 1 << 14;  // Per thread.
+constexpr size_t kWorkloadOps = 1 << 20;  // Per thread.
+
+// Mostly small sizes, up to 64K: 60% in [16, 64], 25% in (64, 512], 12% in
+// (512, 8K], 3% in (8K, 64K].
+size_t WorkloadSize(std::mt19937_64 &R) {
+  auto Uniform = [&](size_t Lo, size_t Hi) {
+    return std::uniform_int_distribution<size_t>(Lo, Hi)(R);
+  };
+  size_t P = Uniform(0, 99);
+  if (P < 60) return Uniform(16, 64);
+  if (P < 85) return Uniform(65, 512);
+  if (P < 97) return Uniform(513, 8 << 10);
+  return Uniform((8 << 10) + 1, 64 << 10);
+}
+
+void WorkloadThread(size_t Idx) {
+  std::mt19937_64 R(Idx + 1);
+  std::vector<void **> Slots(kWorkloadSlots);
+  auto New = [&] {
+    size_t Size = WorkloadSize(R);
+    auto *P = static_cast<void **>(malloc(Size));
+    for (size_t I = 0; I < Size; I += 4096) reinterpret_cast<char *>(P)[I] = 1;
+    P[0] = Slots[R() % kWorkloadSlots];
+    return P;
+  };
+  for (auto &S : Slots) S = New();
+  for (size_t I = 0; I < kWorkloadOps; I++) {
+    size_t Slot = R() % kWorkloadSlots;
+    free(Slots[Slot]);
+    Slots[Slot] = New();
+  }
+  for (auto S : Slots) free(S);
+}
+
+int RunWorkload() {
+  std::vector<std::thread> Threads;
+  for (size_t I = 0; I < kWorkloadThreads; I++)
+    Threads.emplace_back(WorkloadThread, I);
+  for (auto &T : Threads) T.join();
+  return 0;
+}
+
+struct Setting {
+  long QuarantineMb, UseTag;
+};
+
+struct Run {
+  double CpuSec, WallSec;
+  size_t PeakRssKb;
+};
+
+double Seconds(const timeval &T) { return T.tv_sec + T.tv_usec / 1e6; }
+
+// Runs Argv with the setting, collecting the scan pauses from the JSON lines
+// of MTM_SCAN_LOG; the other lines of its stderr are passed through.
+bool RunOnce(char **Argv, const Setting &S, Run *Res,
+             std::vector<double> *PauseUs) {
+  int Pipe[2];
+  if (pipe(Pipe)) return false;
+  timeval Beg, End;
+  gettimeofday(&Beg, nullptr);
+  pid_t Pid = fork();
+  if (Pid < 0) return false;
+  if (!Pid) {
+    setenv("MTM_QUARANTINE_SIZE", std::to_string(S.QuarantineMb).c_str(), 1);
+    setenv("MTM_USE_TAG", std::to_string(S.UseTag).c_str(), 1);
+    setenv("MTM_SCAN_LOG", "1", 1);
+    // Its stdout goes to stderr, to keep the table (or CSV) clean.
+    dup2(2, 1);
+    dup2(Pipe[1], 2);
+    close(Pipe[0]);
+    close(Pipe[1]);
+    execv(Argv[0], Argv);
+    perror(Argv[0]);
+    _exit(127);
+  }
+  close(Pipe[1]);
+  FILE *F = fdopen(Pipe[0], "r");
+  char *Line = nullptr;
+  size_t Cap = 0;
+  const char kPause[] = "\"pause_us\": ";
+  while (getline(&Line, &Cap, F) > 0) {
+    const char *P = strstr(Line, kPause);
+    if (!strncmp(Line, "{\"scan\"", 7) && P)
+      PauseUs->push_back(atof(P + sizeof(kPause) - 1));
+    else
+      fputs(Line, stderr);
+  }
+  free(Line);
+  fclose(F);
+  int Status;
+  rusage U;
+  if (wait4(Pid, &Status, 0, &U) != Pid) return false;
+  gettimeofday(&End, nullptr);
+  if (!WIFEXITED(Status) || WEXITSTATUS(Status)) {
+    fprintf(stderr, "%s failed (status %d)\n", Argv[0], Status);
+    return false;
+  }
+  Res->CpuSec = Seconds(U.ru_utime) + Seconds(U.ru_stime);
+  Res->WallSec = Seconds(End) - Seconds(Beg);
+  Res->PeakRssKb = U.ru_maxrss;
+  return true;
+}
+
+template <class T> T Median(std::vector<T> V) {
+  std::sort(V.begin(), V.end());
+  return V[V.size() / 2];
+}
+
+double Percentile(const std::vector<double> &Sorted, double P) {
+  if (Sorted.empty()) return 0;
+  size_t Idx = std::min(Sorted.size() - 1,
+                        static_cast<size_t>(P / 100 * Sorted.size()));
+  return Sorted[Idx];
+}
+
+// Returns an empty list if S is not a list of numbers in [Min, Max].
+std::vector<long> ParseList(const char *S, long Min, long Max) {
+  std::vector<long> Res;
+  for (char *End; *S; S = *End ? End + 1 : End) {
+    Res.push_back(strtol(S, &End, 10));
+    if (End == S || (*End && *End != ',') || Res.back() < Min ||
+        Res.back() > Max)
+      return {};
+  }
+  return Res;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc == 2 && !strcmp(argv[1], "-w")) return RunWorkload();
+  std::vector<long> Quarantines = {0, 4, 16, 64, 255}, Tags = {0, 1, 2};
+  size_t Repeats = 3;
+  bool Csv = false;
+  int Opt;
+  while ((Opt = getopt(argc, argv, "+q:t:r:c")) != -1) {
+    if (Opt == 'q') Quarantines = ParseList(optarg, 0, 255);
+    else if (Opt == 't') Tags = ParseList(optarg, 0, 2);
+    else if (Opt == 'r') {
+      std::vector<long> R = ParseList(optarg, 1, 1000);
+      Repeats = R.size() == 1 ? R[0] : 0;
+    }
+    else if (Opt == 'c') Csv = true;
+    else Quarantines.clear();
+  }
+  if (Quarantines.empty() || Tags.empty() || !Repeats) {
+    fprintf(stderr,
+            "Usage: %s [-q MB,...] [-t TAG,...] [-r REPEATS] [-c] "
+            "[-- COMMAND ARGS...]\n",
+            argv[0]);
+    return 1;
+  }
+  char Self[] = "/proc/self/exe", Workload[] = "-w";
+  char *DefaultArgv[] = {Self, Workload, nullptr};
+  char **Argv = optind < argc ? argv + optind : DefaultArgv;
+
+  std::vector<Setting> Settings;
+  for (long Q : Quarantines) {
+    if (!Q) Settings.insert(Settings.begin(), {0, 0});
+    else
+      for (long T : Tags) Settings.push_back({Q, T});
+  }
+  if (Csv)
+    printf("quarantine_mb,use_tag,cpu_s,cpu_overhead_pct,wall_s,peak_rss_mb,"
+           "rss_overhead_pct,scans,pause_p50_us,pause_p90_us,pause_p99_us,"
+           "pause_max_us,pause_total_ms\n");
+  else
+    printf("%8s %4s %8s %8s %8s %8s %8s %6s %9s %9s %9s %9s %9s\n", "quar_mb",
+           "tag", "cpu_s", "cpu_ovh", "wall_s", "rss_mb", "rss_ovh", "scans",
+           "p50_us", "p90_us", "p99_us", "max_us", "total_ms");
+  double BaseCpu = 0, BaseRss = 0;
+  for (const Setting &S : Settings) {
+    std::vector<double> Cpu, Wall, PauseUs;
+    std::vector<size_t> Rss;
+    for (size_t I = 0; I < Repeats; I++) {
+      Run R;
+      if (!RunOnce(Argv, S, &R, &PauseUs)) return 1;
+      Cpu.push_back(R.CpuSec);
+      Wall.push_back(R.WallSec);
+      Rss.push_back(R.PeakRssKb);
+    }
+    double CpuSec = Median(Cpu), RssMb = Median(Rss) / 1024.;
+    // The first setting is the baseline: no quarantine, if it is there.
+    if (!BaseCpu) {
+      BaseCpu = CpuSec;
+      BaseRss = RssMb;
+    }
+    std::sort(PauseUs.begin(), PauseUs.end());
+    double TotalMs = 0;
+    for (double Us : PauseUs) TotalMs += Us / 1000;
+    printf(Csv ? "%ld,%ld,%.3f,%.1f,%.3f,%.1f,%.1f,%.1f,%.0f,%.0f,%.0f,%.0f,"
+                 "%.1f\n"
+               : "%8ld %4ld %8.3f %7.1f%% %8.3f %8.1f %7.1f%% %6.1f %9.0f "
+                 "%9.0f %9.0f %9.0f %9.1f\n",
+           S.QuarantineMb, S.UseTag, CpuSec, 100 * (CpuSec / BaseCpu - 1),
+           Median(Wall), RssMb, 100 * (RssMb / BaseRss - 1),
+           static_cast<double>(PauseUs.size()) / Repeats,
+           Percentile(PauseUs, 50), Percentile(PauseUs, 90),
+           Percentile(PauseUs, 99), PauseUs.empty() ? 0 : PauseUs.back(),
+           TotalMs / Repeats);
+    fflush(stdout);
+  }
+  return 0;
+}
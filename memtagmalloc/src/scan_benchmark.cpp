@@ -0,0 +1,272 @@
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+
+// GC scan benchmarks (linked with mtmalloc.a). Every case builds a synthetic
+// heap, then, for every iteration, frees a part of it (which goes to the
+// quarantine), scans, and allocates the freed part again. The time of an
+// iteration is the scan pause (stats.last_scan_time_us); the allocation and
+// the freeing are not timed.
+//
+// The arguments of a case:
+//   * heap_mb: the heap, small chunks of log-uniform sizes in [16, 4096]
+//     bytes;
+//   * ptr_pct: the percentage of the words of every chunk that point to
+//     other chunks; the other words hold data that doesn't look like a
+//     pointer;
+//   * shape: where the pointers go: to the next chunks in allocation order
+//     (kList), to the children 2i+1 and 2i+2 (kTree), or anywhere (kRandom).
+//     The scan is one pass over the live chunks, not a graph traversal, so
+//     the shape only changes the locality of the marks;
+//   * quar_pct: the chunks freed before every scan, in percent of the heap
+//     (the rest is the live heap);
+//   * dangling_pct: the percentage of the freed chunks that are still
+//     pointed to from the live heap (i.e. stay in the quarantine); the
+//     pointers to the others are cleared before they are freed;
+//   * threads: the threads that take part in the scan: the scanning thread,
+//     plus threads-1 idle threads that scan in the SIGUSR2 handler (the
+//     memory release thread of mtmalloc scans too).
+//
+// Every case reports:
+//   * bytes_per_second: the scanned bytes (the live heap) per second of
+//     pause;
+//   * pause_ms/GB: the mean pause per GB of live heap (not reported if the
+//     live heap is empty);
+//   * pause_max_us: the longest pause;
+//   * retained_pct: the part of the freed bytes still quarantined after the
+//     scan, in percent; retained_MB: the same in MB.
+//
+// mtmalloc prints a line per scan to stderr; run with 2>/dev/null.
+
+#include <benchmark/benchmark.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "mtmalloc_interface.h"
+
+namespace {
+
+enum Shape { kList, kTree, kRandom };
+
+constexpr size_t kScansPerCase = 20;
+// The scan starts by itself above config.quarantine_size_mb (at most 255):
+// the freed part of the heap must be smaller.
+constexpr size_t kMaxQuarantineMb = 255;
+
+uint64_t Ctl(const char *Name) {
+  uint64_t V = 0;
+  mtm_ctl(Name, &V, nullptr);
+  return V;
+}
+
+// Idle threads that only scan, in the SIGUSR2 handler of mtmalloc.
+struct IdleThreads {
+  std::mutex Mu;
+  std::condition_variable Cv;
+  bool Stop = false;
+  std::vector<std::thread> Threads;
+
+  explicit IdleThreads(size_t N) {
+    for (size_t I = 0; I < N; I++)
+      Threads.emplace_back([this] {
+        std::unique_lock<std::mutex> Lock(Mu);
+        Cv.wait(Lock, [this] { return Stop; });
+      });
+  }
+  ~IdleThreads() {
+    {
+      std::lock_guard<std::mutex> Lock(Mu);
+      Stop = true;
+    }
+    Cv.notify_all();
+    for (auto &T : Threads) T.join();
+  }
+};
+
+struct Chunk {
+  uintptr_t *Ptr;
+  size_t Words;
+};
+
+struct SyntheticHeap {
+  std::vector<Chunk> Live, Freed;
+  // The words of the live chunks that point to each of the dangling chunks
+  // (Referrers[I] points to Freed[I], or is null).
+  std::vector<uintptr_t *> Referrers;
+  size_t LiveBytes = 0;
+
+  static uintptr_t *Allocate(size_t Words) {
+    auto *P = static_cast<uintptr_t *>(malloc(Words * sizeof(uintptr_t)));
+    // Small numbers: never a heap address. The slack at the end of the chunk
+    // is scanned too, and may hold old pointers.
+    for (size_t I = 0, N = malloc_usable_size(P) / sizeof(uintptr_t); I < N;
+         I++)
+      P[I] = I;
+    return P;
+  }
+
+  SyntheticHeap(size_t HeapBytes, double PtrFraction, Shape S,
+                double FreedFraction, double DanglingFraction) {
+    std::mt19937_64 R(1);
+    std::uniform_real_distribution<double> U(0, 1);
+    for (size_t Bytes = 0; Bytes < HeapBytes;) {
+      size_t Words = std::max<size_t>(2, std::exp2(U(R) * 8 + 4) / 8);
+      Chunk C = {Allocate(Words), Words};
+      Bytes += Words * sizeof(uintptr_t);
+      if (U(R) < FreedFraction) {
+        Freed.push_back(C);
+      } else {
+        Live.push_back(C);
+        LiveBytes += Words * sizeof(uintptr_t);
+      }
+    }
+    size_t N = Live.size();
+    for (size_t I = 0; I < N; I++) {
+      Chunk &C = Live[I];
+      for (size_t J = 0, K = 0; J < C.Words; J++) {
+        if (U(R) >= PtrFraction) continue;
+        size_t Target = S == kList   ? I + 1 + K
+                        : S == kTree ? 2 * I + 1 + K % 2
+                                     : R();
+        C.Ptr[J] = reinterpret_cast<uintptr_t>(Live[Target % N].Ptr);
+        K++;
+      }
+    }
+    Referrers.resize(Freed.size());
+    for (size_t I = 0; I < Freed.size(); I++) {
+      if (!N || U(R) >= DanglingFraction) continue;
+      Chunk &C = Live[R() % N];
+      Referrers[I] = &C.Ptr[R() % C.Words];
+      *Referrers[I] = reinterpret_cast<uintptr_t>(Freed[I].Ptr);
+    }
+  }
+
+  ~SyntheticHeap() {
+    for (auto &C : Live) free(C.Ptr);
+    for (auto &C : Freed) free(C.Ptr);
+  }
+
+  // Clears the pointers: this object is on the heap too, and is scanned.
+  void FreeAll() {
+    for (auto &C : Freed) {
+      free(C.Ptr);
+      C.Ptr = nullptr;
+    }
+  }
+
+  // Replaces the freed chunks with new ones; the dangling pointers now point
+  // to the new chunks, so the old ones become garbage.
+  void AllocateAgain() {
+    for (size_t I = 0; I < Freed.size(); I++) {
+      Freed[I].Ptr = Allocate(Freed[I].Words);
+      if (Referrers[I])
+        *Referrers[I] = reinterpret_cast<uintptr_t>(Freed[I].Ptr);
+    }
+  }
+};
+
+void BM_Scan(benchmark::State &State) {
+  size_t HeapBytes = State.range(0) << 20;
+  double QuarFraction = State.range(3) / 100.;
+  if (HeapBytes * QuarFraction >= (kMaxQuarantineMb << 20)) {
+    State.SkipWithError("quar_pct of heap_mb is above 255 MB");
+    return;
+  }
+  uint64_t QuarantineMb = kMaxQuarantineMb;
+  mtm_ctl("config.quarantine_size_mb", nullptr, &QuarantineMb);
+  SyntheticHeap H(HeapBytes, State.range(1) / 100.,
+                  static_cast<Shape>(State.range(2)), QuarFraction,
+                  State.range(4) / 100.);
+  IdleThreads Idle(State.range(5) - 1);
+  // Start with an empty quarantine.
+  mtm_release_memory(~0UL);
+  std::vector<double> PauseUs;
+  double Retained = 0, RetainedBytes = 0;
+  uint64_t PrevAfter = Ctl("stats.quarantined_bytes");
+  for (auto _ : State) {
+    H.FreeAll();
+    uint64_t Before = Ctl("stats.quarantined_bytes");
+    uint64_t NumScans = Ctl("stats.num_scans");
+    // Scans first, since nothing is free.
+    mtm_release_memory(~0UL);
+    if (Ctl("stats.num_scans") != NumScans + 1) {
+      State.SkipWithError("no scan, or more than one");
+      break;
+    }
+    double Us = Ctl("stats.last_scan_time_us");
+    State.SetIterationTime(Us / 1e6);
+    PauseUs.push_back(Us);
+    uint64_t After = Ctl("stats.quarantined_bytes");
+    Retained += static_cast<double>(After) /
+                std::max<uint64_t>(1, Before - std::min(Before, PrevAfter));
+    RetainedBytes += After;
+    PrevAfter = After;
+    H.AllocateAgain();
+  }
+  if (PauseUs.empty()) return;
+  double N = PauseUs.size(), MeanUs = 0;
+  for (double Us : PauseUs) MeanUs += Us / N;
+  State.SetBytesProcessed(State.iterations() * H.LiveBytes);
+  if (H.LiveBytes)
+    State.counters["pause_ms/GB"] = MeanUs / 1000 / (H.LiveBytes / 1e9);
+  State.counters["pause_max_us"] =
+      *std::max_element(PauseUs.begin(), PauseUs.end());
+  State.counters["retained_pct"] = 100 * Retained / N;
+  State.counters["retained_MB"] = RetainedBytes / N / (1 << 20);
+}
+
+// heap_mb, ptr_pct, shape, quar_pct, dangling_pct, threads.
+void HeapSizeArgs(benchmark::internal::Benchmark *B) {
+  for (int64_t HeapMb : {64, 256, 1024})
+    B->Args({HeapMb, 25, kRandom, 10, 1, 1});
+}
+
+void PointerDensityArgs(benchmark::internal::Benchmark *B) {
+  for (int64_t PtrPct : {0, 10, 50, 100})
+    B->Args({256, PtrPct, kRandom, 10, 1, 1});
+}
+
+void ShapeArgs(benchmark::internal::Benchmark *B) {
+  for (int64_t S : {kList, kTree, kRandom}) B->Args({256, 25, S, 10, 1, 1});
+}
+
+void QuarantineArgs(benchmark::internal::Benchmark *B) {
+  for (int64_t QuarPct : {1, 10, 50})
+    for (int64_t DanglingPct : {0, 10, 50})
+      B->Args({256, 25, kRandom, QuarPct, DanglingPct, 1});
+}
+
+void ThreadArgs(benchmark::internal::Benchmark *B) {
+  for (int64_t Threads : {1, 2, 4, 8, 16})
+    B->Args({256, 25, kRandom, 10, 1, Threads});
+}
+
+}  // namespace
+
+#define SCAN_BENCHMARK(CaseName, Args)                                      \
+  BENCHMARK(BM_Scan)                                                        \
+      ->Name(CaseName)                                                      \
+      ->Apply(Args)                                                         \
+      ->ArgNames({"heap_mb", "ptr_pct", "shape", "quar_pct", "dangling_pct", \
+                  "threads"})                                               \
+      ->Iterations(kScansPerCase)                                           \
+      ->UseManualTime()                                                     \
+      ->Unit(benchmark::kMillisecond)
+
+SCAN_BENCHMARK("BM_ScanHeapSize", HeapSizeArgs);
+SCAN_BENCHMARK("BM_ScanPointerDensity", PointerDensityArgs);
+SCAN_BENCHMARK("BM_ScanShape", ShapeArgs);
+SCAN_BENCHMARK("BM_ScanQuarantine", QuarantineArgs);
+SCAN_BENCHMARK("BM_ScanThreads", ThreadArgs);
+
+BENCHMARK_MAIN();
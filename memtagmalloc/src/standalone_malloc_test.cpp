@@ -2,7 +2,16 @@
 // See https://llvm.org/LICENSE.txt for license information.
 // SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
 
+#include "mtmalloc_interface.h"
+#include "mtmalloc_trace.h"
+#include <dirent.h>
+#include <malloc.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -85,6 +94,245 @@ void MemalignTest() {
   for (auto Ptr : All) free(Ptr);
 }
 
+void ReleaseTest() {
+  int Trimmed = malloc_trim(0);
+  size_t Released = mtm_release_memory(1 << 30);
+  fprintf(stderr, "ReleaseTest: trimmed %d released %zd\n", Trimmed,
+          Released);
+}
+
+// Reads a few stats, and changes the quarantine size (and changes it
+// back). The calls are kept out of assert(), which NDEBUG compiles away.
+void CtlTest() {
+  uint64_t NumScans = 0, SuperPages = 0, SuperPages0 = 0;
+  int Res = mtm_ctl("stats.num_scans", &NumScans, nullptr);
+  assert(Res == 0);
+  Res = mtm_ctl("stats.super_pages", &SuperPages, nullptr);
+  assert(Res == 0 && SuperPages > 0);
+  Res = mtm_ctl("stats.super_pages.0", &SuperPages0, nullptr);
+  assert(Res == 0);
+  Res = mtm_ctl("stats.super_pages.100000", &SuperPages0, nullptr);
+  assert(Res == ENOENT);
+  Res = mtm_ctl("stats.no_such_thing", &NumScans, nullptr);
+  assert(Res == ENOENT);
+  Res = mtm_ctl("stats.num_scans", nullptr, &NumScans);
+  assert(Res == EPERM);
+  uint64_t Old = 0, New = 300;  // Above the maximum, 255.
+  Res = mtm_ctl("config.quarantine_size_mb", &Old, &New);
+  assert(Res == EINVAL);
+  New = Old + 1;
+  Res = mtm_ctl("config.quarantine_size_mb", nullptr, &New);
+  assert(Res == 0);
+  uint64_t Now = 0;
+  Res = mtm_ctl("config.quarantine_size_mb", &Now, &Old);
+  assert(Res == 0 && Now == Old + 1);
+  (void)Res;
+  fprintf(stderr, "CtlTest: scans %zd super pages %zd\n", (size_t)NumScans,
+          (size_t)SuperPages);
+}
+
+void MallInfoTest() {
+  std::vector<void *> V;
+  for (size_t Size : {1UL, 17UL, 1000UL, 5000UL, 1UL << 20, 3UL << 20}) {
+    void *P = malloc(Size);
+    assert(malloc_usable_size(P) >= Size);
+    memset(P, 1, malloc_usable_size(P));
+    V.push_back(P);
+  }
+  assert(malloc_usable_size(nullptr) == 0);
+  struct mallinfo2 MI = mallinfo2();
+  assert(MI.hblks >= 2);
+  assert(MI.hblkhd >= (4UL << 20));
+  assert(MI.uordblks >= 6000);
+  assert(MI.arena >= MI.uordblks);
+  malloc_stats();
+  int Res = mallopt(M_MMAP_THRESHOLD, 1 << 20);
+  assert(Res == 1);
+  Res = mallopt(12345, 0);
+  assert(Res == 0);
+  char *Buf = nullptr;
+  size_t Len = 0;
+  FILE *Out = open_memstream(&Buf, &Len);
+  Res = malloc_info(0, Out);
+  fclose(Out);
+  assert(Res == 0);
+  assert(strstr(Buf, "<malloc version=") && strstr(Buf, "</malloc>"));
+  assert(strstr(Buf, "<total type=\"peak_live\""));
+  (void)Res;
+  free(Buf);
+  for (void *P : V) free(P);
+}
+
+void LatencyTest() {
+  uint64_t Rate = 1, Old = 0;
+  int Res = mtm_ctl("config.latency_sample", &Old, &Rate);
+  assert(Res == 0);
+  std::vector<void *> V;
+  for (size_t I = 0; I < 10000; I++)
+    V.push_back(malloc(I % 2 ? 64 : (1 << 20)));
+  for (void *P : V) free(P);
+  Res = mtm_ctl("config.latency_sample", nullptr, &Old);
+  assert(Res == 0);
+  uint64_t Fast = 0, Large = 0, FreeFast = 0, P99 = 0;
+  Res = mtm_ctl("stats.latency.malloc_fast_ns.count", &Fast, nullptr);
+  assert(Res == 0);
+  Res = mtm_ctl("stats.latency.malloc_large_ns.count", &Large, nullptr);
+  assert(Res == 0);
+  Res = mtm_ctl("stats.latency.free_fast_ns.count", &FreeFast, nullptr);
+  assert(Res == 0);
+  Res = mtm_ctl("stats.latency.malloc_large_ns.p99", &P99, nullptr);
+  assert(Res == 0);
+  Res = mtm_ctl("stats.latency.malloc_large_ns.p42", &P99, nullptr);
+  assert(Res == ENOENT);
+  (void)Res;
+  // Each malloc is counted in exactly one of the paths.
+  assert(Large >= 5000 && Fast >= 4000 && FreeFast >= 5000 && P99 > 0);
+  fprintf(stderr, "LatencyTest: malloc fast %zd large %zd (p99 %zdns)\n",
+          (size_t)Fast, (size_t)Large, (size_t)P99);
+}
+
+// Walks the heap while other threads keep allocating, with and without
+// stopping them.
+void IterateTest() {
+  std::vector<void *> V;
+  for (size_t Size : {10UL, 3000UL, 1UL << 20}) V.push_back(malloc(Size));
+  std::atomic<bool> Done(false);
+  std::thread T([&]() {
+    while (!Done) free(malloc(100));
+  });
+  struct Counts {
+    size_t NumChunks, NumFound, Bytes;
+    std::vector<void *> *V;
+  };
+  auto CB = [](uintptr_t Base, size_t Size, void *Arg) {
+    Counts *C = reinterpret_cast<Counts *>(Arg);
+    C->NumChunks++;
+    C->Bytes += Size;
+    for (void *P : *C->V)
+      if (reinterpret_cast<uintptr_t>(P) == Base) C->NumFound++;
+  };
+  for (int Flags : {0, MTM_ITERATE_STOP_THE_WORLD}) {
+    Counts C = {0, 0, 0, &V};
+    int Res = mtm_iterate(0, ~0UL, CB, &C, Flags);
+    assert(Res == 0 && C.NumFound == V.size() && C.Bytes >= (1 << 20));
+    (void)Res;
+    fprintf(stderr, "IterateTest: flags %d chunks %zd bytes %zd\n", Flags,
+            C.NumChunks, C.Bytes);
+  }
+  Done = true;
+  T.join();
+  for (void *P : V) free(P);
+}
+
+__attribute__((noinline)) void Leak(uintptr_t *Hidden, size_t N) {
+  for (size_t I = 0; I < N; I++)
+    Hidden[I] = ~reinterpret_cast<uintptr_t>(malloc(I ? 64 : 1 << 20));
+}
+
+// Leaks a large chunk and 99 small ones (keeping their addresses hidden)
+// while another thread keeps allocating.
+void LeakTest() {
+  std::vector<uintptr_t> Hidden(100);
+  Leak(Hidden.data(), Hidden.size());
+  std::atomic<bool> Done(false);
+  std::thread T([&]() {
+    while (!Done) free(malloc(100));
+  });
+  size_t Leaked = mtm_leak_check();
+  Done = true;
+  T.join();
+  assert(Leaked >= (1 << 20) + 90 * 64);
+  for (uintptr_t H : Hidden) free(reinterpret_cast<void *>(~H));
+}
+
+// Writes a heap snapshot to Path (to be looked at with mtm_snapshot_reader),
+// or to a temporary file if Path is null.
+void SnapshotTest(const char *Path) {
+  int Res = mtm_heap_snapshot("/no/such/dir/snapshot", 0);
+  assert(Res == ENOENT);
+  char Tmp[] = "/tmp/mtm_snapshot_XXXXXX";
+  if (!Path) {
+    close(mkstemp(Tmp));
+    Path = Tmp;
+  }
+  Res = mtm_heap_snapshot(Path, MTM_SNAPSHOT_TAGS);
+  assert(Res == 0);
+  struct stat St;
+  Res = stat(Path, &St);
+  assert(Res == 0 && St.st_size > 0);
+  (void)Res;
+  fprintf(stderr, "SnapshotTest: %s %zd bytes\n", Path, (size_t)St.st_size);
+  if (Path == Tmp) unlink(Tmp);
+}
+
+// Records a few calls on two threads, one freeing what the other allocated,
+// and decodes the trace files.
+void TraceTest() {
+  char Dir[] = "/tmp/mtm_trace_XXXXXX";
+  char *Made = mkdtemp(Dir);
+  assert(Made);
+  char Prefix[64];
+  snprintf(Prefix, sizeof(Prefix), "%s/trace", Dir);
+  int Res = mtm_trace_start(Prefix);
+  assert(Res == 0);
+  Res = mtm_trace_start(Prefix);
+  assert(Res == EBUSY);
+  (void)Made;
+  void *P = malloc(12345);
+  void *Q = nullptr;
+  std::thread T([&]() {
+    free(P);
+    Q = realloc(calloc(10, 100), 5000);
+  });
+  T.join();
+  void *A = nullptr;
+  Res = posix_memalign(&A, 256, 1000);
+  assert(Res == 0);
+  (void)Res;
+  free(Q);
+  free(A);
+  mtm_trace_stop();
+  free(malloc(54321));  // Not recorded.
+
+  using namespace MTMalloc;
+  size_t NumFiles = 0, NumEvents = 0;
+  bool Malloc = false, Free = false, Calloc = false, Realloc = false,
+       Memalign = false, Stopped = true;
+  DIR *D = opendir(Dir);
+  while (struct dirent *Ent = readdir(D)) {
+    if (Ent->d_name[0] == '.') continue;
+    char Path[PATH_MAX];
+    snprintf(Path, sizeof(Path), "%s/%s", Dir, Ent->d_name);
+    FILE *F = fopen(Path, "rb");
+    std::vector<uint8_t> Buf(1 << 20);
+    Buf.resize(fread(Buf.data(), 1, Buf.size(), F));
+    fclose(F);
+    unlink(Path);
+    NumFiles++;
+    auto *H = reinterpret_cast<const TraceHeader *>(Buf.data());
+    assert(Buf.size() >= sizeof(*H) && H->Version == kTraceVersion);
+    TraceReader R(H, Buf.data() + Buf.size());
+    TraceEvent E;
+    while (R.Next(&E)) {
+      NumEvents++;
+      Malloc |= E.Op == kTraceMalloc && E.Addr == (uintptr_t)P &&
+                E.Size == 12345;
+      Free |= E.Op == kTraceFree && E.OldAddr == (uintptr_t)P;
+      Calloc |= E.Op == kTraceCalloc && E.Size == 1000;
+      Realloc |= E.Op == kTraceRealloc && E.Addr == (uintptr_t)Q &&
+                 E.Size == 5000 && E.EndTicks >= E.Ticks;
+      Memalign |= E.Op == kTraceMemalign && E.Addr == (uintptr_t)A &&
+                  E.Alignment == 256;
+      Stopped &= E.Size != 54321;
+    }
+    assert(R.Done());
+  }
+  closedir(D);
+  rmdir(Dir);
+  fprintf(stderr, "TraceTest: %zd files %zd events\n", NumFiles, NumEvents);
+  assert(NumFiles >= 2 && Malloc && Free && Calloc && Realloc && Memalign &&
+         Stopped);
+}
 
 int main(int argc, char **argv) {
   size_t NumThreads = kMaxNumThreads;
@@ -100,4 +348,12 @@ int main(int argc, char **argv) {
     T[i]->join();
     delete T[i];
   }
+  CtlTest();
+  MallInfoTest();
+  LatencyTest();
+  IterateTest();
+  LeakTest();
+  SnapshotTest(argc >= 3 ? argv[2] : nullptr);
+  TraceTest();
+  ReleaseTest();
 }